@@ -1,70 +1,104 @@
 #include "SharedFlowDistributor.h"
 
-SharedFlowDistributor::SharedFlowDistributor(const std::string &shm_name, const int &num_of_handlers)
+SharedFlowDistributor::SharedFlowDistributor(const std::string &shm_name, const int &num_of_handlers):
+    _flow_expiration(FLOW_EXPIRATION_TICK), _next_handler(0)
 {
     _shm_flows = std::make_shared<SharedFlowAccum>(shm_name);
+    // Handlers are not started until all of them exist: they steal from each other
+    std::lock_guard<std::mutex> lock(_pool.lock);
+    for(int i = 0; i < num_of_handlers; i++) {
+        _pool.handlers.emplace_back(new SharedFlowHandler(_shm_flows, _pool, i));
+    }
+    _handler_stats.resize(num_of_handlers, { 0, 0, 0 });
+    _idle_check_ts = TimeHandler::Instance()->get_time_usecs();
 }
 
 SharedFlowDistributor::~SharedFlowDistributor()
 {
-    _idle_check_ts = TimeHandler::Instance()->get_time_usecs();
-    _flow_handlers_map_ckeck_ts = TimeHandler::Instance()->get_time_usecs();
 
 }
 
 void SharedFlowDistributor::idle()
 {
-    if((TimeHandler::Instance()->get_time_usecs() - _idle_check_ts) < IDLE_INTERVAL) {
+    removeOldFlows();
+
+    auto now = TimeHandler::Instance()->get_time_usecs();
+    if((now - _idle_check_ts) < IDLE_INTERVAL) {
         return;
     }
 
-
-    _idle_check_ts = TimeHandler::Instance()->get_time_usecs();
+    reportHandlers(now - _idle_check_ts);
+    _idle_check_ts = now;
 }
 
 void SharedFlowDistributor::handlePkts()
 {
     bool got = true;
     while(got) {
-        auto it_block = _shm_flows->get(got);
+        auto block = _shm_flows->get(got);
         if(!got) {
-            continue;;
-        }
-
-        // Read only start blocks in map.
-        // After read of start block - FlowHandler thread will read all related blocks
-        if((Block::BlockType)it_block->second.type != Block::BlockType::START_FLOW) {
             continue;
         }
 
-        auto flow_idx = FlowSeqKeyCtx::getFlowIdx(it_block->first);
-        auto it_flow_handler = _flow_handlers_map.find(flow_idx);
-        if(it_flow_handler == _flow_handlers_map.end()) {
-            if(_it_curr_flow_handler == _flow_handlers.end()) {
-                _it_curr_flow_handler = _flow_handlers.begin();
-            }
-
-            it_flow_handler = _flow_handlers_map.emplace(flow_idx, _it_curr_flow_handler).first;
-            _it_curr_flow_handler++;
+        auto flow_idx = FlowSeqKeyCtx::getFlowIdx(_shm_flows->key(block));
+        auto it_flow_task = _flow_tasks.find(flow_idx);
+        if(it_flow_task == _flow_tasks.end()) {
+            auto home = _next_handler;
+            _next_handler = (_next_handler + 1) % _pool.handlers.size();
+            it_flow_task = _flow_tasks.emplace(flow_idx, std::unique_ptr<FlowTask>(new FlowTask(flow_idx, home))).first;
+            _flow_expiration.schedule(it_flow_task->second.get(), TimeHandler::Instance()->get_time_usecs() + FLOW_EXPIRATION_INTERVAL);
         }
 
-        it_flow_handler->second->push(it_block);
+        auto task = it_flow_task->second.get();
+        bool ready;
+        {
+            std::lock_guard<std::mutex> lock(task->lock);
+            task->blocks.push_back(block);
+            // Scheduled task takes new blocks when it runs
+            ready = !task->scheduled;
+            task->scheduled = true;
+        }
+        if(ready) {
+            _pool.handlers[task->home]->schedule(task);
+        }
     }
 }
 
+bool SharedFlowDistributor::waitPkts(const TimeHandler::usecs_t & timeout)
+{
+    return _shm_flows->wait(timeout);
+}
+
 void SharedFlowDistributor::removeOldFlows()
 {
-    if((TimeHandler::Instance()->get_time_usecs() - _flow_handlers_map_ckeck_ts) < FLOW_HANDLER_EXIPATION_INTERVAL) {
-        return;
-    }
+    auto now = TimeHandler::Instance()->get_time_usecs();
+    _flow_expiration.advance(now, [this, &now](flow_timer_wheel_t::Node * node) {
+        auto task = static_cast<FlowTask *>(node);
+        bool scheduled;
+        {
+            std::lock_guard<std::mutex> lock(task->lock);
+            scheduled = task->scheduled;
+        }
+        auto expire_ts = task->update_time + FLOW_EXPIRATION_INTERVAL;
+        if(scheduled || expire_ts > now) {
+            // Flow is handled or was updated after timer was set. Check it again later
+            _flow_expiration.schedule(task, scheduled ? now + FLOW_EXPIRATION_INTERVAL : expire_ts);
+            return;
+        }
+        _flow_tasks.erase(task->idx);
+    });
+}
 
-    for(auto it_flow_handler = _flow_handlers_map.begin(); it_flow_handler != _flow_handlers_map.end();) {
-        if(it_flow_handler->second->exired(it_flow_handler->first)) {
-            it_flow_handler = _flow_handlers_map.erase(it_flow_handler);
-            continue;
+void SharedFlowDistributor::reportHandlers(const TimeHandler::usecs_t & interval)
+{
+    for(size_t i = 0; i < _pool.handlers.size(); i++) {
+        auto & handler = *_pool.handlers[i];
+        auto & prev = _handler_stats[i];
+        HandlerStat curr = { handler.busyTime(), handler.handledBlocks(), handler.steals() };
+        if(curr.blocks != prev.blocks) {
+            LOG_MESS(DEBUG_APP_EXAMPLE, "Flow handler %lu: utilisation %lu%%, %lu blocks, %lu flows stolen\n",
+                     i, (curr.busy - prev.busy) * 100 / interval, curr.blocks - prev.blocks, curr.steals - prev.steals);
         }
-        it_flow_handler++;
+        prev = curr;
     }
-
-    _flow_handlers_map_ckeck_ts = TimeHandler::Instance()->get_time_usecs();
 }
@@ -2,10 +2,12 @@
 
 #include <thread>
 #include <memory>
-#include <forward_list>
+#include <vector>
+#include <unordered_map>
 
 #include "../../src/core/Debug.h"
 #include "../../lib/libshared/SharedFlowAccum.h"
+#include "../../lib/TimerWheel.h"
 #include "SharedFlowHandler.h"
 
 class SharedFlowDistributor
@@ -16,19 +18,34 @@ public:
 
     void idle();
     void handlePkts();
+    // Sleeps until writer completes some block. Returns false on timeout.
+    bool waitPkts(const TimeHandler::usecs_t & timeout);
 private:
-    static const TimeHandler::usecs_t FLOW_HANDLER_EXIPATION_INTERVAL = 5 * 1000000;
+    static const TimeHandler::usecs_t FLOW_EXPIRATION_INTERVAL = 10 * 1000000;
     static const TimeHandler::usecs_t IDLE_INTERVAL = 1 * 1000000;
+    static const TimeHandler::usecs_t FLOW_EXPIRATION_TICK = 100 * 1000;
+
+    typedef TimerWheel<> flow_timer_wheel_t;
 
     TimeHandler::usecs_t _idle_check_ts;
     std::shared_ptr<SharedFlowAccum> _shm_flows;
 
-    std::forward_list<SharedFlowHandler> _flow_handlers;
-    std::forward_list<SharedFlowHandler>::iterator _it_curr_flow_handler;
+    // Flow tasks are bound to home handler round-robin, idle handlers steal them
+    std::unordered_map<flow_idx_t, std::unique_ptr<FlowTask>> _flow_tasks;
+    flow_timer_wheel_t _flow_expiration;
+    size_t _next_handler;
 
-    std::unordered_map<flow_idx_t, std::forward_list<SharedFlowHandler>::iterator> _flow_handlers_map;
-    TimeHandler::usecs_t _flow_handlers_map_ckeck_ts;
+    // Handler counters at previous report
+    struct HandlerStat {
+        TimeHandler::usecs_t busy;
+        uint64_t blocks;
+        uint64_t steals;
+    };
+    std::vector<HandlerStat> _handler_stats;
 
+    // Destroyed first: handlers are stopped before tasks they run
+    FlowHandlerPool _pool;
 
     void removeOldFlows();
+    void reportHandlers(const TimeHandler::usecs_t & interval);
 };
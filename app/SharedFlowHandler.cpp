@@ -1,65 +1,165 @@
 #include "SharedFlowHandler.h"
 #include "Block.h"
 
-#include <condition_variable>
+FlowHandlerPool::~FlowHandlerPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        work = false;
+    }
+    cv.notify_all();
+    handlers.clear();
+}
 
-SharedFlowHandler::SharedFlowHandler(std::shared_ptr<SharedFlowAccum> shm_accum_map): _shm_accum_map(shm_accum_map)
+SharedFlowHandler::SharedFlowHandler(std::shared_ptr<SharedFlowAccum> shm_accum_map, FlowHandlerPool & pool, const size_t & index):
+    _shm_accum_map(shm_accum_map), _pool(pool), _index(index), _busy_usecs(0), _handled_blocks(0), _steals(0)
 {
-    _thread = std::thread(&SharedFlowHandler::run);
-    _thread.detach();
+    _latency_report_ts = TimeHandler::Instance()->get_time_usecs();
+    _thread = std::thread(&SharedFlowHandler::run, this);
 }
 
 SharedFlowHandler::~SharedFlowHandler()
 {
-
+    if(_thread.joinable()) {
+        _thread.join();
+    }
 }
 
 void SharedFlowHandler::run()
 {
     while(gWork) {
-        auto it_flow_ctx = _flow_ctx_map.begin();
-        while(it_flow_ctx != _flow_ctx_map.end()) {
-            bool got;
-            auto it_flow_block = _shm_accum_map->getLowerBoundBlock(((uint64_t)it_flow_ctx->first) << 32, got);
-            while(got) {
-                // TODO handle block
-                // Insert Session.h from this
-
-                // Remove handled block
-                _shm_accum_map->erase(it_flow_block);
-                it_flow_block = _shm_accum_map->getNextBlock(it_flow_block, got);
+        {
+            std::unique_lock<std::mutex> lock(_pool.lock);
+            _pool.cv.wait_for(lock, std::chrono::microseconds(IDLE_WAIT), [this] { return _pool.ready || !_pool.work; });
+            if(!_pool.work) {
+                break;
             }
+            if(!_pool.ready) {
+                lock.unlock();
+                reportLatency();
+                continue;
+            }
+            // One of queued tasks is reserved for this handler
+            _pool.ready--;
+        }
 
-            it_flow_ctx++;
+        // Tasks are queued before they are counted, so reserved one is in some deque
+        FlowTask * task = nullptr;
+        while(!popTask(task) && !stealTask(task)) {
+            std::this_thread::yield();
         }
+
+        auto start_ts = TimeHandler::Instance()->get_time_usecs();
+        runTask(task);
+        _busy_usecs.fetch_add(TimeHandler::Instance()->get_time_usecs() - start_ts, std::memory_order_relaxed);
+
+        reportLatency();
     }
 }
 
-void SharedFlowHandler::push(SharedFlowAccum::shm_mmap_it it_block)
+void SharedFlowHandler::schedule(FlowTask * task)
 {
-    std::lock_guard<std::mutex> lock(_flow_ctx_map_lock);
-    auto flow_idx = FlowSeqKeyCtx::getFlowIdx(it_block->first);
-    auto it_flow = _flow_ctx_map.find(flow_idx);
-    if(it_flow != _flow_ctx_map.end()) {
-        return;
+    {
+        std::lock_guard<std::mutex> lock(_tasks_lock);
+        _tasks.push_back(task);
+    }
+    {
+        std::lock_guard<std::mutex> lock(_pool.lock);
+        _pool.ready++;
     }
+    // Any idle handler takes it: this one from its deque, others by stealing
+    _pool.cv.notify_one();
+}
 
-    BlockL4Wrapper block_l4(&it_block->second);
-    _flow_ctx_map.emplace(flow_idx, FlowContext(block_l4.get_isn(), it_block));
+bool SharedFlowHandler::popTask(FlowTask *& task)
+{
+    std::lock_guard<std::mutex> lock(_tasks_lock);
+    if(_tasks.empty()) {
+        return false;
+    }
+    task = _tasks.front();
+    _tasks.pop_front();
+    return true;
 }
 
-bool SharedFlowHandler::exired(const flow_idx_t &idx) const
+bool SharedFlowHandler::stealTask(FlowTask *& task)
 {
-    auto it_flow = _flow_ctx_map.find(idx);
-    if(it_flow != _flow_ctx_map.end()) {
-        return true;
+    for(size_t i = 1; i < _pool.handlers.size(); i++) {
+        auto & victim = *_pool.handlers[(_index + i) % _pool.handlers.size()];
+        std::lock_guard<std::mutex> lock(victim._tasks_lock);
+        if(!victim._tasks.empty()) {
+            // Whole flow moves: its next blocks are queued to the thief
+            task = victim._tasks.back();
+            victim._tasks.pop_back();
+            _steals.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
     }
+    return false;
+}
+
+void SharedFlowHandler::runTask(FlowTask * task)
+{
+    task->home = _index;
 
-    return (TimeHandler::Instance()->get_time_usecs() - it_flow->second.update_time) > FLOW_EXPIRATION_INVERVAL;
+    std::vector<SharedFlowAccum::block_handle_t> blocks;
+    {
+        std::lock_guard<std::mutex> lock(task->lock);
+        size_t count = task->blocks.size() < TASK_BATCH ? task->blocks.size() : TASK_BATCH;
+        blocks.assign(task->blocks.begin(), task->blocks.begin() + count);
+        task->blocks.erase(task->blocks.begin(), task->blocks.begin() + count);
+    }
+
+    for(auto & block : blocks) {
+        handleBlock(task, block);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(task->lock);
+        if(task->blocks.empty()) {
+            task->scheduled = false;
+            return;
+        }
+    }
+    // Blocks came meanwhile: task goes to the end of deque, other flows run first
+    schedule(task);
 }
 
-void SharedFlowHandler::remove(const flow_idx_t &idx)
+void SharedFlowHandler::handleBlock(FlowTask * task, const SharedFlowAccum::block_handle_t & block)
 {
-    std::lock_guard<std::mutex> lock(_flow_ctx_map_lock);
-    _flow_ctx_map.erase(idx);
+    auto block_ptr = _shm_accum_map->block(block);
+    auto key = _shm_accum_map->key(block);
+    auto now = TimeHandler::Instance()->get_time_usecs();
+    // Writer sets update timestamp when block is completed
+    _handling_latency.add(now > block_ptr->update_timestamp ? now - block_ptr->update_timestamp : 0);
+
+    if(!task->started) {
+        // Flow could start before distributor: no START_FLOW block, flow starts from this one
+        task->isn = (Block::BlockType)block_ptr->type == Block::BlockType::START_FLOW ? BlockL4Wrapper(block_ptr).get_isn() : FlowSeqKeyCtx::getSeq(key);
+        task->last_seq = task->isn;
+        task->started = true;
+    }
+    else {
+        task->last_seq = FlowSeqKeyCtx::getSeq(key);
+    }
+    task->update_time = now;
+
+    // TODO handle block
+    // Insert Session.h from this
+
+    _shm_accum_map->erase(block);
+    _handled_blocks.fetch_add(1, std::memory_order_relaxed);
+}
+
+void SharedFlowHandler::reportLatency()
+{
+    auto now = TimeHandler::Instance()->get_time_usecs();
+    if(!_handling_latency.count() || (_handling_latency.count() < LATENCY_REPORT && now - _latency_report_ts < LATENCY_REPORT_INTERVAL)) {
+        return;
+    }
+
+    LOG_MESS(DEBUG_APP_EXAMPLE, "Flow handler %lu: %lu blocks, completion to handling p50 %lu us, p99 %lu us, max %lu us\n",
+             _index, _handling_latency.count(), _handling_latency.percentile(50), _handling_latency.percentile(99), _handling_latency.max());
+    _handling_latency.reset();
+    _latency_report_ts = now;
 }
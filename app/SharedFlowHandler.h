@@ -1,44 +1,114 @@
 #pragma once
 
 #include <unordered_map>
+#include <vector>
+#include <deque>
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
 
 #include "../../lib/libshared/SharedFlowAccum.h"
+#include "../../lib/TimerWheel.h"
+#include "../../lib/LatencyStat.h"
 
 static bool gWork = true;
 
+/*
+ * Flow with its completed blocks which are not handled yet. Task is queued to at most one handler deque
+ * and runs on one handler at a time, so blocks of a flow are handled in completion order wherever it runs.
+ * Owned by distributor, which also expires it.
+ */
+struct FlowTask: public TimerWheel<>::Node {
+    FlowTask(const flow_idx_t & idx, const size_t & home): idx(idx), home(home) {
+        update_time = TimeHandler::Instance()->get_time_usecs();
+    }
+
+    flow_idx_t idx;
+    // Handler whose deque gets task when it becomes ready: the last one which ran it
+    std::atomic<size_t> home;
+    std::atomic<TimeHandler::usecs_t> update_time;
+
+    // Flow state, touched only by running handler
+    bool started = false;
+    seq_t isn = 0;
+    seq_t last_seq = 0;
+
+    // Guards blocks and scheduled
+    std::mutex lock;
+    std::vector<SharedFlowAccum::block_handle_t> blocks;
+    // Task is queued or running
+    bool scheduled = false;
+};
+
+class SharedFlowHandler;
+
+// Handlers of one distributor: idle handler waits for any ready task, takes it from own deque or steals it
+struct FlowHandlerPool {
+    ~FlowHandlerPool();
+
+    std::vector<std::unique_ptr<SharedFlowHandler>> handlers;
+    std::mutex lock;
+    std::condition_variable cv;
+    // Tasks in all deques not taken by handlers yet
+    size_t ready = 0;
+    bool work = true;
+};
+
 class SharedFlowHandler {
 public:
-    SharedFlowHandler(std::shared_ptr<SharedFlowAccum> shm_accum_map);
+    SharedFlowHandler(std::shared_ptr<SharedFlowAccum> shm_accum_map, FlowHandlerPool & pool, const size_t & index);
     ~SharedFlowHandler();
     void run();
-    void push(SharedFlowAccum::shm_mmap_it it_block);
-    bool exired(const flow_idx_t & idx) const;
-    void remove(const flow_idx_t & idx);
-private:
-    static const TimeHandler::usecs_t FLOW_EXPIRATION_INVERVAL = 10 * 1000000;
+    // Task got blocks and is not scheduled yet: queue it to this handler
+    void schedule(FlowTask * task);
 
-    struct FlowContext {
-        FlowContext(const seq_t & isn, SharedFlowAccum::shm_mmap_it it_block): isn(isn), last_seq(isn) {
-            update_time = TimeHandler::Instance()->get_time_usecs();
-        }
+    // Counters since start, read by distributor
+    TimeHandler::usecs_t busyTime() const
+    {
+        return _busy_usecs.load(std::memory_order_relaxed);
+    }
 
-        void updateLastSeq(const seq_t & new_seq) {
-            last_seq = new_seq;
-            update_time = TimeHandler::Instance()->get_time_usecs();
-        }
+    uint64_t handledBlocks() const
+    {
+        return _handled_blocks.load(std::memory_order_relaxed);
+    }
+
+    uint64_t steals() const
+    {
+        return _steals.load(std::memory_order_relaxed);
+    }
+private:
+    // Idle handler wakes up only to report latency
+    static const TimeHandler::usecs_t IDLE_WAIT = 1000000;
+    // Blocks handled at once, then task is queued again so a heavy flow doesn't hold handler
+    static const size_t TASK_BATCH = 64;
+    // Handling latency is reported every LATENCY_REPORT blocks or LATENCY_REPORT_INTERVAL
+    static const uint64_t LATENCY_REPORT = 100000;
+    static const TimeHandler::usecs_t LATENCY_REPORT_INTERVAL = 10 * 1000000;
 
-        seq_t isn;
-        seq_t last_seq;
-        TimeHandler::usecs_t update_time;
-    };
+    bool popTask(FlowTask *& task);
+    bool stealTask(FlowTask *& task);
+    void runTask(FlowTask * task);
+    void handleBlock(FlowTask * task, const SharedFlowAccum::block_handle_t & block);
+    void reportLatency();
 
     std::shared_ptr<SharedFlowAccum> _shm_accum_map;
-    typedef std::unordered_map<flow_idx_t, FlowContext> flow_ctx_map_t;
-    flow_ctx_map_t _flow_ctx_map;
-    flow_ctx_map_t::iterator _it_flow_ctx_map_current;
-    std::mutex _flow_ctx_map_lock;
+    FlowHandlerPool & _pool;
+    size_t _index;
+
+    // Ready tasks: owner takes from front, thieves from back
+    std::deque<FlowTask *> _tasks;
+    std::mutex _tasks_lock;
+
+    std::atomic<TimeHandler::usecs_t> _busy_usecs;
+    std::atomic<uint64_t> _handled_blocks;
+    std::atomic<uint64_t> _steals;
+
+    // Time from block completion by writer to its handling, µs
+    LatencyStat _handling_latency;
+    TimeHandler::usecs_t _latency_report_ts;
+
     std::thread _thread;
 
 };
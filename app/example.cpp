@@ -31,7 +31,8 @@ int main(int argc, char *argv[])
     shm_id_t id = 0;
     std::string shmem_name;
     ss_cmd cmd;
-    SharedClient sc("127.0.0.1", BASE_PORT);
+    // Local consumer: channel memory comes as descriptor and is gone with this process
+    SharedClient sc(SharedSocket::localPath());
 
     srand(time(nullptr));
     hash_t hash_upper = 100000000;
@@ -51,11 +52,16 @@ int main(int argc, char *argv[])
     LOG_MESS(DEBUG_APP_EXAMPLE, "Recv ACK in INIT ...\n");
 
     LOG_MESS(DEBUG_APP_EXAMPLE, "Send R_CHAN ...\n");
-    sc.newRChan("test", shmem_size);
+    // Consumer threads drain the channel in parallel
+    ss_chan_params params;
+    params.shm_size = shmem_size;
+    params.ring = SharedCircularBuffer::Ring::MPMC;
+    sc.newRChan("test", params);
     LOG_MESS(DEBUG_APP_EXAMPLE, "Wait ACK on R_CHAN ...\n");
     sc.waitAck(cmd);
     id = cmd.id;
     shmem_name = std::string(cmd.text);
+    int shmem_fd = sc.takeChanFd();
     LOG_MESS(DEBUG_APP_EXAMPLE, "Recv ACK on R_CHAN %lu:%s ...\n", id, shmem_name.c_str());
 
     //hash_t hash = rand() % (hash_upper - hash_lower + 1) + hash_lower;
@@ -67,15 +73,16 @@ int main(int argc, char *argv[])
     sc.waitAck(cmd);
     LOG_MESS(DEBUG_APP_EXAMPLE, "Recv ACK in BIND ...\n");
 
-    SharedCircularBuffer * io = new SharedCircularBuffer(shmem_name.c_str(), shmem_size, false);
+    SharedCircularBuffer * io = new SharedCircularBuffer(shmem_fd, shmem_name);
 
     auto shared_cycle_buff_test_run = [&io](int idx) {
         while (true) {
-            uint16_t data_len = 0;
-            auto data = (*io).pop(data_len);
-            if(data)
+            // Record is checked in place, slot is returned after that
+            SharedCircularBuffer::Record record;
+            if((*io).peek(record))
             {
-                handleData(idx, data, data_len);
+                handleData(idx, record.data, record.length);
+                (*io).release(record);
                 std::this_thread::sleep_for(std::chrono::milliseconds(30));
             } else {
                 std::this_thread::sleep_for(std::chrono::milliseconds(5));
@@ -0,0 +1,117 @@
+// Copyright: https://github.com/mikerez/mediaroom/blob/main/LICENSE
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * Fixed memory latency histogram: every power of two range is split to SUB_BUCKETS linear buckets,
+ * so percentile error is below 1/SUB_BUCKETS. Values are in any unit (cpu ticks, ns, µs).
+ */
+
+class LatencyStat
+{
+public:
+    LatencyStat()
+    {
+        reset();
+    }
+
+    void add(const uint64_t & value)
+    {
+        _buckets[bucketIndex(value)]++;
+        _count++;
+        _sum += value;
+        if(value > _max) {
+            _max = value;
+        }
+    }
+
+    void merge(const LatencyStat & other)
+    {
+        for(size_t i = 0; i < BUCKETS; i++) {
+            _buckets[i] += other._buckets[i];
+        }
+        _count += other._count;
+        _sum += other._sum;
+        if(other._max > _max) {
+            _max = other._max;
+        }
+    }
+
+    void reset()
+    {
+        memset(_buckets, 0, sizeof(_buckets));
+        _count = _sum = _max = 0;
+    }
+
+    // Upper bound of bucket containing requested percentile (0..100)
+    uint64_t percentile(const double & pct) const
+    {
+        if(!_count) {
+            return 0;
+        }
+
+        uint64_t rank = (uint64_t)(_count * pct / 100.0);
+        if(rank >= _count) {
+            rank = _count - 1;
+        }
+
+        uint64_t seen = 0;
+        for(size_t i = 0; i < BUCKETS; i++) {
+            seen += _buckets[i];
+            if(seen > rank) {
+                auto upper = bucketUpper(i);
+                return upper < _max ? upper : _max;
+            }
+        }
+        return _max;
+    }
+
+    uint64_t count() const
+    {
+        return _count;
+    }
+
+    uint64_t max() const
+    {
+        return _max;
+    }
+
+    uint64_t avg() const
+    {
+        return _count ? _sum / _count : 0;
+    }
+
+private:
+    static const size_t SUB_BITS = 3;
+    static const size_t SUB_BUCKETS = 1 << SUB_BITS;
+    static const size_t BUCKETS = 64 * SUB_BUCKETS;
+
+    uint64_t _buckets[BUCKETS];
+    uint64_t _count;
+    uint64_t _sum;
+    uint64_t _max;
+
+    static size_t bucketIndex(const uint64_t & value)
+    {
+        if(value < SUB_BUCKETS) {
+            return value;
+        }
+        size_t power = 63 - __builtin_clzll(value);
+        size_t sub = (value >> (power - SUB_BITS)) & (SUB_BUCKETS - 1);
+        return (power - SUB_BITS + 1) * SUB_BUCKETS + sub;
+    }
+
+    static uint64_t bucketUpper(const size_t & index)
+    {
+        if(index < SUB_BUCKETS) {
+            return index;
+        }
+        size_t power = index / SUB_BUCKETS + SUB_BITS - 1;
+        size_t sub = index % SUB_BUCKETS;
+        return ((uint64_t)(SUB_BUCKETS + sub + 1) << (power - SUB_BITS)) - 1;
+    }
+};
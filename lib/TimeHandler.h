@@ -60,6 +60,10 @@ public:
         return rdtsc();
     }
 
+    uint64_t ticks_to_nsecs(uint64_t cpu_ticks) const {
+        return cpu_ticks * 1000 / (timedatas[index.load()].freq / USECS_IN_SECS);
+    }
+
     void update_time()
     {
         static usecs_t prev = get_time_usecs();
@@ -0,0 +1,180 @@
+// Copyright: https://github.com/mikerez/mediaroom/blob/main/LICENSE
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "TimeHandler.h"
+
+/*
+ * Hierarchical timer wheel (Varghese & Lauck) driven by TimeHandler time.
+ *
+ * Every level has 2^SLOT_BITS slots, level N slot covers 2^(SLOT_BITS*N) ticks.
+ * Timers are intrusive nodes, so schedule/cancel are O(1) and never allocate.
+ * advance() fires expired timers and cascades upper levels down, amortised O(1) per tick.
+ * Timers beyond the wheel range are parked in the last slot of the upper level and re-cascaded.
+ */
+
+template<size_t LEVELS = 4, size_t SLOT_BITS = 8>
+class TimerWheel
+{
+public:
+    typedef TimeHandler::usecs_t usecs_t;
+
+    struct Node
+    {
+        Node() {}
+        // Node is never copied together with its links: copied owner must be scheduled again
+        Node(const Node &) {}
+        Node & operator =(const Node &) { return *this; }
+
+        bool scheduled() const
+        {
+            return prev;
+        }
+
+        usecs_t expireTs() const
+        {
+            return expire_ts;
+        }
+
+    private:
+        friend class TimerWheel;
+        Node * prev = nullptr;
+        Node * next = nullptr;
+        usecs_t expire_ts = 0;
+        uint64_t expire_tick = 0;
+    };
+
+    TimerWheel(const usecs_t & tick_usecs, const usecs_t & now = TimeHandler::Instance()->get_time_usecs()):
+        _tick_usecs(tick_usecs ? tick_usecs : 1), _curr_tick(now / _tick_usecs), _count(0)
+    {
+        for(auto & level : _slots) {
+            for(auto & slot : level) {
+                slot.prev = slot.next = &slot;
+            }
+        }
+    }
+
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel & operator =(const TimerWheel &) = delete;
+
+    void schedule(Node * node, const usecs_t & expire_ts)
+    {
+        // Rescheduled node is counted once
+        cancel(node);
+        node->expire_ts = expire_ts;
+        // Round up, so timer never fires before expire_ts
+        node->expire_tick = (expire_ts + _tick_usecs - 1) / _tick_usecs;
+        if(node->expire_tick <= _curr_tick) {
+            node->expire_tick = _curr_tick + 1;
+        }
+        link(node);
+        _count++;
+    }
+
+    void cancel(Node * node)
+    {
+        if(node->scheduled()) {
+            unlink(node);
+            _count--;
+        }
+    }
+
+    size_t size() const
+    {
+        return _count;
+    }
+
+    // Fire all timers expired up to `now`. on_expire(Node *) may schedule the node again.
+    template<typename F>
+    size_t advance(const usecs_t & now, F && on_expire)
+    {
+        size_t fired = 0;
+        uint64_t target_tick = now / _tick_usecs;
+        while(_curr_tick < target_tick) {
+            if(!_count) {
+                // Nothing to cascade or fire, jump straight to the target
+                _curr_tick = target_tick;
+                break;
+            }
+
+            _curr_tick++;
+            cascade();
+
+            Node & slot = _slots[0][_curr_tick & SLOT_MASK];
+            while(slot.next != &slot) {
+                Node * node = slot.next;
+                unlink(node);
+                _count--;
+                fired++;
+                on_expire(node);
+            }
+        }
+        return fired;
+    }
+
+private:
+    static const size_t SLOTS = 1 << SLOT_BITS;
+    static const uint64_t SLOT_MASK = SLOTS - 1;
+
+    usecs_t _tick_usecs;
+    uint64_t _curr_tick;
+    size_t _count;
+    Node _slots[LEVELS][SLOTS];
+
+    void link(Node * node)
+    {
+        uint64_t delta = node->expire_tick - _curr_tick;
+        size_t level = 0;
+        while(level < LEVELS - 1 && delta >= ((uint64_t)1 << (SLOT_BITS * (level + 1)))) {
+            level++;
+        }
+
+        uint64_t tick = node->expire_tick;
+        if(level == LEVELS - 1 && delta >= ((uint64_t)1 << (SLOT_BITS * LEVELS))) {
+            // Out of wheel range: park in the farthest slot, it will be re-linked on cascade
+            tick = _curr_tick + ((uint64_t)1 << (SLOT_BITS * LEVELS)) - 1;
+        }
+
+        Node & slot = _slots[level][(tick >> (SLOT_BITS * level)) & SLOT_MASK];
+        node->prev = slot.prev;
+        node->next = &slot;
+        slot.prev->next = node;
+        slot.prev = node;
+    }
+
+    void unlink(Node * node)
+    {
+        node->prev->next = node->next;
+        node->next->prev = node->prev;
+        node->prev = node->next = nullptr;
+    }
+
+    void cascade()
+    {
+        for(size_t level = 1; level < LEVELS; level++) {
+            if((_curr_tick >> (SLOT_BITS * (level - 1))) & SLOT_MASK) {
+                break;
+            }
+
+            Node & slot = _slots[level][(_curr_tick >> (SLOT_BITS * level)) & SLOT_MASK];
+            Node list;
+            list.prev = list.next = &list;
+            if(slot.next != &slot) {
+                // Detach whole slot at once, nodes are re-linked to lower levels
+                list.next = slot.next;
+                list.prev = slot.prev;
+                list.next->prev = &list;
+                list.prev->next = &list;
+                slot.prev = slot.next = &slot;
+            }
+            while(list.next != &list) {
+                Node * node = list.next;
+                unlink(node);
+                link(node);
+            }
+        }
+    }
+};
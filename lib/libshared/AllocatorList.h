@@ -8,6 +8,8 @@
 #include <unordered_map>
 #include <new>
 
+#include <boost/interprocess/offset_ptr.hpp>
+
 #define VIRTUAL_PAGE_SIZE_4KiB   4096
 
 template<typename TYPE>
@@ -18,18 +20,22 @@ public:
     using size_type = size_t;
     using propagate_on_container_move_assignment = std::true_type;
 
+    // Links are offsets: memory can be mapped to different addresses in every process
+    struct Entry;
+    typedef boost::interprocess::offset_ptr<Entry> entry_ptr;
+
 #pragma pack(1)
     struct Entry
     {
-        uint8_t data[sizeof(TYPE) - sizeof(Entry*)];
-        Entry * next = nullptr;
+        uint8_t data[sizeof(TYPE) - sizeof(entry_ptr)];
+        entry_ptr next = nullptr;
     };
 #pragma pack()
     struct AllocatorCtx
     {
-        Entry * _array;
-        Entry * _begin;
-        Entry * _end;
+        entry_ptr _array;
+        entry_ptr _begin;
+        entry_ptr _end;
         size_t _count;
         size_t _overall;
     };
@@ -57,6 +63,35 @@ public:
         return sizeof(AllocatorCtx);
     }
 
+    // Entries are never moved, so index is stable and can be used as a handle
+    TYPE * at(const size_t & index) const
+    {
+        auto alloc_ctx = (alloc_ctx_t *)_mem;
+        return (TYPE *)(alloc_ctx->_array.get() + index);
+    }
+
+    size_t indexOf(const TYPE * ptr) const
+    {
+        auto alloc_ctx = (alloc_ctx_t *)_mem;
+        return (const Entry *)ptr - alloc_ctx->_array.get();
+    }
+
+    size_t capacity() const
+    {
+        return ((alloc_ctx_t *)_mem)->_overall;
+    }
+
+    size_t available() const
+    {
+        return ((alloc_ctx_t *)_mem)->_count;
+    }
+
+    // Memory needed to hold `count` entries
+    static size_t memSize(const size_t & count)
+    {
+        return sizeof(AllocatorCtx) + VIRTUAL_PAGE_SIZE_4KiB + count * sizeof(TYPE);
+    }
+
     TYPE* allocate(size_t __n, const void* = 0)
     {
         return (TYPE*)get();
@@ -86,7 +121,7 @@ private:
     uint8_t* get()
     {
         auto alloc_ctx = (alloc_ctx_t *)_mem;
-        Entry * entry = alloc_ctx->_begin;
+        Entry * entry = alloc_ctx->_begin.get();
         if (!entry->next) {
             return nullptr;
         }
@@ -101,7 +136,7 @@ private:
         Entry * entry = (Entry *)ptr;
         assert(entry >= alloc_ctx->_array && entry < alloc_ctx->_array + alloc_ctx->_overall);
         entry->next = nullptr;
-        (alloc_ctx->_end)->next = entry;
+        alloc_ctx->_end->next = entry;
         alloc_ctx->_end = entry;
         ++alloc_ctx->_count;
     }
@@ -109,16 +144,18 @@ private:
     void init(uint8_t * mem, size_t size, bool create)
     {
         if(create) {
-            assert(("Size of shared memory must be grether than virtual page size 4KiB + sizeof(AllocatorCtx)!", size > VIRTUAL_PAGE_SIZE_4KiB + sizeof(AllocatorCtx)));
+            assert(size > VIRTUAL_PAGE_SIZE_4KiB + sizeof(AllocatorCtx) && "Size of shared memory must be grether than virtual page size 4KiB + sizeof(AllocatorCtx)!");
 
-            alloc_ctx_t * new_ctx = (alloc_ctx_t *)mem;
-            new_ctx->_count = new_ctx->_overall = (size - VIRTUAL_PAGE_SIZE_4KiB) / sizeof (TYPE);
+            alloc_ctx_t * new_ctx = new (mem) alloc_ctx_t();
+            // Entries start from the first page boundary after context
+            uintptr_t array_addr = ((uintptr_t)(mem + sizeof(AllocatorCtx)) + VIRTUAL_PAGE_SIZE_4KiB - 1) & ~(uintptr_t)(VIRTUAL_PAGE_SIZE_4KiB - 1);
+            new_ctx->_count = new_ctx->_overall = ((uintptr_t)(mem + size) - array_addr) / sizeof (TYPE);
 
-            new_ctx->_array = (Entry *)(mem + VIRTUAL_PAGE_SIZE_4KiB - (unsigned long long)new_ctx->_array % VIRTUAL_PAGE_SIZE_4KiB);
+            new_ctx->_array = (Entry *)array_addr;
             new_ctx->_begin = new_ctx->_array;
 
-            Entry * entry = new_ctx->_array;
-            for (; entry < new_ctx->_array + new_ctx->_count - 1; entry++) {
+            Entry * entry = new_ctx->_array.get();
+            for (; entry < new_ctx->_array.get() + new_ctx->_count - 1; entry++) {
                 entry->next = entry + 1;
             }
 
@@ -4,24 +4,41 @@
 #include <stdint.h>
 #include <cstddef>
 #include <stdio.h>
+#include <atomic>
 #include <exception>
 #include <stdexcept>
 #include <cstring>
 
+/*
+ * Single producer / single consumer ring of length-prefixed records, producer and consumer may live in different processes.
+ * head and tail are free running byte counters: head is published by producer with release after record is written,
+ * tail is published by consumer with release after record is not used anymore, each side reads the other one with acquire.
+ * Every side caches the last seen remote counter and rereads it only when the cached one says ring is full (empty),
+ * so in steady state counters cache lines are not bounced between cores on every record.
+ *
+ * Record: uint32_t length, data, padding to RECORD_ALIGN. Record never wraps: if it doesn't fit to the end of ring,
+ * WRAP_MARKER is written instead of length and record starts from the beginning.
+ */
 struct CycleBufferDescriptor {
-    volatile size_t head;
-    volatile size_t _tmp_head;  // needed for async ops
-    char cacheLineAlign[64 - sizeof(size_t)*2];
-    volatile size_t tail;
-    volatile size_t _tmp_tail;  // needed for async ops
-    char cacheLineAlign1[64 - sizeof(size_t)*2];
-    volatile size_t size;
+    static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && sizeof(size_t) == sizeof(long long), "Ring counters must be lock-free to be shared between processes");
+
+    std::atomic<size_t> head;
+    char cacheLineAlign[64 - sizeof(size_t)];
+    std::atomic<size_t> tail;
+    char cacheLineAlign1[64 - sizeof(size_t)];
+    size_t size;
 };
 
 class CycleBuffer {
 public:
+    static const size_t RECORD_HDR_SIZE = sizeof(uint32_t);
+    static const size_t RECORD_ALIGN = sizeof(uint32_t);
+    static const uint32_t WRAP_MARKER = 0xFFFFFFFF;
+    static const uintptr_t DESC_ALIGN = 64;
+
     CycleBuffer() : _desc(nullptr), _buffer(nullptr), _size(0), _freeMem(false)
     {
+        resetCache();
     }
 
     CycleBuffer(uint8_t* buffer, size_t size = 0, bool freeMem = false)
@@ -40,19 +57,19 @@ public:
     {
         _buffer = buffer;
         _freeMem = freeMem;
-        _size = size - sizeof(CycleBufferDescriptor);
-        _desc = (CycleBufferDescriptor*)(_buffer + size - sizeof(CycleBufferDescriptor));
-        _desc->_tmp_head = -1;  // flush write_begin.write_end
-        _desc->_tmp_tail = -1;  // flush read_begin.read_end
+        // Descriptor counters stay on their own cache lines whatever size of memory is (e.g. odd client shm_size)
+        _desc = (CycleBufferDescriptor*)((uintptr_t)(_buffer + size - sizeof(CycleBufferDescriptor)) & ~(uintptr_t)(DESC_ALIGN - 1));
+        _size = ((uint8_t*)_desc - _buffer) / RECORD_ALIGN * RECORD_ALIGN;
+        resetCache();
     }
 
+    // Only by creator, before producer and consumer start
     void clear()
     {
-        _desc->head = 0;
-        _desc->tail = 0;
+        _desc->head.store(0, std::memory_order_relaxed);
+        _desc->tail.store(0, std::memory_order_relaxed);
         _desc->size = _size;
-        _desc->_tmp_head = -1;
-        _desc->_tmp_tail = -1;
+        resetCache();
     }
 
     size_t size() const
@@ -60,67 +77,156 @@ public:
         return _desc->size;
     }
 
+    // Approximate, exact only when both sides are idle
     size_t length()
     {
-        return _desc->head >= _desc->tail ? _desc->head - _desc->tail : _desc->size - _desc->tail + _desc->head;
+        return _desc->head.load(std::memory_order_relaxed) - _desc->tail.load(std::memory_order_relaxed);
     }
 
     char* print(char* buffer, size_t size)
     {
-        snprintf(buffer, size, "head: %u(%d), tail: %u(%d), length: %u", (unsigned)_desc->head, (int) _desc->_tmp_head, (unsigned)_desc->tail, (int) _desc->_tmp_tail, (unsigned)length() );
+        snprintf(buffer, size, "head: %lu, tail: %lu, length: %lu", (unsigned long)_desc->head.load(), (unsigned long)_desc->tail.load(), (unsigned long)length());
         return buffer;
     }
 
-    bool write1(const uint8_t* data, uint16_t len)
+    /*
+     * Producer, zero-copy write: returns span of `len` bytes inside ring for the next record, nullptr if there is no space now
+     * or record is bigger than ring. Record is invisible for consumer until commit().
+     */
+    uint8_t * reserve(uint32_t len)
     {
-        size_t pos = _desc->head + 2;
+        size_t size = _desc->size;
+        size_t record = align(RECORD_HDR_SIZE + (size_t)len);
+        // Follows records committed without publishing
+        size_t head = _desc->head.load(std::memory_order_relaxed) + _appended;
+        size_t pos = position(head, _writeCounter, _writePos);
+        size_t contiguous = size - pos;
+        // Rest of ring is skipped if record doesn't fit there
+        size_t need = record <= contiguous ? record : contiguous + record;
+        if (need > size) {
+            return nullptr;
+        }
+        if (head + need - _cachedTail > size) {
+            _cachedTail = _desc->tail.load(std::memory_order_acquire);
+            if (head + need - _cachedTail > size) {
+                return nullptr;
+            }
+        }
 
-        if ((_desc->tail <= _desc->head && pos + len >= _desc->size && static_cast<int>(_desc->tail) <= len + 2 /*we always ask +2 even if can fit 2 in the end*/) ||
-            /*---------TxxxxxxxxxxxxxxxH---------------*/   /*++len++Txxxxxxxx...*/
-            (_desc->tail > _desc->head && pos + len >= _desc->tail))
-            /*xxxxxxxxxxxxH-----------Txxxxxxxxxxxxxxxx*/ {
-            return false;
+        if (record > contiguous) {
+            // Aligned positions: at least RECORD_HDR_SIZE bytes are left for marker
+            *(uint32_t*)(_buffer + pos) = WRAP_MARKER;
+            head += contiguous;
+            pos = 0;
         }
+        _reservedHead = head;
+        _reservedPos = pos;
+        _reservedLen = len;
+        return _buffer + pos + RECORD_HDR_SIZE;
+    }
 
-        if (_desc->head == _desc->size - 1) {
-            *(uint16_t*)(_buffer) = len;
-            pos = 2;
-        } else {
-            *(uint16_t*)(_buffer + pos - 2) = len;
-            if (pos + len >= _desc->size) {
-                pos = 0;
-            }
+    /*
+     * Completes reserved record, `len` may be less than reserved. With doPublish == false record is only appended:
+     * the next reserve() follows it, and consumer sees all appended records at once after publish().
+     */
+    void commit(uint32_t len, bool doPublish = true)
+    {
+        if (len > _reservedLen) {
+            throw std::runtime_error("CycleBuffer: committed record is bigger than reserved");
+        }
+        size_t record = align(RECORD_HDR_SIZE + (size_t)len);
+        *(uint32_t*)(_buffer + _reservedPos) = len;
+        advance(_reservedHead + record, _reservedPos + record, _writeCounter, _writePos);
+        _appended = _reservedHead + record - _desc->head.load(std::memory_order_relaxed);
+        _reservedLen = 0;
+        if (doPublish) {
+            publish();
         }
-        memcpy(_buffer + pos, data, len);
-        _desc->head = pos + len;
+    }
+
+    // Producer: makes appended records visible to consumer with one head update
+    void publish()
+    {
+        if (_appended) {
+            _desc->head.store(_desc->head.load(std::memory_order_relaxed) + _appended, std::memory_order_release);
+            _appended = 0;
+        }
+    }
+
+    // Producer. Returns false if there is no space now or record is bigger than ring.
+    bool write1(const uint8_t* data, uint32_t len)
+    {
+        auto span = reserve(len);
+        if (!span) {
+            return false;
+        }
+        memcpy(span, data, len);
+        commit(len);
         return true;
     }
 
-    const uint8_t * read1(uint16_t & len)
+    /*
+     * Consumer, zero-copy read: returns the oldest record in place, nullptr if ring is empty.
+     * Record stays valid and is returned again until release().
+     */
+    const uint8_t * peek(uint32_t & len)
     {
-        size_t pos = _desc->tail + 2;
-        // if len is written (seen by tail) this means data is completely written too
+        _readPending = 0;
+        return peekNext(len);
+    }
 
-        if ((_desc->tail <= _desc->head && pos > _desc->head) //||
-            /*---------TxxxxxxxxxxxxxxxH---------------*/
-//            (_desc->tail > _desc->head && pos > _desc->size + _desc->head)
-            /*xxxxxxxxxxxxH-----------Txxxxxxxxxxxxxxxx*/ ) {
-            return nullptr;
+    /*
+     * Consumer: returns record following already peeked ones, nullptr if there is no more.
+     * All of them are given back by one release().
+     */
+    const uint8_t * peekNext(uint32_t & len)
+    {
+        size_t counter = _desc->tail.load(std::memory_order_relaxed) + _readPending;
+        // Cached head is behind tail after attach to ring used before
+        if (_cachedHead <= counter) {
+            _cachedHead = _desc->head.load(std::memory_order_acquire);
+            if (_cachedHead == counter) {
+                return nullptr;
+            }
         }
 
-        if (_desc->tail == _desc->size - 1) {
-            len = *(uint16_t*)(_buffer);
-            pos = 2;
+        size_t size = _desc->size;
+        size_t pos = _readPending ? (_readPendingPos == size ? 0 : _readPendingPos) : position(counter, _readCounter, _readPos);
+        len = *(uint32_t*)(_buffer + pos);
+        size_t skipped = 0;
+        if (len == WRAP_MARKER) {
+            // Head is published after the record following marker, so it's already written
+            skipped = size - pos;
+            pos = 0;
+            len = *(uint32_t*)(_buffer);
         }
-        else {
-            len = *(uint16_t*)(_buffer + pos - 2);
-            if (pos + len >= _desc->size) {
-                pos = 0;
-            }
+
+        size_t record = align(RECORD_HDR_SIZE + (size_t)len);
+        _readPending += skipped + record;
+        _readPendingPos = pos + record;
+        return _buffer + pos + RECORD_HDR_SIZE;
+    }
+
+    // Gives space of peeked records back to producer
+    void release()
+    {
+        if (!_readPending) {
+            return;
         }
+        size_t tail = _desc->tail.load(std::memory_order_relaxed) + _readPending;
+        advance(tail, _readPendingPos, _readCounter, _readPos);
+        _readPending = 0;
+        _desc->tail.store(tail, std::memory_order_release);
+    }
 
-        _desc->tail = pos + len;
-        return _buffer + pos;
+    /*
+     * Consumer. Returned record stays valid until the next read1() call: its space is given back to producer only then.
+     * Returns nullptr if ring is empty.
+     */
+    const uint8_t * read1(uint32_t & len)
+    {
+        release();
+        return peek(len);
     }
 
     CycleBufferDescriptor* operator ->() {
@@ -132,4 +238,58 @@ private:
     uint8_t * _buffer;
     size_t _size;
     bool _freeMem;
+    // Local to process: producer and consumer side state
+    size_t _cachedTail;
+    size_t _cachedHead;
+    // Reserved, not committed record
+    size_t _reservedHead;
+    size_t _reservedPos;
+    uint32_t _reservedLen;
+    // Committed, not published bytes
+    size_t _appended;
+    // Peeked, not released records: their size with skipped ends of ring and position after the last one
+    size_t _readPending;
+    size_t _readPendingPos;
+    // Position in ring of own counter, so it isn't divided by size on every record
+    size_t _writeCounter;
+    size_t _writePos;
+    size_t _readCounter;
+    size_t _readPos;
+
+    static size_t align(const size_t & size)
+    {
+        return (size + RECORD_ALIGN - 1) / RECORD_ALIGN * RECORD_ALIGN;
+    }
+
+    // Known position is recalculated only if counter was moved by other instance (attach after restart)
+    size_t position(const size_t & counter, size_t & known_counter, size_t & known_pos) const
+    {
+        if (counter != known_counter) {
+            known_counter = counter;
+            known_pos = counter % _desc->size;
+        }
+        return known_pos;
+    }
+
+    void advance(const size_t & counter, const size_t & pos, size_t & known_counter, size_t & known_pos) const
+    {
+        known_counter = counter;
+        known_pos = pos == _desc->size ? 0 : pos;
+    }
+
+    void resetCache()
+    {
+        _cachedTail = 0;
+        _cachedHead = 0;
+        _reservedHead = 0;
+        _reservedPos = 0;
+        _reservedLen = 0;
+        _appended = 0;
+        _readPending = 0;
+        _readPendingPos = 0;
+        _writeCounter = 0;
+        _writePos = 0;
+        _readCounter = 0;
+        _readPos = 0;
+    }
 };
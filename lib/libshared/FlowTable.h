@@ -0,0 +1,350 @@
+// Copyright: https://github.com/mikerez/mediaroom/blob/main/LICENSE
+
+#pragma once
+
+#include <memory>
+#include <utility>
+#include <functional>
+#include <algorithm>
+#include <exception>
+#include <stdint.h>
+
+/*
+ * Chained hash table with incremental (non-blocking) resize.
+ *
+ * Table grows when load factor reaches 1 and shrinks when it drops below 1/8.
+ * Resize allocates new bucket array, every operation then initializes REHASH_STEP * INIT_PER_STEP of its buckets
+ * and after that migrates REHASH_STEP buckets from old array to new one, so there is no stop-the-world pause.
+ * Old array alone is used until new one is initialized, then lookups check both arrays.
+ * Nodes are moved between chains but never reallocated: pointers to values are stable until erase.
+ * If new array can't be allocated, table goes on with the old one and tries again later.
+ *
+ * All links are ALLOCATOR::pointer, so table can be placed to shared memory with offset_ptr based allocator.
+ */
+
+template<typename KEY, typename VALUE, typename ALLOCATOR = std::allocator<VALUE>, typename HASH = std::hash<KEY>>
+class FlowTable
+{
+public:
+    static const size_t REHASH_STEP = 4;
+    static const size_t INIT_PER_STEP = 16;
+
+    struct Node;
+    typedef typename std::pointer_traits<typename std::allocator_traits<ALLOCATOR>::pointer>::template rebind<Node> node_ptr;
+    typedef typename std::pointer_traits<node_ptr>::template rebind<node_ptr> bucket_ptr;
+
+    struct Node
+    {
+        Node(const KEY & key, const VALUE & value): key(key), value(value) { }
+
+        node_ptr next;
+        KEY key;
+        VALUE value;
+    };
+
+    struct Stats
+    {
+        size_t size;
+        size_t buckets;
+        size_t resizing_to;
+        uint64_t resizes;
+        uint64_t migrated;
+        // New bucket array couldn't be allocated
+        uint64_t failed_resizes;
+    };
+
+    FlowTable(const size_t & min_buckets, const ALLOCATOR & alloc = ALLOCATOR()):
+        _node_alloc(alloc), _bucket_alloc(alloc), _min_buckets(roundPow2(min_buckets)), _rehash_idx(NO_REHASH), _init_idx(0), _resizes(0), _migrated(0),
+        _failed_resizes(0), _resize_backoff(0)
+    {
+        allocTable(_tables[0], _min_buckets);
+        initBuckets(_tables[0], 0, _min_buckets);
+        _tables[1].buckets = nullptr;
+        _tables[1].mask = _tables[1].used = 0;
+    }
+
+    FlowTable(const FlowTable &) = delete;
+    FlowTable & operator =(const FlowTable &) = delete;
+
+    ~FlowTable()
+    {
+        clear();
+        freeTable(_tables[0]);
+        freeTable(_tables[1]);
+    }
+
+    VALUE * find(const KEY & key)
+    {
+        rehashStep(REHASH_STEP);
+        auto hash = hashKey(key);
+        for(size_t t = 0; t < (migrating() ? 2 : 1); t++) {
+            for(node_ptr node = _tables[t].buckets[hash & _tables[t].mask]; node; node = node->next) {
+                if(node->key == key) {
+                    return &node->value;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    // Returns existing value if key is already present
+    std::pair<VALUE *, bool> insert(const KEY & key, const VALUE & value)
+    {
+        auto value_ptr = find(key);
+        if(value_ptr) {
+            return { value_ptr, false };
+        }
+
+        node_ptr node = std::allocator_traits<node_alloc_t>::allocate(_node_alloc, 1);
+        new (toRaw(node)) Node(key, value);
+
+        auto & table = _tables[migrating() ? 1 : 0];
+        auto & bucket = table.buckets[hashKey(key) & table.mask];
+        node->next = bucket;
+        bucket = node;
+        table.used++;
+
+        checkResize();
+        return { &node->value, true };
+    }
+
+    bool erase(const KEY & key)
+    {
+        rehashStep(REHASH_STEP);
+        auto hash = hashKey(key);
+        for(size_t t = 0; t < (migrating() ? 2 : 1); t++) {
+            node_ptr * link = &_tables[t].buckets[hash & _tables[t].mask];
+            while(*link) {
+                node_ptr node = *link;
+                if(node->key == key) {
+                    *link = node->next;
+                    _tables[t].used--;
+                    destroyNode(node);
+                    checkResize();
+                    return true;
+                }
+                link = &node->next;
+            }
+        }
+        return false;
+    }
+
+    template<typename F>
+    void forEach(F && func)
+    {
+        for(size_t t = 0; t < (migrating() ? 2 : 1); t++) {
+            for(size_t i = 0; i <= _tables[t].mask; i++) {
+                for(node_ptr node = _tables[t].buckets[i]; node; node = node->next) {
+                    func(node->key, node->value);
+                }
+            }
+        }
+    }
+
+    void clear()
+    {
+        for(size_t t = 0; t < (migrating() ? 2 : 1); t++) {
+            for(size_t i = 0; i <= _tables[t].mask; i++) {
+                node_ptr node = _tables[t].buckets[i];
+                while(node) {
+                    node_ptr next = node->next;
+                    destroyNode(node);
+                    node = next;
+                }
+                _tables[t].buckets[i] = nullptr;
+            }
+            _tables[t].used = 0;
+        }
+    }
+
+    // Initialize up to `steps` * INIT_PER_STEP new buckets or migrate up to `steps` non-empty buckets. Returns true while resize is in progress.
+    bool rehashStep(size_t steps)
+    {
+        if(!resizing()) {
+            return false;
+        }
+        if(!migrating()) {
+            size_t end = std::min(_init_idx + steps * INIT_PER_STEP, _tables[1].mask + 1);
+            initBuckets(_tables[1], _init_idx, end);
+            _init_idx = end;
+            return true;
+        }
+
+        size_t empty_visits = steps * 10;
+        auto & from = _tables[0];
+        auto & to = _tables[1];
+        while(steps && _rehash_idx <= from.mask) {
+            node_ptr node = from.buckets[_rehash_idx];
+            if(!node) {
+                _rehash_idx++;
+                if(!--empty_visits) {
+                    break;
+                }
+                continue;
+            }
+            while(node) {
+                node_ptr next = node->next;
+                auto & bucket = to.buckets[hashKey(node->key) & to.mask];
+                node->next = bucket;
+                bucket = node;
+                from.used--;
+                to.used++;
+                _migrated++;
+                node = next;
+            }
+            from.buckets[_rehash_idx++] = nullptr;
+            steps--;
+        }
+
+        if(_rehash_idx > from.mask) {
+            freeTable(from);
+            from = to;
+            to.buckets = nullptr;
+            to.mask = to.used = 0;
+            _rehash_idx = NO_REHASH;
+            return false;
+        }
+        return true;
+    }
+
+    bool resizing() const
+    {
+        return _rehash_idx != NO_REHASH;
+    }
+
+    // New bucket array is initialized, nodes are moved to it
+    bool migrating() const
+    {
+        return resizing() && _init_idx > _tables[1].mask;
+    }
+
+    size_t size() const
+    {
+        return _tables[0].used + _tables[1].used;
+    }
+
+    Stats stats() const
+    {
+        return { size(), _tables[0].mask + 1, resizing() ? _tables[1].mask + 1 : 0, _resizes, _migrated, _failed_resizes };
+    }
+
+private:
+    typedef typename std::allocator_traits<ALLOCATOR>::template rebind_alloc<Node> node_alloc_t;
+    typedef typename std::allocator_traits<ALLOCATOR>::template rebind_alloc<node_ptr> bucket_alloc_t;
+
+    static const size_t NO_REHASH = (size_t)-1;
+
+    struct Table
+    {
+        bucket_ptr buckets;
+        size_t mask;
+        size_t used;
+    };
+
+    node_alloc_t _node_alloc;
+    bucket_alloc_t _bucket_alloc;
+    size_t _min_buckets;
+    Table _tables[2];
+    size_t _rehash_idx;
+    // New buckets below it are initialized
+    size_t _init_idx;
+    uint64_t _resizes;
+    uint64_t _migrated;
+    uint64_t _failed_resizes;
+    // Inserts and erases left before the next try to allocate new bucket array
+    size_t _resize_backoff;
+
+    template<typename PTR>
+    static auto toRaw(const PTR & ptr) -> decltype(&*ptr)
+    {
+        return &*ptr;
+    }
+
+    static size_t roundPow2(size_t size)
+    {
+        size_t pow2 = 1;
+        while(pow2 < size) {
+            pow2 <<= 1;
+        }
+        return pow2;
+    }
+
+    static uint64_t hashKey(const KEY & key)
+    {
+        // Spread identity-like std::hash of integral keys over all bits
+        uint64_t hash = HASH()(key);
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 33;
+        return hash;
+    }
+
+    // Buckets are not initialized
+    void allocTable(Table & table, const size_t & buckets)
+    {
+        table.buckets = std::allocator_traits<bucket_alloc_t>::allocate(_bucket_alloc, buckets);
+        table.mask = buckets - 1;
+        table.used = 0;
+    }
+
+    void initBuckets(Table & table, const size_t & begin, const size_t & end)
+    {
+        for(size_t i = begin; i < end; i++) {
+            new (toRaw(table.buckets + i)) node_ptr(nullptr);
+        }
+    }
+
+    void freeTable(Table & table)
+    {
+        if(table.buckets) {
+            std::allocator_traits<bucket_alloc_t>::deallocate(_bucket_alloc, table.buckets, table.mask + 1);
+            table.buckets = nullptr;
+        }
+    }
+
+    void destroyNode(node_ptr node)
+    {
+        toRaw(node)->~Node();
+        std::allocator_traits<node_alloc_t>::deallocate(_node_alloc, node, 1);
+    }
+
+    void checkResize()
+    {
+        if(resizing()) {
+            return;
+        }
+        if(_resize_backoff) {
+            _resize_backoff--;
+            return;
+        }
+
+        auto buckets = _tables[0].mask + 1;
+        auto used = _tables[0].used;
+        size_t new_buckets = 0;
+        if(used >= buckets) {
+            new_buckets = buckets * 2;
+        }
+        else if(buckets > _min_buckets && used < buckets / 8) {
+            new_buckets = roundPow2(used * 2);
+            if(new_buckets < _min_buckets) {
+                new_buckets = _min_buckets;
+            }
+        }
+
+        if(!new_buckets) {
+            return;
+        }
+        try {
+            allocTable(_tables[1], new_buckets);
+        }  catch (std::exception &e) {
+            // Memory (e.g. shared segment) is full: longer chains until some flows are gone
+            _tables[1].buckets = nullptr;
+            _failed_resizes++;
+            _resize_backoff = buckets / 8 + 1;
+            return;
+        }
+        _rehash_idx = 0;
+        _init_idx = 0;
+        _resizes++;
+    }
+};
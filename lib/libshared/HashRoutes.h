@@ -0,0 +1,192 @@
+// Copyright: https://github.com/mikerez/mediaroom/blob/main/LICENSE
+
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <stdint.h>
+
+/*
+ * Flow hash to consumer routing rules, checked in order:
+ *  exact hash;
+ *  (mask, value): hash & mask == value, e.g. N consumers take mask N-1 and values 0..N-1. Mask of low bits up to
+ *  MAX_DIRECT_MASK is looked up in direct-indexed buckets, other masks in hash map. Masks are checked in order of
+ *  their first bind;
+ *  range [lo, hi]: sorted non-overlapping ranges, the top RANGE_INDEX_BITS of hash index the first candidate range,
+ *  so lookup is O(1) when ranges split hash space evenly.
+ *
+ * VALUE must be default constructible and convertible to bool, empty value is no route (e.g. shared_ptr).
+ * Rules of one kind must not collide, bind returns false on that.
+ */
+
+template<typename VALUE>
+class HashRoutes
+{
+public:
+    static const size_t RANGE_INDEX_BITS = 8;
+    static const uint64_t MAX_DIRECT_MASK = 0xFFF;
+
+    HashRoutes(): _range_index(1 << RANGE_INDEX_BITS, 0)
+    {
+    }
+
+    bool bind(const uint64_t & hash, const VALUE & value)
+    {
+        return _exact.emplace(hash, value).second;
+    }
+
+    bool bindMask(const uint64_t & mask, const uint64_t & bits, const VALUE & value)
+    {
+        if(bits & ~mask) {
+            return false;
+        }
+
+        auto group = std::find_if(_masks.begin(), _masks.end(), [&](const MaskGroup & g) { return g.mask == mask; });
+        if(group == _masks.end()) {
+            group = _masks.insert(_masks.end(), MaskGroup());
+            group->mask = mask;
+            if(mask <= MAX_DIRECT_MASK && !(mask & (mask + 1))) {
+                group->direct.resize(mask + 1);
+            }
+        }
+
+        if(!group->direct.empty()) {
+            if(group->direct[bits]) {
+                return false;
+            }
+            group->direct[bits] = value;
+            return true;
+        }
+        return group->values.emplace(bits, value).second;
+    }
+
+    bool bindRange(const uint64_t & lo, const uint64_t & hi, const VALUE & value)
+    {
+        if(lo > hi) {
+            return false;
+        }
+
+        auto next = std::lower_bound(_ranges.begin(), _ranges.end(), lo, [](const Range & r, const uint64_t & h) { return r.hi < h; });
+        if(next != _ranges.end() && next->lo <= hi) {
+            return false;
+        }
+        _ranges.insert(next, Range{ lo, hi, value });
+        indexRanges();
+        return true;
+    }
+
+    // Removes all rules with value matching `pred`, returns number of them
+    template<typename PRED>
+    size_t eraseIf(PRED pred)
+    {
+        size_t erased = 0;
+        for(auto it = _exact.begin(); it != _exact.end(); ) {
+            if(pred(it->second)) {
+                it = _exact.erase(it);
+                erased++;
+            }
+            else {
+                it++;
+            }
+        }
+
+        for(auto & group : _masks) {
+            for(auto & value : group.direct) {
+                if(value && pred(value)) {
+                    value = VALUE();
+                    erased++;
+                }
+            }
+            for(auto it = group.values.begin(); it != group.values.end(); ) {
+                if(pred(it->second)) {
+                    it = group.values.erase(it);
+                    erased++;
+                }
+                else {
+                    it++;
+                }
+            }
+        }
+        _masks.erase(std::remove_if(_masks.begin(), _masks.end(), [](const MaskGroup & g) { return g.empty(); }), _masks.end());
+
+        auto last = std::remove_if(_ranges.begin(), _ranges.end(), [&](const Range & r) { return pred(r.value); });
+        erased += _ranges.end() - last;
+        _ranges.erase(last, _ranges.end());
+        indexRanges();
+        return erased;
+    }
+
+    // nullptr if there is no route
+    const VALUE * find(const uint64_t & hash) const
+    {
+        if(!_exact.empty()) {
+            auto it = _exact.find(hash);
+            if(it != _exact.end()) {
+                return &it->second;
+            }
+        }
+
+        for(auto & group : _masks) {
+            uint64_t bits = hash & group.mask;
+            if(!group.direct.empty()) {
+                if(group.direct[bits]) {
+                    return &group.direct[bits];
+                }
+                continue;
+            }
+            auto it = group.values.find(bits);
+            if(it != group.values.end()) {
+                return &it->second;
+            }
+        }
+
+        if(!_ranges.empty()) {
+            for(size_t i = _range_index[hash >> (64 - RANGE_INDEX_BITS)]; i < _ranges.size() && _ranges[i].lo <= hash; i++) {
+                if(hash <= _ranges[i].hi) {
+                    return &_ranges[i].value;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+private:
+    struct MaskGroup
+    {
+        uint64_t mask;
+        // Indexed by hash & mask if mask is low bits, otherwise values are used
+        std::vector<VALUE> direct;
+        std::unordered_map<uint64_t, VALUE> values;
+
+        bool empty() const
+        {
+            return values.empty() && std::none_of(direct.begin(), direct.end(), [](const VALUE & v) { return (bool)v; });
+        }
+    };
+
+    struct Range
+    {
+        uint64_t lo;
+        uint64_t hi;
+        VALUE value;
+    };
+
+    std::unordered_map<uint64_t, VALUE> _exact;
+    std::vector<MaskGroup> _masks;
+    std::vector<Range> _ranges;
+    // First range which ends in or after the bucket of top hash bits
+    std::vector<uint32_t> _range_index;
+
+    void indexRanges()
+    {
+        size_t i = 0;
+        for(size_t bucket = 0; bucket < _range_index.size(); bucket++) {
+            uint64_t start = (uint64_t)bucket << (64 - RANGE_INDEX_BITS);
+            while(i < _ranges.size() && _ranges[i].hi < start) {
+                i++;
+            }
+            _range_index[bucket] = i;
+        }
+    }
+};
@@ -0,0 +1,159 @@
+// Copyright: https://github.com/mikerez/mediaroom/blob/main/LICENSE
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <new>
+
+/*
+ * Refcounted fixed size payload chunks in external memory, shared by producer and any number of consumers
+ * in any processes. Payload is copied once to a chunk taken with refcount = number of readers, and every reader
+ * gets only small Ref through its own ring. Chunk returns to free list when the last reader releases it.
+ *
+ * Free list is a Treiber stack of chunk indexes, head has tag in high 32 bits against ABA.
+ * Chunks get to it only when released: chunks never taken are given from `fresh` watermark, so slab of any size
+ * is ready at once and its memory is touched by the first use of every chunk.
+ */
+struct PayloadSlabDescriptor {
+    static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "Free list head must be lock-free to be shared between processes");
+
+    std::atomic<uint64_t> free_head;
+    // Chunks from it on were never taken
+    std::atomic<uint32_t> fresh;
+    char cacheLineAlign[64 - sizeof(uint64_t) - sizeof(uint32_t)];
+    uint32_t chunks;
+    uint32_t chunk_size;
+};
+
+class PayloadSlab
+{
+public:
+    typedef uint32_t chunk_t;
+    static const chunk_t NO_CHUNK = 0xFFFFFFFF;
+
+    // Record of subscriber ring
+    struct Ref
+    {
+        chunk_t chunk;
+        uint32_t length;
+    };
+
+    PayloadSlab(): _desc(nullptr), _chunks(nullptr), _chunk_size(0), _count(0)
+    {
+    }
+
+    // Chunk data size is rounded up, as many chunks as fit to `size` bytes
+    void set(uint8_t * buffer, const size_t & size, const size_t & chunk_data)
+    {
+        _desc = (PayloadSlabDescriptor *)buffer;
+        _chunks = buffer + sizeof(PayloadSlabDescriptor);
+        _chunk_size = (sizeof(Chunk) + chunk_data + alignof(Chunk) - 1) / alignof(Chunk) * alignof(Chunk);
+        size_t count = (size - sizeof(PayloadSlabDescriptor)) / _chunk_size;
+        _count = count < NO_CHUNK ? count : NO_CHUNK - 1;
+    }
+
+    // Slab prepared by creator
+    void attach(uint8_t * buffer)
+    {
+        _desc = (PayloadSlabDescriptor *)buffer;
+        _chunks = buffer + sizeof(PayloadSlabDescriptor);
+        _chunk_size = _desc->chunk_size;
+        _count = _desc->chunks;
+    }
+
+    // Only by creator, before anybody uses chunks. Chunks are not touched.
+    void clear()
+    {
+        _desc->chunks = _count;
+        _desc->chunk_size = _chunk_size;
+        _desc->free_head.store(NO_CHUNK, std::memory_order_relaxed);
+        _desc->fresh.store(0, std::memory_order_relaxed);
+    }
+
+    size_t chunks() const
+    {
+        return _desc->chunks;
+    }
+
+    // Max payload size
+    size_t chunkData() const
+    {
+        return _desc->chunk_size - sizeof(Chunk);
+    }
+
+    // Chunk owned by `refs` readers, NO_CHUNK if slab is exhausted
+    chunk_t alloc(const uint32_t & refs)
+    {
+        uint64_t head = _desc->free_head.load(std::memory_order_acquire);
+        while(true) {
+            chunk_t index = (chunk_t)head;
+            if(index == NO_CHUNK) {
+                return allocFresh(refs);
+            }
+            // Next of chunk taken meanwhile by other side may be garbage, tag fails CAS then
+            chunk_t next = chunk(index)->next.load(std::memory_order_relaxed);
+            uint64_t popped = ((head >> 32) + 1) << 32 | next;
+            if(_desc->free_head.compare_exchange_weak(head, popped, std::memory_order_acquire, std::memory_order_acquire)) {
+                chunk(index)->refs.store(refs, std::memory_order_relaxed);
+                return index;
+            }
+        }
+    }
+
+    uint8_t * data(const chunk_t & index) const
+    {
+        return (uint8_t *)(chunk(index) + 1);
+    }
+
+    // Reader is done with chunk, the last one gives it back to free list
+    void release(const chunk_t & index, const uint32_t & refs = 1)
+    {
+        Chunk * c = chunk(index);
+        if(c->refs.fetch_sub(refs, std::memory_order_acq_rel) != refs) {
+            return;
+        }
+
+        uint64_t head = _desc->free_head.load(std::memory_order_relaxed);
+        while(true) {
+            c->next.store((chunk_t)head, std::memory_order_relaxed);
+            uint64_t pushed = ((head >> 32) + 1) << 32 | index;
+            if(_desc->free_head.compare_exchange_weak(head, pushed, std::memory_order_release, std::memory_order_relaxed)) {
+                return;
+            }
+        }
+    }
+
+private:
+    struct Chunk
+    {
+        std::atomic<uint32_t> refs;
+        std::atomic<chunk_t> next;
+    };
+
+    PayloadSlabDescriptor * _desc;
+    uint8_t * _chunks;
+    size_t _chunk_size;
+    chunk_t _count;
+
+    Chunk * chunk(const chunk_t & index) const
+    {
+        return (Chunk *)(_chunks + (size_t)index * _chunk_size);
+    }
+
+    // Free list is empty: chunk which was never taken, NO_CHUNK if all of them were
+    chunk_t allocFresh(const uint32_t & refs)
+    {
+        chunk_t index = _desc->fresh.load(std::memory_order_relaxed);
+        while(index < _count) {
+            if(_desc->fresh.compare_exchange_weak(index, index + 1, std::memory_order_relaxed, std::memory_order_relaxed)) {
+                Chunk * c = chunk(index);
+                new (&c->refs) std::atomic<uint32_t>(refs);
+                new (&c->next) std::atomic<chunk_t>(NO_CHUNK);
+                return index;
+            }
+        }
+        return NO_CHUNK;
+    }
+};
@@ -0,0 +1,144 @@
+// Copyright: https://github.com/mikerez/mediaroom/blob/main/LICENSE
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * Many small messages packed into one ring record (frame), so ring position and its cache line are updated once per frame:
+ *
+ *   [message 0][message 1]...[message n-1][end n-1]...[end 1][end 0][n]
+ *
+ * end i and n are uint16_t, end i is offset of the end of message i from frame start, so frame is at most MAX_FRAME_SIZE.
+ * Producer builds frame in place in reserved ring span: messages from the front, index from the back of span, and
+ * finish() moves index right after the messages. Consumer iterates frame in place, messages aren't aligned.
+ */
+class FrameBuilder
+{
+public:
+    static const size_t MAX_FRAME_SIZE = 0xFFFF;
+    static const size_t INDEX_ENTRY = sizeof(uint16_t);
+
+    FrameBuilder(): _frame(nullptr), _capacity(0), _size(0), _count(0)
+    {
+    }
+
+    // `capacity` bytes of `frame`, at most MAX_FRAME_SIZE
+    void start(uint8_t * frame, const size_t & capacity)
+    {
+        _frame = frame;
+        _capacity = capacity;
+        _size = 0;
+        _count = 0;
+    }
+
+    bool started() const
+    {
+        return _frame != nullptr;
+    }
+
+    size_t count() const
+    {
+        return _count;
+    }
+
+    // Frame with one message of `length` bytes
+    static size_t frameSize(const size_t & length)
+    {
+        return length + 2 * INDEX_ENTRY;
+    }
+
+    // False if message with its index entry doesn't fit to the rest of frame
+    bool add(const uint8_t * message, const size_t & length)
+    {
+        if(_size + length + (_count + 2) * INDEX_ENTRY > _capacity) {
+            return false;
+        }
+        if(length) {
+            memcpy(_frame + _size, message, length);
+        }
+        _size += length;
+        _count++;
+        uint16_t end = _size;
+        memcpy(_frame + _capacity - (_count + 1) * INDEX_ENTRY, &end, INDEX_ENTRY);
+        return true;
+    }
+
+    // Writes index after messages, returns frame size. Builder is empty after it.
+    size_t finish()
+    {
+        size_t index = _count * INDEX_ENTRY;
+        memmove(_frame + _size, _frame + _capacity - INDEX_ENTRY - index, index);
+        uint16_t count = _count;
+        memcpy(_frame + _size + index, &count, INDEX_ENTRY);
+        size_t size = _size + index + INDEX_ENTRY;
+        _frame = nullptr;
+        return size;
+    }
+
+private:
+    uint8_t * _frame;
+    size_t _capacity;
+    size_t _size;
+    size_t _count;
+};
+
+class FrameReader
+{
+public:
+    // Frame is checked, broken one has no messages
+    FrameReader(const uint8_t * frame, const size_t & size): _frame(frame), _footer(nullptr), _count(0), _next(0), _begin(0), _limit(0)
+    {
+        if(size < FrameBuilder::INDEX_ENTRY || size > FrameBuilder::MAX_FRAME_SIZE) {
+            return;
+        }
+        _footer = frame + size - FrameBuilder::INDEX_ENTRY;
+        uint16_t count;
+        memcpy(&count, _footer, FrameBuilder::INDEX_ENTRY);
+        if((count + 1) * FrameBuilder::INDEX_ENTRY > size) {
+            return;
+        }
+        _count = count;
+        _limit = size - (count + 1) * FrameBuilder::INDEX_ENTRY;
+    }
+
+    size_t count() const
+    {
+        return _count;
+    }
+
+    // Messages in order, false after the last one or at broken index entry
+    bool next(const uint8_t *& message, uint32_t & length)
+    {
+        if(_next >= _count) {
+            return false;
+        }
+        size_t message_end = end(_next++);
+        if(message_end < _begin || message_end > _limit) {
+            _count = 0;
+            return false;
+        }
+        message = _frame + _begin;
+        length = message_end - _begin;
+        _begin = message_end;
+        return true;
+    }
+
+private:
+    const uint8_t * _frame;
+    const uint8_t * _footer;
+    size_t _count;
+    size_t _next;
+    size_t _begin;
+    // End of messages
+    size_t _limit;
+
+    size_t end(const size_t & i) const
+    {
+        uint16_t offset;
+        memcpy(&offset, _footer - (i + 1) * FrameBuilder::INDEX_ENTRY, FrameBuilder::INDEX_ENTRY);
+        return offset;
+    }
+};
@@ -0,0 +1,80 @@
+// Copyright: https://github.com/mikerez/mediaroom/blob/main/LICENSE
+
+#pragma once
+
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string>
+#include <stdexcept>
+
+/*
+ * Process shared mutex placed in shared memory which survives death of its owner: the next locker gets it
+ * with EOWNERDEAD and makes it consistent, so process restarted after crash inside critical section doesn't hang.
+ * Data protected by mutex is taken as the dead owner left it.
+ */
+class RobustMutex
+{
+public:
+    RobustMutex(): _owner_died(0)
+    {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        int rc = pthread_mutex_init(&_mutex, &attr);
+        pthread_mutexattr_destroy(&attr);
+        if(rc) {
+            throw std::runtime_error("RobustMutex: init failed: " + std::to_string(rc));
+        }
+    }
+
+    ~RobustMutex()
+    {
+        pthread_mutex_destroy(&_mutex);
+    }
+
+    RobustMutex(const RobustMutex &) = delete;
+    RobustMutex & operator =(const RobustMutex &) = delete;
+
+    void lock()
+    {
+        recover(pthread_mutex_lock(&_mutex));
+    }
+
+    bool try_lock()
+    {
+        int rc = pthread_mutex_trylock(&_mutex);
+        if(rc == EBUSY) {
+            return false;
+        }
+        recover(rc);
+        return true;
+    }
+
+    void unlock()
+    {
+        pthread_mutex_unlock(&_mutex);
+    }
+
+    // Times the owner died holding mutex
+    uint32_t ownerDied() const
+    {
+        return _owner_died;
+    }
+
+private:
+    pthread_mutex_t _mutex;
+    uint32_t _owner_died;
+
+    void recover(const int & rc)
+    {
+        if(rc == EOWNERDEAD) {
+            pthread_mutex_consistent(&_mutex);
+            _owner_died++;
+        }
+        else if(rc) {
+            throw std::runtime_error("RobustMutex: lock failed: " + std::to_string(rc));
+        }
+    }
+};
@@ -0,0 +1,198 @@
+// Copyright: https://github.com/mikerez/mediaroom/blob/main/LICENSE
+
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <stdexcept>
+#include <vector>
+#include <stdint.h>
+
+/*
+ * Read-mostly table (any copyable TABLE, e.g. map) with copy-on-write snapshots protected by epochs (RCU like).
+ *
+ * Readers look up in the current immutable snapshot inside Reader section. Section costs two plain stores to own
+ * epoch slot and one fence, no read-modify-write on shared data. Writers (serialized by mutex) copy snapshot,
+ * change the copy, publish it and free the old one after grace period: when every reader section which
+ * could see it is finished. So values (e.g. shared_ptr) live at least until readers of old snapshot are gone.
+ *
+ * Every reader thread takes one of MAX_READERS epoch slots on its first section, index is shared by tables of one type.
+ * Thread gives its index back when it exits, so MAX_READERS limits only readers running at the same time.
+ */
+
+template<typename TABLE>
+class RouteTable
+{
+    struct Slot;
+
+public:
+    typedef TABLE table_t;
+    static const size_t MAX_READERS = 64;
+
+    // Read section, snapshot and its values are valid while it exists. Sections may be nested.
+    class Reader
+    {
+    public:
+        Reader(const RouteTable & table): _slot(table.slot())
+        {
+            if(!_slot.depth++) {
+                _slot.epoch.store(table._epoch.load(std::memory_order_acquire), std::memory_order_relaxed);
+                // Orders own epoch before snapshot load against writer's publish before epochs scan
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+            }
+            _table = table._table.load(std::memory_order_acquire);
+        }
+
+        ~Reader()
+        {
+            if(!--_slot.depth) {
+                _slot.epoch.store(0, std::memory_order_release);
+            }
+        }
+
+        Reader(const Reader &) = delete;
+        Reader & operator =(const Reader &) = delete;
+
+        const table_t & operator *() const
+        {
+            return *_table;
+        }
+
+        const table_t * operator ->() const
+        {
+            return _table;
+        }
+
+    private:
+        Slot & _slot;
+        const table_t * _table;
+    };
+
+    RouteTable(): _table(new table_t()), _epoch(1)
+    {
+        for(auto & slot : _slots) {
+            slot.epoch.store(0, std::memory_order_relaxed);
+            slot.depth = 0;
+        }
+    }
+
+    ~RouteTable()
+    {
+        delete _table.load();
+    }
+
+    RouteTable(const RouteTable &) = delete;
+    RouteTable & operator =(const RouteTable &) = delete;
+
+    /*
+     * `change` gets copy of current table and returns true to publish it. Waits for grace period,
+     * so must not be called inside Reader section of the same thread.
+     */
+    template<typename CHANGE>
+    bool update(CHANGE change)
+    {
+        std::lock_guard<std::mutex> lock(_write_mutex);
+        const table_t * old = _table.load(std::memory_order_relaxed);
+        table_t * next = new table_t(*old);
+        if(!change(*next)) {
+            delete next;
+            return false;
+        }
+
+        _table.store(next, std::memory_order_release);
+        uint64_t epoch = _epoch.load(std::memory_order_relaxed) + 1;
+        _epoch.store(epoch, std::memory_order_release);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        synchronize(epoch);
+        delete old;
+        return true;
+    }
+
+private:
+    struct Slot
+    {
+        // Epoch seen at section start, 0 is outside of section
+        std::atomic<uint64_t> epoch;
+        // Touched by owner thread only
+        size_t depth;
+        char cacheLineAlign[64 - sizeof(uint64_t) - sizeof(size_t)];
+    };
+
+    std::atomic<const table_t *> _table;
+    char cacheLineAlign[64 - sizeof(void *)];
+    std::atomic<uint64_t> _epoch;
+    char cacheLineAlign1[64 - sizeof(uint64_t)];
+    mutable Slot _slots[MAX_READERS];
+    std::mutex _write_mutex;
+
+    // Reader indexes of table type, indexes of exited threads are taken first
+    struct Indexes
+    {
+        std::mutex mutex;
+        std::vector<size_t> free;
+        size_t next = 0;
+    };
+
+    static Indexes & indexes()
+    {
+        static Indexes indexes;
+        return indexes;
+    }
+
+    // Reader index of thread, returned when the thread exits: it is outside of sections then, its slots are idle
+    class ReaderIndex
+    {
+    public:
+        ReaderIndex()
+        {
+            auto & all = indexes();
+            std::lock_guard<std::mutex> lock(all.mutex);
+            if(!all.free.empty()) {
+                index = all.free.back();
+                all.free.pop_back();
+            }
+            else if(all.next < MAX_READERS) {
+                index = all.next++;
+            }
+            else {
+                throw std::runtime_error("RouteTable: too many reader threads");
+            }
+        }
+
+        ~ReaderIndex()
+        {
+            auto & all = indexes();
+            std::lock_guard<std::mutex> lock(all.mutex);
+            all.free.push_back(index);
+        }
+
+        size_t index;
+    };
+
+    // Reader index of calling thread
+    static size_t readerIndex()
+    {
+        thread_local ReaderIndex reader;
+        return reader.index;
+    }
+
+    Slot & slot() const
+    {
+        return _slots[readerIndex()];
+    }
+
+    // Readers which started before `epoch` could see old snapshot
+    void synchronize(const uint64_t & epoch) const
+    {
+        for(auto & slot : _slots) {
+            while(true) {
+                uint64_t seen = slot.epoch.load(std::memory_order_acquire);
+                if(!seen || seen >= epoch) {
+                    break;
+                }
+                std::this_thread::yield();
+            }
+        }
+    }
+};
@@ -0,0 +1,586 @@
+// Copyright: https://github.com/mikerez/mediaroom/blob/main/LICENSE
+
+#pragma once
+
+#include <stdint.h>
+#include <new>
+
+#include <boost/interprocess/managed_shared_memory.hpp>
+#include <boost/interprocess/offset_ptr.hpp>
+
+#include "AllocatorList.h"
+#include "../libstack/Block.h"
+
+using namespace boost::interprocess;
+
+/*
+ * Open addressing hash index with linear probing, placed in shared memory.
+ * Capacity is fixed, erase uses backward shift (no tombstones), so probe chains never degrade.
+ * Duplicate keys are allowed: erase/find select exact entry by value predicate.
+ */
+template<typename KEY, typename VALUE>
+class SharedOpenIndex
+{
+public:
+    struct Slot
+    {
+        KEY key;
+        VALUE value;
+        bool used;
+    };
+
+    SharedOpenIndex(managed_shared_memory::segment_manager * segment_manager, const size_t & min_capacity): _size(0)
+    {
+        size_t capacity = 1;
+        while(capacity < min_capacity) {
+            capacity <<= 1;
+        }
+        _mask = capacity - 1;
+        _slots = static_cast<Slot *>(segment_manager->allocate(capacity * sizeof(Slot)));
+        for(size_t i = 0; i < capacity; i++) {
+            _slots[i].used = false;
+        }
+    }
+
+    template<typename PRED>
+    VALUE * find(const KEY & key, PRED && pred) const
+    {
+        for(size_t i = home(key); _slots[i].used; i = (i + 1) & _mask) {
+            if(_slots[i].key == key && pred(_slots[i].value)) {
+                return &_slots[i].value;
+            }
+        }
+        return nullptr;
+    }
+
+    VALUE * find(const KEY & key) const
+    {
+        return find(key, [](const VALUE &) { return true; });
+    }
+
+    // Index is sized by owner to never be full
+    VALUE * insert(const KEY & key, const VALUE & value)
+    {
+        size_t i = home(key);
+        while(_slots[i].used) {
+            i = (i + 1) & _mask;
+        }
+        _slots[i].key = key;
+        _slots[i].value = value;
+        _slots[i].used = true;
+        _size++;
+        return &_slots[i].value;
+    }
+
+    template<typename PRED>
+    bool erase(const KEY & key, PRED && pred)
+    {
+        auto value = find(key, pred);
+        if(!value) {
+            return false;
+        }
+
+        // Shift following entries of the cluster back, if the hole is between their home and them
+        size_t hole = (Slot *)((uint8_t *)value - offsetof(Slot, value)) - _slots.get();
+        for(size_t i = (hole + 1) & _mask; _slots[i].used; i = (i + 1) & _mask) {
+            size_t h = home(_slots[i].key);
+            bool stays = hole <= i ? (hole < h && h <= i) : (hole < h || h <= i);
+            if(!stays) {
+                _slots[hole] = _slots[i];
+                hole = i;
+            }
+        }
+        _slots[hole].used = false;
+        _size--;
+        return true;
+    }
+
+    size_t size() const
+    {
+        return _size;
+    }
+
+    size_t capacity() const
+    {
+        return _mask + 1;
+    }
+
+private:
+    offset_ptr<Slot> _slots;
+    size_t _mask;
+    size_t _size;
+
+    size_t home(const KEY & key) const
+    {
+        return ((uint64_t)key * 0x9E3779B97F4A7C15ULL >> 32) & _mask;
+    }
+};
+
+/*
+ * Shared memory storage of flow blocks: preallocated slots managed by AllocatorList plus open addressing
+ * index by block key. Replaces red-black tree of SharedMultimap: insert, find and erase are O(1),
+ * Block is constructed in place and never copied.
+ *
+ * Slots come in Block::SIZE_CLASSES pools, one per data size. Pools get equal share of memory,
+ * so there are 4 times more blocks in every smaller class.
+ *
+ * Key: high 32 bits - list (flow index and side), low 32 bits - order inside of list (sequence number).
+ * Blocks of every list are linked in sequence order, compared with serial arithmetic so that order survives
+ * sequence wraparound; in-order data is appended to the tail in O(1).
+ * All blocks are also linked in insertion order for readers scanning the whole storage.
+ * Owner may queue block to one of DEADLINE_LISTS: list is ordered by queuing time, so with one timeout
+ * per list due blocks are at its head and nothing else is visited to find them.
+ *
+ * Handles are size class in 2 high bits and slot number + 1 (NO_BLOCK == 0), they don't depend on mapping address.
+ * Whole object lives in one managed segment, external locking is required.
+ */
+class SharedBlockMap
+{
+public:
+    typedef uint32_t handle_t;
+    typedef uint64_t key_t;
+    static const handle_t NO_BLOCK = 0;
+    static const size_t DEADLINE_LISTS = 2;
+
+    // Blocks fitting to `bytes` of free segment memory together with indexes
+    SharedBlockMap(managed_shared_memory & segment, const size_t & bytes):
+        _index(segment.get_segment_manager(), totalBlocks(bytes) * 2),
+        _lists(segment.get_segment_manager(), totalBlocks(bytes) * 2),
+        _first(NO_BLOCK), _last(NO_BLOCK)
+    {
+        for(auto & list : _deadlines) {
+            list.head = list.tail = NO_BLOCK;
+        }
+        initPool<0>(segment, blocksFor(bytes, 0));
+        initPool<1>(segment, blocksFor(bytes, 1));
+        initPool<2>(segment, blocksFor(bytes, 2));
+    }
+
+    SharedBlockMap(const SharedBlockMap &) = delete;
+    SharedBlockMap & operator =(const SharedBlockMap &) = delete;
+
+    /*
+     * Block is placed after all blocks of the list with order <= new key order.
+     * If pool of size class is exhausted, bigger classes are tried first, then smaller ones.
+     * Returns NO_BLOCK if storage is full.
+     */
+    handle_t emplace(const key_t & key, const Block::BlockType & type, const size_t & size_class = 0)
+    {
+        Slot * slot = nullptr;
+        size_t cls = size_class;
+        for(; cls < CLASSES && !slot; cls++) {
+            slot = allocate(cls);
+        }
+        for(cls = size_class; cls > 0 && !slot; cls--) {
+            slot = allocate(cls - 1);
+        }
+        if(!slot) {
+            return NO_BLOCK;
+        }
+        new (&slot->block) Block(type, Block::classSize(slot->size_class));
+        slot->key = key;
+        slot->used = true;
+        slot->gen++;
+        slot->deadline = 0;
+        handle_t handle = toHandle(slot);
+
+        linkList(handle, slot);
+        linkAll(handle, slot);
+        _index.insert(key, handle);
+        return handle;
+    }
+
+    void erase(const handle_t & handle)
+    {
+        Slot * slot = toSlot(handle);
+        _index.erase(slot->key, [&handle](const handle_t & h) { return h == handle; });
+        unlinkList(handle, slot);
+        unlinkAll(slot);
+        unlinkDeadline(slot);
+        slot->used = false;
+        deallocate(slot);
+    }
+
+    Block * block(const handle_t & handle) const
+    {
+        return &toSlot(handle)->block;
+    }
+
+    key_t key(const handle_t & handle) const
+    {
+        return toSlot(handle)->key;
+    }
+
+    // Slot reuse counter: handle kept outside of the map is checked by (handle, generation) pair
+    uint32_t generation(const handle_t & handle) const
+    {
+        return toSlot(handle)->gen;
+    }
+
+    bool valid(const handle_t & handle, const uint32_t & gen) const
+    {
+        Slot * slot = toSlot(handle);
+        return slot->used && slot->gen == gen;
+    }
+
+    static size_t sizeClass(const handle_t & handle)
+    {
+        return handle >> CLASS_SHIFT;
+    }
+
+    // First block inserted with exactly this key
+    handle_t find(const key_t & key) const
+    {
+        auto handle = _index.find(key);
+        return handle ? *handle : NO_BLOCK;
+    }
+
+    // First block of the list with order >= key order
+    handle_t lowerBound(const key_t & key) const
+    {
+        auto list = _lists.find(listOf(key));
+        handle_t handle = list ? list->head : NO_BLOCK;
+        while(handle && before(toSlot(handle)->key, key)) {
+            handle = toSlot(handle)->next;
+        }
+        return handle;
+    }
+
+    // Neighbours inside of the same list
+    handle_t next(const handle_t & handle) const
+    {
+        return toSlot(handle)->next;
+    }
+
+    handle_t prev(const handle_t & handle) const
+    {
+        return toSlot(handle)->prev;
+    }
+
+    // All blocks in insertion order
+    handle_t first() const
+    {
+        return _first;
+    }
+
+    handle_t nextInserted(const handle_t & handle) const
+    {
+        return toSlot(handle)->all_next;
+    }
+
+    // Block goes to the tail of deadline list `list`, out of list it was in
+    void queueDeadline(const handle_t & handle, const size_t & list)
+    {
+        Slot * slot = toSlot(handle);
+        unlinkDeadline(slot);
+        auto & deadlines = _deadlines[list];
+        slot->deadline = list + 1;
+        slot->dl_prev = deadlines.tail;
+        slot->dl_next = NO_BLOCK;
+        if(deadlines.tail) {
+            toSlot(deadlines.tail)->dl_next = handle;
+        }
+        else {
+            deadlines.head = handle;
+        }
+        deadlines.tail = handle;
+    }
+
+    // Does nothing if block is not in `list`
+    void cancelDeadline(const handle_t & handle, const size_t & list)
+    {
+        Slot * slot = toSlot(handle);
+        if(slot->deadline == list + 1) {
+            unlinkDeadline(slot);
+        }
+    }
+
+    // Block queued the earliest
+    handle_t firstDeadline(const size_t & list) const
+    {
+        return _deadlines[list].head;
+    }
+
+    size_t size() const
+    {
+        return _index.size();
+    }
+
+    size_t capacity() const
+    {
+        size_t blocks = 0;
+        for(auto & pool : _pools) {
+            blocks += pool.capacity;
+        }
+        return blocks;
+    }
+
+    size_t capacity(const size_t & size_class) const
+    {
+        return _pools[size_class].capacity;
+    }
+
+    size_t available(const size_t & size_class) const
+    {
+        return _pools[size_class].available;
+    }
+
+    size_t lists() const
+    {
+        return _lists.size();
+    }
+
+private:
+    static const size_t CLASSES = Block::SIZE_CLASSES;
+    static const size_t CLASS_SHIFT = 30;
+    static const handle_t SLOT_MASK = (1U << CLASS_SHIFT) - 1;
+    static_assert(CLASSES == 3, "Pools are instantiated for 3 size classes");
+
+#pragma pack(1)
+    // Block must be the last field: its data follows slot header
+    struct Slot
+    {
+        bool used;
+        uint8_t size_class;
+        uint32_t gen;
+        key_t key;
+        handle_t prev;
+        handle_t next;
+        handle_t all_prev;
+        handle_t all_next;
+        // Deadline list + 1, 0 if none
+        uint8_t deadline;
+        handle_t dl_prev;
+        handle_t dl_next;
+        Block block;
+    };
+
+    template<size_t CLS>
+    struct ClassSlot
+    {
+        Slot slot;
+        uint8_t data[Block::classSize(CLS)];
+    };
+#pragma pack()
+
+    struct List
+    {
+        handle_t head;
+        handle_t tail;
+    };
+
+    // Fixed size slots of one size class
+    struct Pool
+    {
+        size_t mem_size;
+        offset_ptr<uint8_t> mem;
+        offset_ptr<uint8_t> array;
+        size_t slot_size;
+        size_t capacity;
+        size_t available;
+    };
+
+    typedef SharedOpenIndex<key_t, handle_t> index_t;
+    typedef SharedOpenIndex<uint32_t, List> lists_t;
+
+    Pool _pools[CLASSES];
+    index_t _index;
+    lists_t _lists;
+    handle_t _first;
+    handle_t _last;
+    List _deadlines[DEADLINE_LISTS];
+
+    static size_t blocksFor(const size_t & bytes, const size_t & size_class)
+    {
+        size_t per_block = sizeof(Slot) + Block::classSize(size_class) + 2 * sizeof(index_t::Slot) + 2 * sizeof(lists_t::Slot);
+        size_t reserve = VIRTUAL_PAGE_SIZE_4KiB * 4 + bytes / 32; // allocator headers and alignment
+        size_t share = bytes / CLASSES;
+        // AllocatorList keeps one entry as free list tail
+        return share > reserve + per_block * 2 ? (share - reserve) / per_block : 2;
+    }
+
+    static size_t totalBlocks(const size_t & bytes)
+    {
+        size_t blocks = 0;
+        for(size_t cls = 0; cls < CLASSES; cls++) {
+            blocks += blocksFor(bytes, cls);
+        }
+        return blocks;
+    }
+
+    template<size_t CLS>
+    void initPool(managed_shared_memory & segment, const size_t & blocks)
+    {
+        auto & pool = _pools[CLS];
+        pool.mem_size = AllocatorList<ClassSlot<CLS>>::memSize(blocks);
+        pool.mem = static_cast<uint8_t *>(segment.allocate_aligned(pool.mem_size, VIRTUAL_PAGE_SIZE_4KiB));
+        pool.slot_size = sizeof(ClassSlot<CLS>);
+
+        AllocatorList<ClassSlot<CLS>> allocator(pool.mem.get(), pool.mem_size, true);
+        pool.array = (uint8_t *)allocator.at(0);
+        pool.capacity = pool.available = allocator.capacity() - 1;
+        for(size_t i = 0; i < allocator.capacity(); i++) {
+            auto slot = &allocator.at(i)->slot;
+            slot->used = false;
+            slot->size_class = CLS;
+            slot->gen = 0;
+        }
+    }
+
+    template<size_t CLS>
+    AllocatorList<ClassSlot<CLS>> allocator() const
+    {
+        return AllocatorList<ClassSlot<CLS>>(_pools[CLS].mem.get(), _pools[CLS].mem_size, false);
+    }
+
+    // Slot header is at the start of ClassSlot
+    Slot * allocate(const size_t & size_class)
+    {
+        Slot * slot = nullptr;
+        switch(size_class) {
+        case 0: slot = (Slot *)allocator<0>().allocate(1); break;
+        case 1: slot = (Slot *)allocator<1>().allocate(1); break;
+        default: slot = (Slot *)allocator<2>().allocate(1); break;
+        }
+        if(slot) {
+            _pools[size_class].available--;
+        }
+        return slot;
+    }
+
+    void deallocate(Slot * slot)
+    {
+        switch(slot->size_class) {
+        case 0: allocator<0>().deallocate((ClassSlot<0> *)slot, 1); break;
+        case 1: allocator<1>().deallocate((ClassSlot<1> *)slot, 1); break;
+        default: allocator<2>().deallocate((ClassSlot<2> *)slot, 1); break;
+        }
+        _pools[slot->size_class].available++;
+    }
+
+    Slot * toSlot(const handle_t & handle) const
+    {
+        auto & pool = _pools[sizeClass(handle)];
+        return (Slot *)(pool.array.get() + ((handle & SLOT_MASK) - 1) * pool.slot_size);
+    }
+
+    handle_t toHandle(const Slot * slot) const
+    {
+        auto & pool = _pools[slot->size_class];
+        return ((handle_t)slot->size_class << CLASS_SHIFT) | (handle_t)(((const uint8_t *)slot - pool.array.get()) / pool.slot_size + 1);
+    }
+
+    static uint32_t listOf(const key_t & key)
+    {
+        return key >> 32;
+    }
+
+    // Order of keys of one list, sequence numbers wrap
+    static bool before(const key_t & l, const key_t & r)
+    {
+        return (int32_t)((uint32_t)l - (uint32_t)r) < 0;
+    }
+
+    void linkList(const handle_t & handle, Slot * slot)
+    {
+        auto list = _lists.find(listOf(slot->key));
+        if(!list) {
+            slot->prev = slot->next = NO_BLOCK;
+            _lists.insert(listOf(slot->key), { handle, handle });
+            return;
+        }
+
+        // Walk back from the tail: in-order data is appended without walking
+        handle_t after = list->tail;
+        while(after && before(slot->key, toSlot(after)->key)) {
+            after = toSlot(after)->prev;
+        }
+
+        slot->prev = after;
+        slot->next = after ? toSlot(after)->next : list->head;
+        if(slot->prev) {
+            toSlot(slot->prev)->next = handle;
+        }
+        else {
+            list->head = handle;
+        }
+        if(slot->next) {
+            toSlot(slot->next)->prev = handle;
+        }
+        else {
+            list->tail = handle;
+        }
+    }
+
+    void unlinkList(const handle_t & handle, Slot * slot)
+    {
+        auto list_key = listOf(slot->key);
+        auto list = _lists.find(list_key);
+        if(slot->prev) {
+            toSlot(slot->prev)->next = slot->next;
+        }
+        else {
+            list->head = slot->next;
+        }
+        if(slot->next) {
+            toSlot(slot->next)->prev = slot->prev;
+        }
+        else {
+            list->tail = slot->prev;
+        }
+
+        if(!list->head) {
+            _lists.erase(list_key, [](const List &) { return true; });
+        }
+    }
+
+    void linkAll(const handle_t & handle, Slot * slot)
+    {
+        slot->all_prev = _last;
+        slot->all_next = NO_BLOCK;
+        if(_last) {
+            toSlot(_last)->all_next = handle;
+        }
+        else {
+            _first = handle;
+        }
+        _last = handle;
+    }
+
+    void unlinkDeadline(Slot * slot)
+    {
+        if(!slot->deadline) {
+            return;
+        }
+        auto & deadlines = _deadlines[slot->deadline - 1];
+        if(slot->dl_prev) {
+            toSlot(slot->dl_prev)->dl_next = slot->dl_next;
+        }
+        else {
+            deadlines.head = slot->dl_next;
+        }
+        if(slot->dl_next) {
+            toSlot(slot->dl_next)->dl_prev = slot->dl_prev;
+        }
+        else {
+            deadlines.tail = slot->dl_prev;
+        }
+        slot->deadline = 0;
+    }
+
+    void unlinkAll(Slot * slot)
+    {
+        if(slot->all_prev) {
+            toSlot(slot->all_prev)->all_next = slot->all_next;
+        }
+        else {
+            _first = slot->all_next;
+        }
+        if(slot->all_next) {
+            toSlot(slot->all_next)->all_prev = slot->all_prev;
+        }
+        else {
+            _last = slot->all_prev;
+        }
+    }
+};
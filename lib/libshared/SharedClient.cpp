@@ -1,18 +1,36 @@
 #include "SharedClient.h"
 
+#include <algorithm>
+#include <sys/un.h>
 
-SharedClient::SharedClient(const std::string &ip, const uint16_t &port)
+
+SharedClient::SharedClient(const std::string &ip, const uint16_t &port): _chan_fd(-1)
 {
     _cfg.ip = ip;
     _cfg.port = port;
 }
 
+SharedClient::SharedClient(const std::string &path): _chan_fd(-1)
+{
+    _cfg.port = 0;
+    _cfg.path = path;
+}
+
 SharedClient::~SharedClient()
 {
+    if(_chan_fd >= 0)
+    {
+        close(_chan_fd);
+    }
 }
 
 bool SharedClient::create()
 {
+    if(!_cfg.path.empty())
+    {
+        return connectToLocal();
+    }
+
     _ip_addr.sin_family = AF_INET;
     _ip_addr.sin_port = htons(_cfg.port);
 
@@ -31,34 +49,55 @@ bool SharedClient::init()
     return SharedSocket::write(_sock, (uint8_t *)&cmd, sizeof (ss_cmd));
 }
 
-bool SharedClient::newRChan(const std::string &prefix, const size_t &shm_size)
+bool SharedClient::newRChan(const std::string &prefix, const ss_chan_params &params)
 {
-    ss_cmd cmd = { (uint64_t)ss_proto::SS_NEWRCHAN, 0 };
+    return newChan(ss_proto::SS_NEWRCHAN, prefix, params);
+}
+
+bool SharedClient::newWChan(const std::string &prefix, const ss_chan_params &params)
+{
+    return newChan(ss_proto::SS_NEWWCHAN, prefix, params);
+}
+
+bool SharedClient::newChan(const ss_proto & proto, const std::string &prefix, const ss_chan_params &params)
+{
+    ss_cmd cmd = { (uint64_t)proto, 0 };
 
     size_t offset = 0;
-    std::memcpy(cmd.text, &shm_size, sizeof (uint32_t));
-    offset += sizeof (uint32_t);
-    std::memcpy(cmd.text + offset, prefix.c_str(), prefix.size());
+    std::memcpy(cmd.text, &params, sizeof (ss_chan_params));
+    offset += sizeof (ss_chan_params);
+    // Prefix is always null terminated
+    std::memcpy(cmd.text + offset, prefix.c_str(), std::min(prefix.size(), sizeof (cmd.text) - offset - 1));
 
     return SharedSocket::write(_sock, (uint8_t *)&cmd, sizeof (ss_cmd));
 }
 
-bool SharedClient::newWChan(const std::string &prefix, const size_t &shm_size)
+bool SharedClient::bindChan(const uint64_t &id, const hash_t &hash, const ss_bind_params &params)
 {
-    ss_cmd cmd = { (uint64_t)ss_proto::SS_NEWWCHAN, 0 };
+    return bindPair(ss_proto::SS_BINDCHAN, id, hash, 0, params);
+}
 
-    size_t offset = 0;
-    std::memcpy(cmd.text, &shm_size, sizeof (uint32_t));
-    offset += sizeof (uint32_t);
-    std::memcpy(cmd.text + offset, prefix.c_str(), prefix.size());
+bool SharedClient::bindRange(const shm_id_t &id, const hash_t &lo, const hash_t &hi, const ss_bind_params &params)
+{
+    return bindPair(ss_proto::SS_BINDRANGE, id, lo, hi, params);
+}
 
-    return SharedSocket::write(_sock, (uint8_t *)&cmd, sizeof (ss_cmd));
+bool SharedClient::bindMask(const shm_id_t &id, const hash_t &mask, const hash_t &value, const ss_bind_params &params)
+{
+    return bindPair(ss_proto::SS_BINDMASK, id, mask, value, params);
 }
 
-bool SharedClient::bindChan(const uint64_t &id, const hash_t &hash)
+bool SharedClient::subscribe(const shm_id_t &id, const hash_t &mask, const hash_t &value)
 {
-    ss_cmd cmd = { (uint64_t)ss_proto::SS_BINDCHAN, id };
-    std::memcpy(cmd.text, &hash, sizeof (hash_t));
+    return bindPair(ss_proto::SS_SUBSCRIBE, id, mask, value);
+}
+
+bool SharedClient::bindPair(const ss_proto &proto, const shm_id_t &id, const hash_t &first, const hash_t &second, const ss_bind_params &params)
+{
+    ss_cmd cmd = { (uint64_t)proto, id };
+    std::memcpy(cmd.text, &first, sizeof (hash_t));
+    std::memcpy(cmd.text + sizeof (hash_t), &second, sizeof (hash_t));
+    std::memcpy(cmd.text + 2 * sizeof (hash_t), &params, sizeof (ss_bind_params));
 
     return SharedSocket::write(_sock, (uint8_t *)&cmd, sizeof (ss_cmd));
 }
@@ -71,12 +110,43 @@ bool SharedClient::closeChan(const uint64_t &id)
 
 bool SharedClient::waitAck(ss_cmd & cmd)
 {
-    auto read = SharedSocket::read(_sock, (uint8_t *)&cmd, sizeof (ss_cmd));
-    if(read != sizeof (ss_cmd))
+    return waitCmd(cmd, false);
+}
+
+bool SharedClient::waitNotify(ss_cmd &cmd)
+{
+    return waitCmd(cmd, true);
+}
+
+int SharedClient::takeChanFd()
+{
+    int fd = _chan_fd;
+    _chan_fd = -1;
+    return fd;
+}
+
+bool SharedClient::waitCmd(ss_cmd &cmd, const bool &notify)
+{
+    do
     {
-        closeSocket();
-        return false;
-    }
+        int fd = -1;
+        auto read = _cfg.path.empty() ? SharedSocket::read(_sock, (uint8_t *)&cmd, sizeof (ss_cmd))
+                                      : SharedSocket::readFd(_sock, (uint8_t *)&cmd, sizeof (ss_cmd), fd);
+        if(fd >= 0)
+        {
+            // Channel not taken by caller is not attached by anybody
+            if(_chan_fd >= 0)
+            {
+                close(_chan_fd);
+            }
+            _chan_fd = fd;
+        }
+        if(read != sizeof (ss_cmd))
+        {
+            closeSocket();
+            return false;
+        }
+    } while(((ss_proto)cmd.cmd == ss_proto::SS_NOTIFY) != notify);
     return true;
 }
 
@@ -98,3 +168,28 @@ bool SharedClient::connectoToServer()
     return true;
 }
 
+bool SharedClient::connectToLocal()
+{
+    struct sockaddr_un addr;
+    auto addr_len = localAddr(_cfg.path, addr);
+    if(!addr_len)
+    {
+        LOG_ERR(DEBUG_SHARED_CLIENT, "Bad socket path: %s\n", _cfg.path.c_str());
+        return false;
+    }
+
+    _sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (_sock < 0) {
+        LOG_ERR(DEBUG_SHARED_CLIENT, "Cannot create socket ...\n");
+        return false;
+    }
+
+    if(connect(_sock, (struct sockaddr *)&addr, addr_len) < 0)
+    {
+        LOG_MESS(DEBUG_SHARED_CLIENT, "Cannot connect to %s. Err: %s(%i)\n", _cfg.path.c_str(), strerror(errno), errno);
+        closeSocket();
+        return false;
+    }
+
+    return true;
+}
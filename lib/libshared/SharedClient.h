@@ -7,25 +7,55 @@ class SharedClient: public SharedSocket
 {
 public:
     SharedClient(const std::string & ip, const uint16_t & port);
+    // Local client over socket at `path` like SharedSocket::localPath(), channels come as memory descriptors
+    SharedClient(const std::string & path);
     ~SharedClient();
 
     bool create();
     bool init();
-    bool newRChan(const std::string &prefix, const size_t &shm_size);
-    bool newWChan(const std::string &prefix, const size_t &shm_size);
-    bool bindChan(const shm_id_t & id, const hash_t &hash);
+    bool newRChan(const std::string &prefix, const ss_chan_params &params);
+    bool newWChan(const std::string &prefix, const ss_chan_params &params);
+    // `params` choose what server does when channel is full
+    bool bindChan(const shm_id_t & id, const hash_t &hash, const ss_bind_params & params = ss_bind_params());
+    // Channel gets all hashes in [lo, hi]
+    bool bindRange(const shm_id_t & id, const hash_t & lo, const hash_t & hi, const ss_bind_params & params = ss_bind_params());
+    // Channel gets all hashes with hash & mask == value, e.g. mask N-1 and value i for i-th of N consumers
+    bool bindMask(const shm_id_t & id, const hash_t & mask, const hash_t & value, const ss_bind_params & params = ss_bind_params());
+    /*
+     * Channel gets refs to payloads of all hashes with hash & mask == value, other subscribers get the same payloads.
+     * Payload is read from SharedPayloadSlab named in ACK and released there after use.
+     */
+    bool subscribe(const shm_id_t & id, const hash_t & mask, const hash_t & value);
     bool closeChan(const shm_id_t &id);
+    // Notifications coming meanwhile are dropped: consumer checks its ring after arm() anyway
     bool waitAck(ss_cmd & cmd);
+    /*
+     * Blocks until SS_NOTIFY, cmd.id is notified channel. Consumer does
+     * SharedCircularBuffer::arm(), checks ring once more and only then waits.
+     */
+    bool waitNotify(ss_cmd & cmd);
+    /*
+     * Memory descriptor of channel from the last ACK of local client, -1 if none. Caller owns it:
+     * SharedCircularBuffer(fd, name) attaches the channel.
+     */
+    int takeChanFd();
 private:
     struct Config
     {
         std::string ip;
         uint16_t port;
+        std::string path;
     };
     Config _cfg;
     struct sockaddr_in _ip_addr;
+    int _chan_fd;
 
     bool connectoToServer();
+    bool connectToLocal();
+    bool newChan(const ss_proto & proto, const std::string &prefix, const ss_chan_params &params);
+    bool bindPair(const ss_proto & proto, const shm_id_t & id, const hash_t & first, const hash_t & second,
+                  const ss_bind_params & params = ss_bind_params());
+    bool waitCmd(ss_cmd & cmd, const bool & notify);
 };
 
 
@@ -0,0 +1,175 @@
+// Copyright: https://github.com/mikerez/mediaroom/blob/main/LICENSE
+
+#pragma once
+
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <atomic>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include <boost/interprocess/managed_shared_memory.hpp>
+#include <boost/interprocess/offset_ptr.hpp>
+
+#include "../TimeHandler.h"
+
+using namespace boost::interprocess;
+
+/*
+ * Bounded MPMC queue (D. Vyukov) placed in shared memory. Every cell has a sequence number,
+ * producers and consumers only CAS their position, so there is no lock and no false sharing between sides.
+ * Atomics must be lock-free to work between processes.
+ */
+template<typename VALUE>
+class SharedCompletionQueue
+{
+public:
+    static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && sizeof(size_t) == sizeof(long long), "Queue positions must be lock-free to be shared between processes");
+
+    SharedCompletionQueue(managed_shared_memory::segment_manager * segment_manager, const size_t & min_capacity)
+    {
+        size_t capacity = 2;
+        while(capacity < min_capacity) {
+            capacity <<= 1;
+        }
+        _mask = capacity - 1;
+        _cells = static_cast<Cell *>(segment_manager->allocate(capacity * sizeof(Cell)));
+        for(size_t i = 0; i < capacity; i++) {
+            new (&_cells[i].seq) std::atomic<size_t>(i);
+        }
+        _enqueue_pos.store(0, std::memory_order_relaxed);
+        _dequeue_pos.store(0, std::memory_order_relaxed);
+    }
+
+    SharedCompletionQueue(const SharedCompletionQueue &) = delete;
+    SharedCompletionQueue & operator =(const SharedCompletionQueue &) = delete;
+
+    // Returns false if queue is full
+    bool push(const VALUE & value)
+    {
+        size_t pos = _enqueue_pos.load(std::memory_order_relaxed);
+        while(true) {
+            Cell & cell = _cells[pos & _mask];
+            size_t seq = cell.seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if(diff == 0) {
+                if(_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.value = value;
+                    cell.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if(diff < 0) {
+                return false;
+            }
+            else {
+                pos = _enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Pops head only if ready(head) is true: values are pushed in completion order, so head is the oldest one
+    template<typename PRED>
+    bool pop(VALUE & value, PRED && ready)
+    {
+        size_t pos = _dequeue_pos.load(std::memory_order_relaxed);
+        while(true) {
+            Cell & cell = _cells[pos & _mask];
+            size_t seq = cell.seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if(diff == 0) {
+                // Cell can't be reused until our position is taken, reading it before CAS is safe
+                value = cell.value;
+                if(!ready(value)) {
+                    return false;
+                }
+                if(_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.seq.store(pos + _mask + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if(diff < 0) {
+                return false;
+            }
+            else {
+                pos = _dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool pop(VALUE & value)
+    {
+        return pop(value, [](const VALUE &) { return true; });
+    }
+
+    // Approximate, exact only when both sides are idle
+    size_t size() const
+    {
+        return _enqueue_pos.load(std::memory_order_relaxed) - _dequeue_pos.load(std::memory_order_relaxed);
+    }
+
+    size_t capacity() const
+    {
+        return _mask + 1;
+    }
+
+private:
+    struct Cell
+    {
+        std::atomic<size_t> seq;
+        VALUE value;
+    };
+
+    // Producer and consumer positions are kept in different cache lines
+    offset_ptr<Cell> _cells;
+    size_t _mask;
+    char _pad0[64];
+    std::atomic<size_t> _enqueue_pos;
+    char _pad1[64 - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> _dequeue_pos;
+    char _pad2[64 - sizeof(std::atomic<size_t>)];
+};
+
+/*
+ * Wakeup of consumers sleeping in other processes. Shared (not FUTEX_PRIVATE) futex on a counter in shared memory:
+ * producer bumps counter and issues syscall only if somebody waits.
+ */
+class SharedNotify
+{
+public:
+    SharedNotify(): _seq(0), _waiters(0) { }
+
+    SharedNotify(const SharedNotify &) = delete;
+    SharedNotify & operator =(const SharedNotify &) = delete;
+
+    uint32_t sequence() const
+    {
+        return _seq.load(std::memory_order_acquire);
+    }
+
+    void notify()
+    {
+        // Both sides do RMW before checking the other one (seq_cst), so wakeup can't be lost
+        _seq.fetch_add(1);
+        if(_waiters.load()) {
+            syscall(SYS_futex, &_seq, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+        }
+    }
+
+    // Sleeps while sequence is still `seen`. Returns false on timeout.
+    bool wait(const uint32_t & seen, const TimeHandler::usecs_t & timeout)
+    {
+        timespec ts = { (time_t)(timeout / 1000000), (long)(timeout % 1000000) * 1000 };
+        _waiters.fetch_add(1);
+        long res = syscall(SYS_futex, &_seq, FUTEX_WAIT, seen, &ts, nullptr, 0);
+        _waiters.fetch_sub(1);
+        return res == 0 || errno != ETIMEDOUT;
+    }
+
+private:
+    std::atomic<uint32_t> _seq;
+    std::atomic<uint32_t> _waiters;
+};
@@ -2,48 +2,121 @@
 
 #pragma once
 
+#include <vector>
+
 #include "SharedIO.h"
 #include "CycleBuffer.h"
+#include "SlotRing.h"
 
 using namespace boost::interprocess;
 
+/*
+ * Shared channel ring, its kind is chosen by creator and kept in the segment:
+ * SPSC - CycleBuffer of variable length records, one producer and one consumer.
+ * MPMC - SlotRing of records up to slot size, any number of producers and consumers, e.g. several threads
+ *        or processes draining one channel.
+ */
 class SharedCircularBuffer : public SharedIO
 {
 public:
+    enum class Ring: uint32_t {
+        SPSC,
+        MPMC,
+    };
+    static const size_t DEFAULT_SLOT_SIZE = 2048;
+
     SharedCircularBuffer() = delete;
-    SharedCircularBuffer(const std::string & filename, size_t length = 0, bool create = false):
-        SharedIO(filename.c_str(), length, create), _mem_name(filename), _mem(nullptr)
+    /*
+     * Ring memory is allocated lazily, by the first write to every page. With `populate` creator and every attacher
+     * prefault it in background instead, so data path takes no page faults.
+     */
+    SharedCircularBuffer(const std::string & filename, size_t length = 0, bool create = false, Ring ring = Ring::SPSC, size_t slot_size = DEFAULT_SLOT_SIZE,
+                         bool populate = false):
+        SharedIO(filename.c_str(), length, create), _mem_name(filename), _mem(nullptr), _hdr(nullptr)
     {
-        if(create) {
-            _mem = getSegment().template construct<uint8_t>(std::string(filename + "_cb").c_str())[length - 1024]();
-        }
-        else {
-            _mem = getSegment().template find<uint8_t>(std::string(filename + "_cb").c_str()).first;
-        }
-
-        if(!_mem) {
-            std::string err = "Failed to " + std::string(create ? "create" : "find") + " shared object " + filename + "_cb object!";
-            throw std::runtime_error(err);
-        }
+        init(length, create, ring, slot_size, populate);
+    }
 
-        _cb.set(_mem, length);
-        _cb.clear();
+    // Channel in memory descriptor (see SharedIO), `name` only identifies objects inside of it
+    SharedCircularBuffer(int fd, const std::string & name, size_t length = 0, bool create = false, Ring ring = Ring::SPSC, size_t slot_size = DEFAULT_SLOT_SIZE,
+                         bool populate = false):
+        SharedIO(fd, length, create), _mem_name(name), _mem(nullptr), _hdr(nullptr)
+    {
+        init(length, create, ring, slot_size, populate);
     }
 
     SharedCircularBuffer(const SharedCircularBuffer & cb) = delete;
-    SharedCircularBuffer(SharedCircularBuffer && cb): SharedIO(std::move(cb))
+    SharedCircularBuffer(SharedCircularBuffer && cb): SharedIO(std::move(cb)), _mem_name(std::move(cb._mem_name)), _mem(cb._mem), _hdr(cb._hdr),
+        _cb(std::move(cb._cb)), _slots(cb._slots), _pop_buffer(std::move(cb._pop_buffer))
     {
+        cb._mem = nullptr;
     }
 
     SharedCircularBuffer & operator =(SharedCircularBuffer && cb)
     {
         SharedIO::operator=(std::move(cb));
+        _mem_name = std::move(cb._mem_name);
         _mem = cb._mem;
         cb._mem = nullptr;
+        _hdr = cb._hdr;
         _cb = std::move(cb._cb);
+        _slots = cb._slots;
+        _pop_buffer = std::move(cb._pop_buffer);
         return *this;
     }
 
+    Ring ring() const
+    {
+        return _hdr->ring;
+    }
+
+    /*
+     * Consumer is going to wait for notification: ring must be checked once more after arm(),
+     * record pushed before it is not notified.
+     */
+    void arm()
+    {
+        _hdr->waiting.store(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    // Producer, after push: true once per arm(), consumer has to be notified then
+    bool disarm()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return _hdr->waiting.load(std::memory_order_relaxed) && _hdr->waiting.exchange(0, std::memory_order_relaxed);
+    }
+
+    // Approximate ring fill, bytes of SPSC ring and records of MPMC ring
+    size_t length()
+    {
+        return _hdr->ring == Ring::MPMC ? _slots.length() : _cb.length();
+    }
+
+    // Units of length()
+    size_t capacity()
+    {
+        return _hdr->ring == Ring::MPMC ? _slots.capacity() : _cb.size();
+    }
+
+    /*
+     * Producer drops the oldest record to make room for record of `length` bytes. Only MPMC ring, where producer
+     * may take record as one more consumer. False if ring is empty or record doesn't fit even to empty ring.
+     */
+    bool dropOldest(const size_t & length)
+    {
+        if(_hdr->ring != Ring::MPMC || length > _slots.slotData()) {
+            return false;
+        }
+        Record record;
+        if(!peek(record)) {
+            return false;
+        }
+        release(record);
+        return true;
+    }
+
+    // Thread safe for MPMC ring only
     bool push(const uint8_t * data, const size_t &length)
     {
         if(!_mem) {
@@ -51,22 +124,282 @@ public:
             throw std::runtime_error(err);
         }
 
-        return _cb.write1(data, length);;
+        if(length > UINT32_MAX - CycleBuffer::RECORD_HDR_SIZE) {
+            return false;
+        }
+        return _hdr->ring == Ring::MPMC ? _slots.write1(data, length) : _cb.write1(data, length);
     }
 
-    const uint8_t * pop(uint16_t & length)
+    // Data is valid until the next pop() of this object. MPMC record is copied to buffer of this object.
+    const uint8_t * pop(uint32_t & length)
     {
         if(!_mem) {
             std::string err = "Failed to pop data to shared object " + _mem_name + "_cb object!";
             throw std::runtime_error(err);
         }
 
+        if(_hdr->ring == Ring::MPMC) {
+            _pop_buffer.resize(_slots.slotData());
+            length = _pop_buffer.size();
+            return _slots.read1(_pop_buffer.data(), length) ? _pop_buffer.data() : nullptr;
+        }
         return _cb.read1(length);
     }
 
+    // Writable record inside ring. ticket identifies slot of MPMC ring.
+    struct Span
+    {
+        uint8_t * data;
+        uint32_t length;
+        size_t ticket;
+    };
+
+    // Record read in place
+    struct Record
+    {
+        const uint8_t * data;
+        uint32_t length;
+        size_t ticket;
+    };
+
+    /*
+     * Zero-copy write: span for record of up to `length` bytes is taken inside ring, message is built there
+     * and published by commit(). Returns false if there is no space now.
+     */
+    bool reserve(const uint32_t & length, Span & span)
+    {
+        if(!_mem) {
+            std::string err = "Failed to reserve data in shared object " + _mem_name + "_cb object!";
+            throw std::runtime_error(err);
+        }
+
+        span.length = length;
+        span.ticket = 0;
+        span.data = _hdr->ring == Ring::MPMC ? _slots.reserve(length, span.ticket) : _cb.reserve(length);
+        return span.data != nullptr;
+    }
+
+    // `length` is actual size of record, it may be less than reserved
+    void commit(const Span & span, const uint32_t & length)
+    {
+        if(length > span.length) {
+            throw std::runtime_error("Committed record of " + _mem_name + " is bigger than reserved!");
+        }
+
+        if(_hdr->ring == Ring::MPMC) {
+            _slots.commit(span.ticket, length);
+        }
+        else {
+            _cb.commit(length);
+        }
+    }
+
+    /*
+     * Zero-copy read: the oldest record is parsed in place, its space is given back by release().
+     * SPSC returns the same record until release(), MPMC gives every record to one caller.
+     * Returns false if ring is empty.
+     */
+    bool peek(Record & record)
+    {
+        if(!_mem) {
+            std::string err = "Failed to peek data in shared object " + _mem_name + "_cb object!";
+            throw std::runtime_error(err);
+        }
+
+        record.ticket = 0;
+        record.data = _hdr->ring == Ring::MPMC ? _slots.peek(record.length, record.ticket) : _cb.peek(record.length);
+        return record.data != nullptr;
+    }
+
+    void release(const Record & record)
+    {
+        if(_hdr->ring == Ring::MPMC) {
+            _slots.release(record.ticket);
+        }
+        else {
+            _cb.release();
+        }
+    }
+
+    struct Message
+    {
+        const uint8_t * data;
+        uint32_t length;
+    };
+
+    /*
+     * Pushes messages in order until the first one which doesn't fit, returns number of pushed ones.
+     * They become visible to consumers with one ring position update.
+     */
+    size_t pushBurst(const Message * messages, const size_t & n)
+    {
+        if(!_mem) {
+            std::string err = "Failed to push data to shared object " + _mem_name + "_cb object!";
+            throw std::runtime_error(err);
+        }
+
+        size_t pushed = 0;
+        if(_hdr->ring == Ring::MPMC) {
+            size_t fit = 0;
+            while(fit < n && messages[fit].length <= _slots.slotData()) {
+                fit++;
+            }
+            size_t ticket;
+            pushed = _slots.reserveBurst(fit, ticket);
+            for(size_t i = 0; i < pushed; i++) {
+                memcpy(_slots.data(ticket + i), messages[i].data, messages[i].length);
+                _slots.commit(ticket + i, messages[i].length);
+            }
+            return pushed;
+        }
+
+        for(; pushed < n; pushed++) {
+            auto span = _cb.reserve(messages[pushed].length);
+            if(!span) {
+                break;
+            }
+            memcpy(span, messages[pushed].data, messages[pushed].length);
+            _cb.commit(messages[pushed].length, false);
+        }
+        _cb.publish();
+        return pushed;
+    }
+
+    /*
+     * Zero-copy read of up to `n` the oldest records to `records`, returns number of them. They are given back
+     * by releaseBurst(), SPSC space with one ring position update. As with peek(), SPSC returns the same records until then.
+     */
+    size_t popBurst(Record * records, const size_t & n)
+    {
+        if(!_mem) {
+            std::string err = "Failed to pop data to shared object " + _mem_name + "_cb object!";
+            throw std::runtime_error(err);
+        }
+
+        size_t popped = 0;
+        if(_hdr->ring == Ring::MPMC) {
+            size_t ticket;
+            popped = _slots.peekBurst(n, ticket);
+            for(size_t i = 0; i < popped; i++) {
+                records[i].ticket = ticket + i;
+                records[i].data = _slots.record(ticket + i, records[i].length);
+            }
+            return popped;
+        }
+
+        for(; popped < n; popped++) {
+            records[popped].ticket = 0;
+            records[popped].data = popped ? _cb.peekNext(records[popped].length) : _cb.peek(records[popped].length);
+            if(!records[popped].data) {
+                break;
+            }
+        }
+        return popped;
+    }
+
+    void releaseBurst(const Record * records, const size_t & n)
+    {
+        if(_hdr->ring == Ring::MPMC) {
+            for(size_t i = 0; i < n; i++) {
+                _slots.release(records[i].ticket);
+            }
+        }
+        else if(n) {
+            _cb.release();
+        }
+    }
+
+    /*
+     * Copies record to `data` of `length` bytes, `length` is set to record size. Returns false if ring is empty.
+     * Several threads may pop from one MPMC ring object this way.
+     */
+    bool pop(uint8_t * data, uint32_t & length)
+    {
+        if(!_mem) {
+            std::string err = "Failed to pop data to shared object " + _mem_name + "_cb object!";
+            throw std::runtime_error(err);
+        }
+
+        if(_hdr->ring == Ring::MPMC) {
+            return _slots.read1(data, length);
+        }
+
+        uint32_t record_length;
+        auto record = _cb.read1(record_length);
+        if(!record) {
+            return false;
+        }
+        if(record_length <= length) {
+            memcpy(data, record, record_length);
+        }
+        length = record_length;
+        return true;
+    }
+
 private:
+    struct Hdr
+    {
+        Hdr(const Ring & ring, const size_t & slot_size, const bool & populate): ring(ring), slot_size(slot_size), populate(populate), mem_size(0), waiting(0) { }
+
+        Ring ring;
+        size_t slot_size;
+        bool populate;
+        // Ring memory, raw allocation is not touched by creator
+        offset_ptr<uint8_t> mem;
+        size_t mem_size;
+        // Consumer waits for notification
+        std::atomic<uint32_t> waiting;
+    };
+
     std::string _mem_name;
     uint8_t * _mem;
+    Hdr * _hdr;
     CycleBuffer _cb;
-};
+    SlotRing _slots;
+    std::vector<uint8_t> _pop_buffer;
+
+    void init(const size_t & length, const bool & create, const Ring & ring, const size_t & slot_size, const bool & populate)
+    {
+        auto manager = getManager();
+        if(manager && create) {
+            _hdr = manager->template construct<Hdr>(std::string(_mem_name + "_hdr").c_str())(ring, slot_size, populate);
+            // Named array would be value-initialized, so every page of it would be touched here
+            size_t mem_size = length - 1024 - 2 * sizeof(Hdr);
+            _hdr->mem = (uint8_t *)manager->allocate_aligned(mem_size, 64, std::nothrow);
+            _hdr->mem_size = _hdr->mem ? mem_size : 0;
+            if(!_hdr->mem) {
+                // Otherwise attacher would find header without ring
+                manager->destroy_ptr(_hdr);
+                _hdr = nullptr;
+            }
+        }
+        else if(manager) {
+            _hdr = manager->template find<Hdr>(std::string(_mem_name + "_hdr").c_str()).first;
+        }
+
+        if(!_hdr || !_hdr->mem) {
+            std::string err = "Failed to " + std::string(create ? "create" : "find") + " shared object " + _mem_name + "_hdr object!";
+            throw std::runtime_error(err);
+        }
+        _mem = _hdr->mem.get();
+        size_t mem_size = _hdr->mem_size;
 
+        // Ring takes exactly the aligned block allocated by creator, the rest of segment is used by segment manager
+        if(_hdr->ring == Ring::MPMC) {
+            _slots.set(_mem, mem_size, _hdr->slot_size);
+            if(create) {
+                _slots.clear();
+            }
+        }
+        else {
+            _cb.set(_mem, mem_size);
+            if(create) {
+                _cb.clear();
+            }
+        }
+
+        if(_hdr->populate) {
+            SharedIO::populate(_mem, mem_size);
+        }
+    }
+};
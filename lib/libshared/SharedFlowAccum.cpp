@@ -1,8 +1,60 @@
 #include "SharedFlowAccum.h"
 
-SharedFlowAccum::SharedFlowAccum(const std::string shm_name, const size_t &length, bool create): _mmap(shm_name, length, create)
+SharedFlowAccum::SharedFlowAccum(const std::string shm_name, const size_t &length, bool create, size_t shards, Mode mode):
+    _mode(mode), _notify(nullptr), _read_shard(0)
 {
+    auto start_ts = TimeHandler::Instance()->get_time_usecs();
+    bool recreate = create || (length && !attachable(shm_name, shards, mode));
+
+    // Reader learns real number of shards from header of shard 0
+    for(size_t i = 0; i < shards; i++) {
+        auto name = shardName(shm_name, i);
+        _shards.emplace_back(new Shard(name, i, shards ? length / shards : 0, recreate));
+        auto & shard = *_shards.back();
+        auto & segment = shard.io.getSegment();
+
+        auto hdr = segment.find_or_construct<SegmentHdr>("accum_hdr")(shards, i, mode);
+        if(!hdr || !hdr->compatible() || hdr->shard != i) {
+            throw std::runtime_error("Incompatible layout of shared object " + name + "!");
+        }
+        shards = hdr->shards;
+        _mode = hdr->mode;
+
+        // Writer of previous process could die holding the lock, it is recovered here rather than by the first packet
+        shard.mutex = segment.find_or_construct<RobustMutex>("shm_mutex")();
+        {
+            auto owner_died = shard.mutex->ownerDied();
+            scoped_lock<RobustMutex> lock(*shard.mutex);
+            if(shard.mutex->ownerDied() != owner_died) {
+                LOG_ERR(DEBUG_TCP_ACCUM, "Owner of %s died holding its lock, lock is recovered\n", name.c_str());
+            }
+        }
+        shard.active_flows = segment.find_or_construct<active_flows_table_t>("active_flows")(std::max<size_t>(CONFIG_FLOWHASH_SIZE / shards, 1),
+                                                                                             active_flows_alloc_t(segment.get_segment_manager()));
+        if(!shard.active_flows) {
+            throw std::runtime_error("Failed to find shared object " + name + " active flows!");
+        }
+
+        shard.blocks = segment.find<SharedBlockMap>("blocks").first;
+        if(!shard.blocks && length) {
+            // Rest of segment is left for growth of active flows table
+            shard.blocks = segment.construct<SharedBlockMap>("blocks")(segment, segment.get_free_memory() / 8 * 7);
+        }
+        if(!shard.blocks) {
+            throw std::runtime_error("Failed to find shared object " + name + " blocks!");
+        }
 
+        // Every block is queued at most once while it exists, stale entries are dropped on pop
+        shard.completed = segment.find_or_construct<completion_queue_t>("completed")(segment.get_segment_manager(), shard.blocks->capacity() * 2);
+        if(!i) {
+            _notify = segment.find_or_construct<SharedNotify>("accum_notify")();
+        }
+
+        if(shard.active_flows->size()) {
+            LOG_MESS(DEBUG_TCP_ACCUM, "Attached to %s: %lu active flows, %lu blocks in %lu usecs\n", name.c_str(),
+                     shard.active_flows->size(), shard.blocks->size(), TimeHandler::Instance()->get_time_usecs() - start_ts);
+        }
+    }
 }
 
 SharedFlowAccum::~SharedFlowAccum()
@@ -10,254 +62,607 @@ SharedFlowAccum::~SharedFlowAccum()
 
 }
 
+bool SharedFlowAccum::attachable(const std::string & shm_name, const size_t & shards, const Mode & mode)
+{
+    try {
+        for(size_t i = 0; i < shards; i++) {
+            managed_shared_memory segment(open_only, shardName(shm_name, i).c_str());
+            auto hdr = segment.find<SegmentHdr>("accum_hdr").first;
+            if(!hdr || !hdr->compatible() || hdr->shards != shards || hdr->shard != i || hdr->mode != mode) {
+                return false;
+            }
+        }
+        return true;
+    }  catch (std::exception &e) {
+        return false;
+    }
+}
+
+std::string SharedFlowAccum::shardName(const std::string & shm_name, const size_t & shard)
+{
+    return shard ? shm_name + "_" + std::to_string(shard) : shm_name;
+}
+
 void SharedFlowAccum::put(Tcp<Pkt> &&pkt, const flow_idx_t & idx, const flow_side_t & side)
 {
     uint32_t curr_seq = LS_ntohl(pkt->sequence) + (pkt->syn ? 1 : 0);
     FlowSeqKeyCtx key = { curr_seq, idx, side };
+    auto & shard = shardOfFlow(idx);
 
-    _mmap.lock();
-    auto it_active_block = _active_flows_ctxs.find(idx);
-    if(it_active_block == _active_flows_ctxs.end()) {
+    auto start_ticks = TimeHandler::Instance()->get_cpu_ticks();
+
+    scoped_lock<RobustMutex> lock(*shard.mutex);
+    bool resizing = shard.active_flows->resizing();
+    auto it_flow_ctx = shard.active_flows->find(idx);
+    if(!it_flow_ctx && (_mode == Mode::L4 || pkt.payloadLength() || pkt->syn)) {
         // Put to shm mmmap START block. New data block will be created further
-        it_active_block = put_start_flow_block(pkt, key);
+        it_flow_ctx = put_start_flow_block(shard, pkt, key);
     }
 
-    // If flow is active, but there is no active block
-    if(it_active_block->second.it_mmap == _mmap.getMmap()->end()) {
-        auto it_mmap = _mmap.emplace(key.prepare(), Block(Block::BlockType::L4_PAYLOAD));
-        it_active_block->second.it_mmap->second = it_mmap->second;
-    }
+    if(it_flow_ctx) {
+        auto side_ctx = &it_flow_ctx->sides[side];
+        if(!side_ctx->started) {
+            side_ctx->isn = curr_seq;
+            side_ctx->reassembly.reset(curr_seq);
+            side_ctx->started = true;
+        }
+        it_flow_ctx->update_ts = TimeHandler::Instance()->get_time_usecs();
+
+        // Finished side of L7 flow gets only retransmissions
+        if(_mode == Mode::L4 || !side_ctx->fin) {
+            // Only payload is stored: pure ACKs and handshake don't take block space
+            if(reassemble(shard, side_ctx, key, pkt.payload(), pkt.payloadLength())) {
+                shard.reassembly_latency.add(TimeHandler::Instance()->ticks_to_nsecs(TimeHandler::Instance()->get_cpu_ticks() - start_ticks));
+                if(shard.reassembly_latency.count() >= REASSEMBLY_REPORT) {
+                    reportReassemblyLatency(shard);
+                }
+            }
+        }
 
-    if(it_active_block->second.it_mmap->second.is_complete || it_active_block->second.it_mmap->second.expired(TimeHandler::Instance()->get_time_usecs())) {
-        close_block_and_open_new(it_active_block, key);
+        if(_mode == Mode::L7) {
+            if(pkt->fin && !side_ctx->fin) {
+                // Nothing will fill holes of finished side
+                side_ctx->fin = true;
+                flush_holes(shard, side_ctx);
+                close_block(shard, side_ctx);
+            }
+            if(pkt->rst || (it_flow_ctx->sides[0].fin && it_flow_ctx->sides[1].fin)) {
+                end_flow(shard, it_flow_ctx, key);
+            }
+        }
     }
 
-    push_data_to_block(it_active_block, pkt, key);
-
-    _mmap.unlock();
+    if(resizing) {
+        shard.resize_latency.add(TimeHandler::Instance()->ticks_to_nsecs(TimeHandler::Instance()->get_cpu_ticks() - start_ticks));
+        // Long resize is reported while it runs, not only when it is over
+        if(!shard.active_flows->resizing() || !(shard.resize_latency.count() % RESIZE_REPORT)) {
+            reportResizeLatency(shard);
+        }
+    }
 }
 
-SharedFlowAccum::shm_mmap_it SharedFlowAccum::get(bool & got)
+SharedFlowAccum::block_handle_t SharedFlowAccum::get(bool & got)
 {
-    got = false;
-    _mmap.lock();
-    if(_mmap.getMmap()->empty()) {
-        return _mmap.getMmap()->end();
+    // Round robin over shards, so every shard is drained evenly
+    for(size_t i = 0; i < _shards.size(); i++) {
+        auto & shard = *_shards[_read_shard];
+        _read_shard = (_read_shard + 1) % _shards.size();
+
+        SharedBlockMap::handle_t handle;
+        {
+            scoped_lock<RobustMutex> lock(*shard.mutex);
+            handle = get_from_shard(shard, got);
+        }
+        if(got) {
+            return globalHandle(shard, handle);
+        }
     }
 
-    auto it_last_read = it_read;
-    auto it_block = _mmap.getMmap()->end();
-    do {
-        if(it_read == _mmap.getMmap()->end()) {
-            it_read = _mmap.getMmap()->begin();
-        }
+    got = false;
+    return NO_BLOCK;
+}
 
-        // block must exired after marked is_complete == true
-        if(it_read->second.is_complete && it_read->second.expired(TimeHandler::Instance()->get_time_usecs())) {
-            it_block = it_read;
+SharedBlockMap::handle_t SharedFlowAccum::get_from_shard(Shard & shard, bool & got)
+{
+    got = false;
+    auto blocks = shard.blocks;
+    auto now = TimeHandler::Instance()->get_time_usecs();
+    CompletedBlock completed;
+    // block must exired after marked is_complete == true
+    while(shard.completed->pop(completed, [blocks, &now](const CompletedBlock & c) {
+                                              return !blocks->valid(c.handle, c.gen) || blocks->block(c.handle)->expired(now); })) {
+        if(blocks->valid(completed.handle, completed.gen)) {
             got = true;
+            return completed.handle;
         }
+    }
+    return SharedBlockMap::NO_BLOCK;
+}
 
-        it_read++;
-        if(it_block != _mmap.getMmap()->end()) {
-            break;
+bool SharedFlowAccum::wait(const TimeHandler::usecs_t & timeout)
+{
+    auto seen = _notify->sequence();
+    for(auto & shard : _shards) {
+        if(shard->completed->size()) {
+            // Queued block becomes ready after expiration interval, caller rechecks then
+            TimeHandler::usecs_t ready_in = Block::DEFAULT_BLOCK_EXPIRATION_TIME_MS;
+            _notify->wait(seen, std::min(timeout, ready_in));
+            return true;
         }
-    } while(it_read != it_last_read);
-
-    _mmap.unlock();
-
-    return it_block;
+    }
+    return _notify->wait(seen, timeout);
 }
 
-void SharedFlowAccum::erase(shm_mmap_it it_mmap)
+void SharedFlowAccum::erase(const block_handle_t & handle)
 {
-    _mmap.lock();
-    _mmap.getMmap()->erase(it_mmap);
-    _mmap.unlock();
+    auto & shard = shardOf(handle);
+    auto local = localHandle(handle);
+    scoped_lock<RobustMutex> lock(*shard.mutex);
+
+    // Slot will be reused: writer must not keep it as current block of the flow or out-of-order run
+    auto it_flow_ctx = shard.active_flows->find(FlowSeqKeyCtx::getFlowIdx(shard.blocks->key(local)));
+    if(it_flow_ctx) {
+        for(auto & side_ctx : it_flow_ctx->sides) {
+            if(side_ctx.block == local) {
+                side_ctx.block = SharedBlockMap::NO_BLOCK;
+            }
+            side_ctx.reassembly.removeBlock(local, TimeHandler::Instance()->get_time_usecs());
+        }
+    }
+
+    shard.blocks->erase(local);
+    if(it_flow_ctx) {
+        for(auto & side_ctx : it_flow_ctx->sides) {
+            track_hole(shard, &side_ctx);
+        }
+    }
 }
 
 void SharedFlowAccum::markExpiredBlocks()
 {
-    _mmap.lock();
+    for(auto & shard_ptr : _shards) {
+        auto & shard = *shard_ptr;
+        scoped_lock<RobustMutex> lock(*shard.mutex);
+
+        auto now = TimeHandler::Instance()->get_time_usecs();
+        // Holes of idle flows: nothing calls put() for them
+        for(auto handle = shard.blocks->firstDeadline(HOLE_DEADLINES); handle; handle = shard.blocks->firstDeadline(HOLE_DEADLINES)) {
+            auto key = shard.blocks->key(handle);
+            auto it_flow_ctx = shard.active_flows->find(FlowSeqKeyCtx::getFlowIdx(key));
+            auto side_ctx = it_flow_ctx ? &it_flow_ctx->sides[FlowSeqKeyCtx::getFlowSide(key)] : nullptr;
+            if(!side_ctx || side_ctx->hole_block != handle || !side_ctx->reassembly.size()) {
+                shard.blocks->cancelDeadline(handle, HOLE_DEADLINES);
+                continue;
+            }
+            if(now - side_ctx->reassembly.holeTs() <= REASSEMBLY_TIMEOUT) {
+                break;
+            }
+            flush_holes(shard, side_ctx);
+        }
 
-    auto it_mmap = _mmap.getMmap()->begin();
-    while(it_mmap != _mmap.getMmap()->end()) {
-        if(!it_mmap->second.is_complete && it_read->second.expired(TimeHandler::Instance()->get_time_usecs())) {
-            it_mmap->second.is_complete = true;
+        // Blocks of out-of-order runs are held and don't expire
+        for(auto handle = shard.blocks->firstDeadline(BLOCK_DEADLINES); handle; handle = shard.blocks->firstDeadline(BLOCK_DEADLINES)) {
+            auto block = shard.blocks->block(handle);
+            if(block->is_complete || !block->update_timestamp) {
+                shard.blocks->cancelDeadline(handle, BLOCK_DEADLINES);
+                continue;
+            }
+            if(!block->expired(now)) {
+                break;
+            }
             // Finaly block can be handled when time interval after mark close expired.
-            it_mmap->second.update_ts();
+            complete_block(shard, handle);
         }
-        it_mmap++;
     }
-
-    _mmap.unlock();
 }
 
-SharedFlowAccum::shm_mmap_it SharedFlowAccum::getLowerBoundBlock(flow_seq_key_t key, bool &got)
+SharedFlowAccum::block_handle_t SharedFlowAccum::getLowerBoundBlock(flow_seq_key_t key, bool &got)
 {
-    _mmap.lock();
-    got = false;
-
-    if(_mmap.getMmap()->empty()) {
-        return _mmap.getMmap()->end();
+    auto & shard = shardOfFlow(FlowSeqKeyCtx::getFlowIdx(key));
+    SharedBlockMap::handle_t handle;
+    {
+        scoped_lock<RobustMutex> lock(*shard.mutex);
+        handle = shard.blocks->lowerBound(key);
     }
 
-    auto it_lb_block = _mmap.getMmap()->lower_bound(key);
-    if(it_lb_block != _mmap.getMmap()->end()) {
-        got = true;
+    got = handle != SharedBlockMap::NO_BLOCK;
+    return globalHandle(shard, handle);
+}
+
+SharedFlowAccum::block_handle_t SharedFlowAccum::getNextBlock(const block_handle_t & curr_block, bool & got)
+{
+    auto & shard = shardOf(curr_block);
+    SharedBlockMap::handle_t handle;
+    {
+        scoped_lock<RobustMutex> lock(*shard.mutex);
+        handle = shard.blocks->next(localHandle(curr_block));
     }
 
-    _mmap.unlock();
-    return it_lb_block;
+    got = handle != SharedBlockMap::NO_BLOCK;
+    return globalHandle(shard, handle);
 }
 
-SharedFlowAccum::shm_mmap_it SharedFlowAccum::getNextBlock(SharedFlowAccum::shm_mmap_it it_curr_block, bool & got)
+void SharedFlowAccum::complete_block(Shard & shard, const SharedBlockMap::handle_t & handle)
 {
-    _mmap.lock();
-    got = true;
-    auto it_next_block = _mmap.getMmap()->end();
+    auto block = shard.blocks->block(handle);
+    if(block->is_complete) {
+        return;
+    }
+    block->is_complete = true;
+    block->update_ts();
+    shard.blocks->cancelDeadline(handle, BLOCK_DEADLINES);
 
-    if(_mmap.getMmap()->empty()) {
-        got = false;
-        return _mmap.getMmap()->end();
+    if(!shard.completed->push({ handle, shard.blocks->generation(handle) }) && !(shard.queue_overflow++ % 1000)) {
+        LOG_ERR(DEBUG_TCP_ACCUM, "Completion queue of shard %lu is full, %lu blocks are not delivered\n", shard.index, shard.queue_overflow);
     }
+    _notify->notify();
+}
 
-    if(std::next(it_curr_block) == _mmap.getMmap()->end()) {
-        it_next_block = _mmap.getMmap()->begin();
+SharedBlockMap::handle_t SharedFlowAccum::new_block(Shard & shard, const flow_seq_key_t & key, const Block::BlockType & type, const size_t & size_class)
+{
+    auto handle = shard.blocks->emplace(key, type, size_class);
+    if(!handle && !(shard.no_space++ % 1000)) {
+        LOG_ERR(DEBUG_TCP_ACCUM, "No space for new block in shard %lu (%lu blocks), %lu packets dropped\n", shard.index, shard.blocks->capacity(), shard.no_space);
     }
-    else {
-        it_next_block = std::next(it_curr_block);
+    return handle;
+}
+
+void SharedFlowAccum::adapt_size_class(flow_side_ctx_it side_ctx, const Block * block)
+{
+    // Flow filled more than half of block before it expired: next one is bigger.
+    // Data would fit twice to smaller class: next one is smaller.
+    auto size_class = side_ctx->size_class;
+    if(size_class < Block::SIZE_CLASSES - 1 && block->data_len > block->block_size / 2) {
+        side_ctx->size_class++;
     }
+    else if(size_class > 0 && block->data_len <= Block::classSize(size_class - 1) / 2) {
+        side_ctx->size_class--;
+    }
+}
 
-    if(it_next_block == it_curr_block) {
-        got = false;
+SharedFlowAccum::active_flow_ctx_it SharedFlowAccum::put_start_flow_block(Shard & shard, Tcp<Pkt> & pkt, const FlowSeqKeyCtx & key_ctx)
+{
+    uint32_t curr_seq = LS_ntohl(pkt->sequence) + (pkt->syn ? 1 : 0);
+    auto handle = new_block(shard, key_ctx.prepare(), Block::BlockType::START_FLOW);
+
+    // TODO Serialize PacketDetails to data
+    if(handle) {
+        // Flow handler takes ISN from start block
+        BlockL4Wrapper l4_block_start(shard.blocks->block(handle), curr_seq, true, curr_seq);
+        complete_block(shard, handle);
     }
 
-    _mmap.unlock();
-    return it_next_block;
+    // Insert to actual flows map, but doesn't create new buffer. Sides are started by their first packets.
+    ActiveFlowContext flow_ctx = {};
+    return shard.active_flows->insert(key_ctx.idx, flow_ctx).first;
 }
 
-void SharedFlowAccum::create_flow_block(active_flow_ctx_it it_flow_ctx, const FlowSeqKeyCtx & key_ctx)
+void SharedFlowAccum::close_block(Shard & shard, flow_side_ctx_it side_ctx)
 {
-    _mmap.lock();
-    auto it_new_block = _mmap.emplace(key_ctx.prepare(), Block(Block::BlockType::L4_PAYLOAD));
-    _mmap.unlock();
-    it_flow_ctx->second.it_mmap = it_new_block;
-
-    BlockL4Wrapper l4_block_new(&it_flow_ctx->second.it_mmap->second, true, it_flow_ctx->second.isn, key_ctx.seq);
-    it_flow_ctx->second.it_mmap->second.update_ts();
-    it_flow_ctx->second.last_seq = key_ctx.seq;
+    if(!side_ctx->block) {
+        return;
+    }
 
+    complete_block(shard, side_ctx->block);
+    adapt_size_class(side_ctx, shard.blocks->block(side_ctx->block));
+    side_ctx->block = SharedBlockMap::NO_BLOCK;
 }
 
-void SharedFlowAccum::close_block_and_open_new(active_flow_ctx_it it_flow_ctx, const FlowSeqKeyCtx &key_ctx)
+bool SharedFlowAccum::reassemble(Shard & shard, flow_side_ctx_it side_ctx, const FlowSeqKeyCtx & key_ctx, const uint8_t * data, const uint32_t & data_len)
 {
-    // Close current block and put new to mmap
-    BlockL4Wrapper l4_block_prev(&it_flow_ctx->second.it_mmap->second);
-    it_flow_ctx->second.it_mmap->second.is_complete = true;
-    it_flow_ctx->second.it_mmap->second.update_ts();
+    auto & reassembly = side_ctx->reassembly;
+    if(reassembly.size() && TimeHandler::Instance()->get_time_usecs() - reassembly.holeTs() > REASSEMBLY_TIMEOUT) {
+        flush_holes(shard, side_ctx);
+    }
+    if(!data_len) {
+        return false;
+    }
+
+    reassembly_t::Part parts[reassembly_t::MAX_PARTS];
+    uint32_t duplicate;
+    auto count = reassembly.split(key_ctx.seq, data_len, parts, duplicate);
+    shard.retransmitted_bytes += duplicate;
+    bool in_order = count == 1 && !duplicate && parts[0].seq == reassembly.next();
+
+    for(size_t i = 0; i < count; i++) {
+        auto & part = parts[i];
+        // Hole before the part is abandoned if part is too far ahead or there is no room for one more run
+        while(part.seq != reassembly.next()) {
+            auto run = reassembly.first();
+            auto extended = reassembly.endingAt(part.seq);
+            bool no_room = reassembly.full() && !(extended && shard.blocks->block(extended->block)->hasSpace(part.len));
+            if(!no_room && !reassembly_t::before(reassembly.next() + REASSEMBLY_WINDOW, part.seq + part.len)) {
+                break;
+            }
+            skip_to(shard, side_ctx, run && reassembly_t::before(run->begin, part.seq) ? run->begin : part.seq);
+        }
 
-    // Create new block with new seq key
-    create_flow_block(it_flow_ctx, key_ctx);
+        FlowSeqKeyCtx part_key = { part.seq, key_ctx.idx, key_ctx.side };
+        if(part.seq == reassembly.next()) {
+            deliver(shard, side_ctx, part_key, data + part.offset, part.len);
+        }
+        else {
+            hold(shard, side_ctx, part_key, data + part.offset, part.len);
+        }
+    }
+    track_hole(shard, side_ctx);
+    return !in_order;
 }
 
+void SharedFlowAccum::deliver(Shard & shard, flow_side_ctx_it side_ctx, const FlowSeqKeyCtx & key_ctx, const uint8_t * data, const uint32_t & data_len)
+{
+    if(_mode == Mode::L7) {
+        append_l7(shard, side_ctx, key_ctx, data, data_len);
+    }
+    else {
+        append_l4(shard, side_ctx, key_ctx, data, data_len);
+    }
+    // Current block expires after its last update
+    if(side_ctx->block) {
+        shard.blocks->queueDeadline(side_ctx->block, BLOCK_DEADLINES);
+    }
+    side_ctx->reassembly.advance(key_ctx.seq + data_len);
+    adopt_runs(shard, side_ctx);
+}
 
-SharedFlowAccum::active_flow_ctx_it SharedFlowAccum::put_start_flow_block(Tcp<Pkt> & pkt, const FlowSeqKeyCtx & key_ctx)
+void SharedFlowAccum::append_l4(Shard & shard, flow_side_ctx_it side_ctx, const FlowSeqKeyCtx & key_ctx, const uint8_t * data, const uint32_t & data_len)
 {
-    uint32_t curr_seq = LS_ntohl(pkt->sequence) + (pkt->syn ? 1 : 0);
-    _mmap.lock();
-    auto it_mmap = _mmap.emplace(key_ctx.prepare(), Block(Block::BlockType::L4_PAYLOAD));
-    _mmap.unlock();
+    // Segment bigger than the biggest block goes as several messages
+    for(uint32_t offset = 0; offset < data_len; ) {
+        uint32_t len = std::min(data_len - offset, BlockL4Wrapper::maxMessage());
+        seq_t seq = key_ctx.seq + offset;
+        if(side_ctx->block) {
+            auto block = shard.blocks->block(side_ctx->block);
+            if(block->is_complete || block->expired(TimeHandler::Instance()->get_time_usecs()) || !block->hasSpace(len)) {
+                close_block(shard, side_ctx);
+            }
+        }
 
-    // TODO Serialize PacketDetails to data
-    it_mmap->second.is_complete = true;
-    it_mmap->second.update_ts();
+        if(!side_ctx->block) {
+            auto size_class = std::max<size_t>(side_ctx->size_class, BlockL4Wrapper::classFor(len));
+            side_ctx->block = new_block(shard, prepare_key(seq, key_ctx.idx, key_ctx.side), Block::BlockType::L4_PAYLOAD, size_class);
+            if(!side_ctx->block) {
+                // Storage is full: rest of data is lost, readers see it by seq of next message
+                shard.lost_bytes += data_len - offset;
+                return;
+            }
+            BlockL4Wrapper l4_block_new(shard.blocks->block(side_ctx->block), seq, true, side_ctx->isn);
+        }
 
-    // Insert to actual flows map, but doesn't create new buffer.
-    return _active_flows_ctxs.insert({ key_ctx.idx, { _mmap.getMmap()->end(), curr_seq, curr_seq, TimeHandler::Instance()->get_time_usecs() }}).first;
+        // Pool of size class may be exhausted and block of smaller class is given: message is split to what fits
+        BlockL4Wrapper l4_block(shard.blocks->block(side_ctx->block));
+        len = std::min(len, l4_block.space());
+        if(!len || l4_block.push(data + offset, len, seq) != BlockL4Wrapper::Code::Ok) {
+            close_block(shard, side_ctx);
+            shard.lost_bytes += data_len - offset;
+            return;
+        }
+        offset += len;
+    }
 }
 
-void SharedFlowAccum::push_data_to_block(active_flow_ctx_it it_active_block, Tcp<Pkt> &pkt, const FlowSeqKeyCtx &key_ctx, bool retry)
+void SharedFlowAccum::append_l7(Shard & shard, flow_side_ctx_it side_ctx, const FlowSeqKeyCtx & key_ctx, const uint8_t * data, uint32_t data_len)
 {
-    BlockL4Wrapper l4_block(&it_active_block->second.it_mmap->second);
-    auto * data = pkt.data();
-    auto data_len = pkt.dataLength();
-    switch (l4_block.push(data, data_len, key_ctx.seq)) {
-    case BlockL4Wrapper::Code::InconsistentSeq: {
-        bool insert_new_block = false;
-        // Try to find previous block to push
-        auto it_prev_block = it_active_block->second.it_mmap;
-        while(true) {
-            if(it_prev_block == _mmap.getMmap()->begin()) {
-                insert_new_block = true;
-                break;
+    seq_t seq = key_ctx.seq;
+    while(data_len) {
+        if(side_ctx->block) {
+            auto block = shard.blocks->block(side_ctx->block);
+            if(block->is_complete || block->expired(TimeHandler::Instance()->get_time_usecs())) {
+                close_block(shard, side_ctx);
             }
-            it_prev_block = std::prev(it_prev_block);
+        }
 
-            if(it_prev_block == it_active_block->second.it_mmap) {
-                // We checked all previous blocks. Create new block for new pkt.
-                insert_new_block = true;
+        if(!side_ctx->block) {
+            auto size_class = std::max<size_t>(side_ctx->size_class, BlockL7Wrapper::classFor(data_len));
+            side_ctx->block = new_block(shard, prepare_key(seq, key_ctx.idx, key_ctx.side), Block::BlockType::L7_PAYLOAD, size_class);
+            if(!side_ctx->block) {
+                // Storage is full: rest of data is lost, next block reports it as gap
+                side_ctx->gap += data_len;
+                shard.lost_bytes += data_len;
                 break;
             }
+            BlockL7Wrapper l7_block_new(shard.blocks->block(side_ctx->block), true, side_ctx->gap);
+            side_ctx->gap = 0;
+        }
 
-            if(FlowSeqKeyCtx::getFlowIdx(it_prev_block->first) != key_ctx.idx || FlowSeqKeyCtx::getFlowSide(it_prev_block->first) != key_ctx.side) {
-                // Can be sitiation when tcp seq reach max value and need to find pre max tcp seq value
-                auto it_prev_max_block = _mmap.getMmap()->lower_bound(FlowSeqKeyCtx((unsigned)-1, key_ctx.idx, key_ctx.side).prepare());
-                if(it_prev_max_block != _mmap.getMmap()->end()) {
-                    // We found pre max values of tcp seq. Set iterator and try to move backward from this.
-                    // No needs to decrease iterator -- now, because it will be performed in cycle.
-                    it_prev_block = it_prev_max_block;
-                    continue;
-                }
+        // Stream may be split at any byte: block is closed when full and the rest goes to the next one
+        BlockL7Wrapper l7_block(shard.blocks->block(side_ctx->block));
+        auto taken = l7_block.append(data, data_len);
+        data += taken;
+        data_len -= taken;
+        seq += taken;
+        if(!l7_block.space()) {
+            close_block(shard, side_ctx);
+        }
+    }
+}
 
-                // No more previous blocks for current flow. Insert new block.
-                insert_new_block = true;
-                break;
+void SharedFlowAccum::hold(Shard & shard, flow_side_ctx_it side_ctx, const FlowSeqKeyCtx & key_ctx, const uint8_t * data, uint32_t data_len)
+{
+    auto & reassembly = side_ctx->reassembly;
+    seq_t seq = key_ctx.seq;
+    reassembly_t::Segment * run = nullptr;
+    // Segment bigger than the rest of run block continues in the next run. Run ends at the last stored byte:
+    // bytes which can't be stored stay a hole.
+    while(data_len) {
+        run = reassembly.endingAt(seq);
+        uint32_t space = run ? hold_space(shard.blocks->block(run->block)) : 0;
+        if(!space) {
+            // Run is extended by following segments until the hole is filled: it takes the biggest block,
+            // otherwise every segment would need its own run
+            auto type = _mode == Mode::L7 ? Block::BlockType::L7_PAYLOAD : Block::BlockType::L4_PAYLOAD;
+            auto handle = new_block(shard, prepare_key(seq, key_ctx.idx, key_ctx.side), type, Block::SIZE_CLASSES - 1);
+            if(!handle) {
+                // Bytes are lost, hole before next run becomes bigger
+                return;
             }
-            BlockL4Wrapper l4_block_prev(&it_prev_block->second);
-            if(key_ctx.seq >= FlowSeqKeyCtx::getSeq(it_prev_block->first) && key_ctx.seq <= l4_block_prev.getLastSeqInBlock()) {
-                // This is retransmission - drop
-                break;
+            if(_mode == Mode::L7) {
+                BlockL7Wrapper l7_block_new(shard.blocks->block(handle), true);
             }
-            // Potential insertion block
-            else if(key_ctx.seq >= FlowSeqKeyCtx::getSeq(it_prev_block->first) &&
-                    key_ctx.seq > l4_block_prev.getLastSeqInBlock() &&
-                    !l4_block_prev.block->is_complete && l4_block_prev.block->hasSpace(data_len)) {
-                // Try to append data to block
-                if(l4_block_prev.push(data, data_len, key_ctx.seq) != BlockL4Wrapper::Code::Ok) {
-                    // Need to open new block.
-                    insert_new_block = true;
-                    break;
-                }
+            else {
+                BlockL4Wrapper l4_block_new(shard.blocks->block(handle), seq, true, side_ctx->isn);
             }
-
+            run = reassembly.insert({ seq, seq, handle }, TimeHandler::Instance()->get_time_usecs());
+            if(!run) {
+                // Caller abandons holes to make room for the first run, the rest of segment stays a hole
+                shard.blocks->erase(handle);
+                return;
+            }
+            space = hold_space(shard.blocks->block(handle));
         }
 
-        if(insert_new_block) {
-            // Can't find new block -> insert new
-            auto it_new_block = _mmap.emplace(key_ctx.prepare(), Block(Block::BlockType::L4_PAYLOAD));
-            BlockL4Wrapper l4_block_new(&it_new_block->second, true, it_active_block->second.isn, key_ctx.seq);
-            l4_block_new.push(data, data_len, key_ctx.seq);
-            it_new_block->second.update_ts();
+        auto block = shard.blocks->block(run->block);
+        uint32_t len = std::min(data_len, space);
+        if(_mode == Mode::L7) {
+            BlockL7Wrapper(block).append(data, len);
+        }
+        else {
+            BlockL4Wrapper(block).push(data, len, seq);
         }
-        break;
+        // Readers must not get run before the hole is resolved
+        block->hold();
+        data += len;
+        data_len -= len;
+        seq += len;
+        run->end = seq;
+    }
+    if(!run) {
+        return;
+    }
+    auto block = shard.blocks->block(run->block);
+
+    // Hole between runs is filled: following run joins this one, so its entry is free for the next hole
+    auto next = reassembly.startingAt(run->end);
+    if(next) {
+        auto next_block = shard.blocks->block(next->block);
+        bool merged = _mode == Mode::L7 ? BlockL7Wrapper(block).merge(BlockL7Wrapper(next_block)) : BlockL4Wrapper(block).merge(BlockL4Wrapper(next_block));
+        if(merged) {
+            auto next_handle = next->block;
+            run->end = next->end;
+            // Removed entry follows run, run stays valid
+            reassembly.removeBlock(next_handle, TimeHandler::Instance()->get_time_usecs());
+            shard.blocks->erase(next_handle);
+        }
+    }
+}
+
+uint32_t SharedFlowAccum::hold_space(Block * block) const
+{
+    return _mode == Mode::L7 ? BlockL7Wrapper(block).space() : BlockL4Wrapper(block).space();
+}
+
+void SharedFlowAccum::skip_to(Shard & shard, flow_side_ctx_it side_ctx, const seq_t & seq)
+{
+    auto & reassembly = side_ctx->reassembly;
+    uint32_t lost = seq - reassembly.next();
+    if(!lost) {
+        return;
     }
 
-    case BlockL4Wrapper::Code::NoBlock:
-    case BlockL4Wrapper::Code::NoSpace:
-    case BlockL4Wrapper::Code::BlockClosed: {
-        // CLose current block if needed and open new and try to write
-        close_block_and_open_new(it_active_block, key_ctx);
+    // Data after the hole goes to a new block
+    close_block(shard, side_ctx);
+    side_ctx->gap += lost;
+    shard.abandoned_bytes += lost;
+    reassembly.advance(seq);
+    adopt_runs(shard, side_ctx);
+}
 
-        if(!retry) {
-            push_data_to_block(it_active_block, pkt, key_ctx, true);
+void SharedFlowAccum::adopt_runs(Shard & shard, flow_side_ctx_it side_ctx)
+{
+    // Blocks of contiguous runs become current ones without copying
+    auto & reassembly = side_ctx->reassembly;
+    for(auto run = reassembly.first(); run && run->begin == reassembly.next(); run = reassembly.first()) {
+        close_block(shard, side_ctx);
+        auto block = shard.blocks->block(run->block);
+        if(_mode == Mode::L7) {
+            BlockL7Wrapper(block).setGap(side_ctx->gap);
         }
-        break;
+        side_ctx->gap = 0;
+        block->update_ts();
+        side_ctx->block = run->block;
+        shard.blocks->queueDeadline(side_ctx->block, BLOCK_DEADLINES);
+        reassembly.advance(run->end);
+        reassembly.popFirst(TimeHandler::Instance()->get_time_usecs());
+    }
+}
+
+void SharedFlowAccum::flush_holes(Shard & shard, flow_side_ctx_it side_ctx)
+{
+    for(auto run = side_ctx->reassembly.first(); run; run = side_ctx->reassembly.first()) {
+        skip_to(shard, side_ctx, run->begin);
+    }
+    track_hole(shard, side_ctx);
+}
+
+void SharedFlowAccum::track_hole(Shard & shard, flow_side_ctx_it side_ctx)
+{
+    auto run = side_ctx->reassembly.first();
+    if(run && run->block == side_ctx->hole_block && side_ctx->reassembly.holeTs() == side_ctx->hole_ts) {
+        return;
     }
-    case BlockL4Wrapper::Code::PushError: {
-        LOG_MESS(DEBUG_TCP_ACCUM, "Unhandled case during push data to block!\n");
-        break;
+    // Old first run may be erased meanwhile and its slot reused
+    if(side_ctx->hole_block && shard.blocks->valid(side_ctx->hole_block, side_ctx->hole_gen)) {
+        shard.blocks->cancelDeadline(side_ctx->hole_block, HOLE_DEADLINES);
     }
-    default: break;
+    side_ctx->hole_block = SharedBlockMap::NO_BLOCK;
+    if(run) {
+        shard.blocks->queueDeadline(run->block, HOLE_DEADLINES);
+        side_ctx->hole_block = run->block;
+        side_ctx->hole_gen = shard.blocks->generation(run->block);
+        side_ctx->hole_ts = side_ctx->reassembly.holeTs();
     }
 }
+
+void SharedFlowAccum::end_flow(Shard & shard, active_flow_ctx_it it_flow_ctx, const FlowSeqKeyCtx & key_ctx)
+{
+    for(auto & side_ctx : it_flow_ctx->sides) {
+        flush_holes(shard, &side_ctx);
+        close_block(shard, &side_ctx);
+    }
+
+    // END_FLOW follows all data of the side which ended the flow
+    auto handle = new_block(shard, prepare_key(it_flow_ctx->sides[key_ctx.side].reassembly.next(), key_ctx.idx, key_ctx.side), Block::BlockType::END_FLOW);
+    if(handle) {
+        complete_block(shard, handle);
+    }
+
+    shard.active_flows->erase(key_ctx.idx);
+}
+
+void SharedFlowAccum::reportResizeLatency(Shard & shard)
+{
+    auto stats = shard.active_flows->stats();
+    if(stats.resizing_to) {
+        LOG_MESS(DEBUG_TCP_ACCUM, "Active flows table of shard %lu is resizing to %lu buckets (%lu flows). put() during resize: %lu pkts, p50 %lu ns, p99 %lu ns, max %lu ns\n",
+                 shard.index, stats.resizing_to, stats.size, shard.resize_latency.count(), shard.resize_latency.percentile(50), shard.resize_latency.percentile(99), shard.resize_latency.max());
+        return;
+    }
+    LOG_MESS(DEBUG_TCP_ACCUM, "Active flows table of shard %lu resized to %lu buckets (%lu flows, %lu migrated total). put() during resize: %lu pkts, p50 %lu ns, p99 %lu ns, max %lu ns\n",
+             shard.index, stats.buckets, stats.size, stats.migrated, shard.resize_latency.count(), shard.resize_latency.percentile(50), shard.resize_latency.percentile(99), shard.resize_latency.max());
+    shard.resize_latency.reset();
+}
+
+void SharedFlowAccum::print(FILE * file)
+{
+    for(auto & shard_ptr : _shards) {
+        auto & shard = *shard_ptr;
+        scoped_lock<RobustMutex> lock(*shard.mutex);
+        auto stats = shard.active_flows->stats();
+        fprintf(file, "Flow accumulator shard %lu: %lu flows in %lu buckets, %lu resizes (%lu failed), %lu blocks of %lu\n", shard.index, stats.size, stats.buckets,
+                stats.resizes, stats.failed_resizes, shard.blocks->size(), shard.blocks->capacity());
+        if(stats.resizing_to) {
+            fprintf(file, "  resizing to %lu buckets, put() %lu pkts: p50 %lu ns, p99 %lu ns, max %lu ns\n", stats.resizing_to, shard.resize_latency.count(),
+                    shard.resize_latency.percentile(50), shard.resize_latency.percentile(99), shard.resize_latency.max());
+        }
+        fprintf(file, "  retransmitted %lu bytes, abandoned %lu bytes, lost %lu bytes, no space %lu, queue overflow %lu\n", shard.retransmitted_bytes,
+                shard.abandoned_bytes, shard.lost_bytes, shard.no_space, shard.queue_overflow);
+    }
+}
+
+void SharedFlowAccum::reportReassemblyLatency(Shard & shard)
+{
+    LOG_MESS(DEBUG_TCP_ACCUM, "Shard %lu reassembly: %lu out-of-order pkts, put() p50 %lu ns, p99 %lu ns, max %lu ns. Retransmitted %lu bytes, abandoned %lu bytes, lost %lu bytes\n",
+             shard.index, shard.reassembly_latency.count(), shard.reassembly_latency.percentile(50), shard.reassembly_latency.percentile(99), shard.reassembly_latency.max(),
+             shard.retransmitted_bytes, shard.abandoned_bytes, shard.lost_bytes);
+    shard.reassembly_latency.reset();
+}
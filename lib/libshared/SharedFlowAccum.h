@@ -4,9 +4,19 @@
 
 #include <unordered_map>
 #include <utility>
+#include <vector>
+#include <memory>
 
-#include "SharedMap.h"
+#include <boost/interprocess/sync/scoped_lock.hpp>
+
+#include "SharedIO.h"
+#include "RobustMutex.h"
+#include "SharedBlockMap.h"
+#include "SharedCompletionQueue.h"
+#include "TcpReassembly.h"
+#include "FlowTable.h"
 #include "Debug.h"
+#include "../LatencyStat.h"
 #include "../core/Packet.h"
 #include "../libstack/Tcp.h"
 #include "../libstack/Block.h"
@@ -38,7 +48,7 @@ struct FlowSeqKeyCtx {
     }
 
     static flow_side_t getFlowSide(const flow_seq_key_t & key) {
-        return (key & 0x80000000) >> 32;
+        return (key >> 63) & 1;
     }
 
     static seq_t getSeq(const flow_seq_key_t & key) {
@@ -48,37 +58,219 @@ struct FlowSeqKeyCtx {
 
 class SharedFlowAccum {
 public:
-    typedef SharedMultimap<flow_seq_key_t, Block>::iterator shm_mmap_it;
+    // Shard number in high 32 bits, SharedBlockMap handle in low 32 bits. 0 - no block.
+    typedef uint64_t block_handle_t;
+    static const block_handle_t NO_BLOCK = 0;
+
+    /*
+     * Both modes reassemble every flow side: retransmitted and overlapping bytes are dropped, out-of-order data
+     * waits for the hole before it at most REASSEMBLY_TIMEOUT and REASSEMBLY_WINDOW bytes ahead, then the hole is abandoned.
+     * Blocks of a flow side hold contiguous data, block key is seq of its first byte.
+     */
+    enum class Mode: uint32_t {
+        // L4_PAYLOAD blocks: TCP segments with length prefix, segment boundaries are kept
+        L4,
+        // L7_PAYLOAD blocks: byte stream of every flow side, missing bytes are marked as gap.
+        // Flow is wrapped by START_FLOW and END_FLOW (FIN from both sides or RST) blocks.
+        L7,
+    };
 
-    SharedFlowAccum(const std::string shm_name, const size_t & length = 0, bool create = false);
+    /*
+     * Accumulator is split to shards by flow_idx_t, every shard is a separate shared memory segment
+     * with its own mutex, blocks and active flow contexts. All blocks of a flow live in one shard,
+     * so writers and readers working on different flows don't contend.
+     * Shard 0 is named shm_name, others shm_name_<N>. Reader takes number of shards from shard 0.
+     *
+     * Blocks and active flow contexts survive process restart.
+     * create == false: attach to segments left by previous process (warm restart) or open new ones.
+     * Writer (length != 0) recreates segments if they were built with incompatible layout or shards number.
+     * length is a total size for all shards.
+     * Mode is chosen by writer, reader takes it from shard 0.
+     */
+    SharedFlowAccum(const std::string shm_name, const size_t & length = 0, bool create = false, size_t shards = CONFIG_FLOWACCUM_SHARDS, Mode mode = Mode::L4);
     ~SharedFlowAccum();
 
     void put(Tcp<Pkt> && pkt, const flow_idx_t &idx, const flow_side_t &side);
-    shm_mmap_it get(bool & got);
-    void erase(shm_mmap_it it_mmap);
+    // Pops the oldest completed block which is ready for reading, O(1)
+    block_handle_t get(bool & got);
+    // Sleeps until some block is completed by writer or timeout. Returns false on timeout.
+    bool wait(const TimeHandler::usecs_t & timeout);
+    void erase(const block_handle_t & handle);
+    // Completes expired blocks and abandons timed out holes. Only due ones are visited: they are at head of deadline lists.
     void markExpiredBlocks();
+    // Writer: shard counters for stats file, put() latency of active flows table resize while it runs
+    void print(FILE * file);
+
+    // First block of flow side with seq >= key seq, then following blocks of the same flow side in seq order
+    block_handle_t getLowerBoundBlock(flow_seq_key_t key, bool & got);
+    block_handle_t getNextBlock(const block_handle_t & curr_block, bool & got);
+
+    // Block stays valid until erase()
+    Block * block(const block_handle_t & handle)
+    {
+        return shardOf(handle).blocks->block(localHandle(handle));
+    }
+
+    flow_seq_key_t key(const block_handle_t & handle)
+    {
+        return shardOf(handle).blocks->key(localHandle(handle));
+    }
+
+    size_t shards() const
+    {
+        return _shards.size();
+    }
 
-    shm_mmap_it getLowerBoundBlock(flow_seq_key_t key, bool & got);
-    shm_mmap_it getNextBlock(SharedFlowAccum::shm_mmap_it it_curr_block, bool & got);
+    Mode mode() const
+    {
+        return _mode;
+    }
 private:
-    typedef SharedMultimap<flow_seq_key_t, Block> shm_mmap_t;
-    shm_mmap_t _mmap;
+    static const size_t REASSEMBLY_SEGMENTS = 8;
+    static const uint32_t REASSEMBLY_WINDOW = 1024 * 1024;
+    static const TimeHandler::usecs_t REASSEMBLY_TIMEOUT = 200 * 1000;
+    // put() latency of out-of-order segments is reported every REASSEMBLY_REPORT of them
+    static const uint64_t REASSEMBLY_REPORT = 100000;
+    // put() latency while active flows table is resizing is reported every RESIZE_REPORT packets and when resize is over
+    static const uint64_t RESIZE_REPORT = 10000;
+    // SharedBlockMap deadline lists: current blocks by last update, first runs by start of the hole before them
+    static const size_t BLOCK_DEADLINES = 0;
+    static const size_t HOLE_DEADLINES = 1;
 
-    struct ActiveFlowContext {
-        shm_mmap_it it_mmap;
+    typedef TcpReassembly<SharedBlockMap::handle_t, REASSEMBLY_SEGMENTS> reassembly_t;
+
+    struct FlowSideContext {
+        SharedBlockMap::handle_t block;
         seq_t isn;
-        seq_t last_seq;
+        // Bytes lost before next block (L7 gap marker)
+        uint32_t gap;
+        // Block::SIZE_CLASSES index for next block, follows flow rate
+        uint8_t size_class;
+        bool started;
+        bool fin;
+        // Next expected seq and out-of-order runs
+        reassembly_t reassembly;
+        // First run queued to HOLE_DEADLINES and hole time it was queued with
+        SharedBlockMap::handle_t hole_block;
+        uint32_t hole_gen;
+        TimeHandler::usecs_t hole_ts;
+    };
+
+    struct ActiveFlowContext {
+        FlowSideContext sides[2];
         TimeHandler::usecs_t update_ts;
     };
 
-    std::unordered_map<flow_idx_t, ActiveFlowContext> _active_flows_ctxs;
-    typedef std::unordered_map<flow_idx_t, ActiveFlowContext>::iterator active_flow_ctx_it;
+    typedef allocator<ActiveFlowContext, managed_shared_memory::segment_manager> active_flows_alloc_t;
+    typedef FlowTable<flow_idx_t, ActiveFlowContext, active_flows_alloc_t> active_flows_table_t;
+    typedef ActiveFlowContext * active_flow_ctx_it;
+    typedef FlowSideContext * flow_side_ctx_it;
+
+    // Describes layout of shared segment. Segment is reused only by the same layout.
+    struct SegmentHdr {
+        static const uint32_t MAGIC = 0x4d524641; // MRFA
+        static const uint32_t VERSION = 10;
+
+        SegmentHdr(const uint32_t & shards, const uint32_t & shard, const Mode & mode): shards(shards), shard(shard), mode(mode) { }
+
+        uint32_t magic = MAGIC;
+        uint32_t version = VERSION;
+        uint32_t block_size = sizeof(Block);
+        uint32_t flow_ctx_size = sizeof(ActiveFlowContext);
+        uint32_t shards;
+        uint32_t shard;
+        Mode mode;
+
+        bool compatible() const
+        {
+            return magic == MAGIC && version == VERSION && block_size == sizeof(Block) && flow_ctx_size == sizeof(ActiveFlowContext);
+        }
+    };
+    static bool attachable(const std::string & shm_name, const size_t & shards, const Mode & mode);
+
+    // Handle is checked by generation on pop: block could be erased by flow handler while queued
+    struct CompletedBlock {
+        SharedBlockMap::handle_t handle;
+        uint32_t gen;
+    };
+    typedef SharedCompletionQueue<CompletedBlock> completion_queue_t;
+    static std::string shardName(const std::string & shm_name, const size_t & shard);
+
+    // All fields are protected by mutex
+    struct Shard {
+        Shard(const std::string & shm_name, const size_t & index, const size_t & length, bool create): io(shm_name.c_str(), length, create), index(index) { }
+
+        SharedIO io;
+        size_t index;
+        RobustMutex * mutex = nullptr;
+        SharedBlockMap * blocks = nullptr;
+        active_flows_table_t * active_flows = nullptr;
+        // Blocks in order of completion
+        completion_queue_t * completed = nullptr;
+        // Per packet put() latency, collected only while active flows table is resizing
+        LatencyStat resize_latency;
+        // put() latency of segments which were not in order
+        LatencyStat reassembly_latency;
+        uint64_t no_space = 0;
+        uint64_t queue_overflow = 0;
+        uint64_t retransmitted_bytes = 0;
+        uint64_t abandoned_bytes = 0;
+        // In-order bytes which got no block
+        uint64_t lost_bytes = 0;
+    };
+    std::vector<std::unique_ptr<Shard>> _shards;
+    Mode _mode;
+    // Shared by all shards, placed in shard 0
+    SharedNotify * _notify;
+    // Next shard to read by get()
+    size_t _read_shard;
+
+    Shard & shardOfFlow(const flow_idx_t & idx)
+    {
+        return *_shards[idx % _shards.size()];
+    }
+
+    Shard & shardOf(const block_handle_t & handle)
+    {
+        return *_shards[handle >> 32];
+    }
+
+    static SharedBlockMap::handle_t localHandle(const block_handle_t & handle)
+    {
+        return (SharedBlockMap::handle_t)handle;
+    }
+
+    static block_handle_t globalHandle(const Shard & shard, const SharedBlockMap::handle_t & handle)
+    {
+        return handle ? ((block_handle_t)shard.index << 32) | handle : NO_BLOCK;
+    }
+
+    void reportResizeLatency(Shard & shard);
+    void reportReassemblyLatency(Shard & shard);
 
-    // Writer
-    void create_flow_block(active_flow_ctx_it current_block, const FlowSeqKeyCtx & key_ctx);
-    void close_block_and_open_new(active_flow_ctx_it current_block, const FlowSeqKeyCtx & key_ctx);
-    active_flow_ctx_it put_start_flow_block(Tcp<Pkt> &pkt, const FlowSeqKeyCtx & key_ctx);
-    void push_data_to_block(active_flow_ctx_it it_active_block, Tcp<Pkt> &pkt, const FlowSeqKeyCtx & key_ctx, bool retry = false);
-    // Reader
-    shm_mmap_it it_read;
+    // Writer, shard must be locked
+    void complete_block(Shard & shard, const SharedBlockMap::handle_t & handle);
+    SharedBlockMap::handle_t new_block(Shard & shard, const flow_seq_key_t & key, const Block::BlockType & type, const size_t & size_class = 0);
+    void adapt_size_class(flow_side_ctx_it side_ctx, const Block * block);
+    active_flow_ctx_it put_start_flow_block(Shard & shard, Tcp<Pkt> &pkt, const FlowSeqKeyCtx & key_ctx);
+    void close_block(Shard & shard, flow_side_ctx_it side_ctx);
+    // Returns false if segment was in order
+    bool reassemble(Shard & shard, flow_side_ctx_it side_ctx, const FlowSeqKeyCtx & key_ctx, const uint8_t * data, const uint32_t & data_len);
+    // In-order data at reassembly edge
+    void deliver(Shard & shard, flow_side_ctx_it side_ctx, const FlowSeqKeyCtx & key_ctx, const uint8_t * data, const uint32_t & data_len);
+    void append_l4(Shard & shard, flow_side_ctx_it side_ctx, const FlowSeqKeyCtx & key_ctx, const uint8_t * data, const uint32_t & data_len);
+    void append_l7(Shard & shard, flow_side_ctx_it side_ctx, const FlowSeqKeyCtx & key_ctx, const uint8_t * data, uint32_t data_len);
+    // Out-of-order data is kept in blocks invisible for readers
+    void hold(Shard & shard, flow_side_ctx_it side_ctx, const FlowSeqKeyCtx & key_ctx, const uint8_t * data, uint32_t data_len);
+    // Bytes of out-of-order data which still fit to run block
+    uint32_t hold_space(Block * block) const;
+    // Abandons hole up to seq, then runs which became contiguous are delivered
+    void skip_to(Shard & shard, flow_side_ctx_it side_ctx, const seq_t & seq);
+    void adopt_runs(Shard & shard, flow_side_ctx_it side_ctx);
+    void flush_holes(Shard & shard, flow_side_ctx_it side_ctx);
+    // First run is queued again when hole before it changed
+    void track_hole(Shard & shard, flow_side_ctx_it side_ctx);
+    void end_flow(Shard & shard, active_flow_ctx_it it_flow_ctx, const FlowSeqKeyCtx & key_ctx);
+    // Reader, shard must be locked
+    SharedBlockMap::handle_t get_from_shard(Shard & shard, bool & got);
 };
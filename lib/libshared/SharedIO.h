@@ -3,21 +3,44 @@
 #pragma once
 
 #include <boost/interprocess/managed_shared_memory.hpp>
+#include <boost/interprocess/managed_external_buffer.hpp>
 #include <utility>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
 using namespace boost::interprocess;
+
+// Segment in memory mapped from descriptor, it has the same segment manager as managed_shared_memory
+typedef basic_managed_external_buffer<char, rbtree_best_fit<mutex_family>, iset_index> managed_fd_memory;
+
 class SharedIO
 {
 public:
+    typedef managed_shared_memory::segment_manager segment_manager_t;
+    static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
     SharedIO() = delete;
-    SharedIO(const char * filename, size_t length = 0, bool create = false)
+    SharedIO(const char * filename, size_t length = 0, bool create = false): _fd(-1), _addr(nullptr), _length(0)
     {
         try {
             if(create) {
                 shared_memory_object::remove(filename);
                 segment = boost::interprocess::managed_shared_memory(create_only, filename, length);
             }
+            else if(!length) {
+                // Reader attaches to existing segment, it can't be created without size
+                segment = boost::interprocess::managed_shared_memory(open_only, filename);
+            }
             else {
                 segment = boost::interprocess::managed_shared_memory(open_or_create, filename, length);
             }
@@ -27,21 +50,58 @@ public:
 
     }
 
-    virtual ~SharedIO()
+    /*
+     * Segment in memory of descriptor (memfd got from creator or createMemFd()), object owns the descriptor.
+     * Attacher maps the whole descriptor. There is no name in file system: memory is gone with the last descriptor and mapping.
+     */
+    SharedIO(int fd, size_t length = 0, bool create = false): _fd(fd), _addr(nullptr), _length(length)
     {
+        struct stat st;
+        if(!_length && fstat(fd, &st) == 0) {
+            _length = st.st_size;
+        }
+        void * addr = mmap(nullptr, _length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if(addr == MAP_FAILED) {
+            return;
+        }
+        _addr = addr;
+
+        try {
+            if(create) {
+                fd_segment = managed_fd_memory(create_only, _addr, _length);
+            }
+            else {
+                fd_segment = managed_fd_memory(open_only, _addr, _length);
+            }
+        }  catch (std::exception &e) {
+        }
+    }
 
+    virtual ~SharedIO()
+    {
+        if(_populate_thread.joinable()) {
+            _populate_stop->store(true, std::memory_order_relaxed);
+            _populate_thread.join();
+        }
+        if(_addr) {
+            managed_fd_memory().swap(fd_segment);
+            munmap(_addr, _length);
+        }
+        if(_fd >= 0) {
+            close(_fd);
+        }
     }
 
     SharedIO(const SharedIO &io) = delete;
 
-    SharedIO(SharedIO&& io)
+    SharedIO(SharedIO&& io): _fd(-1), _addr(nullptr), _length(0)
     {
-        segment.swap(io.getSegment());
+        swap(io);
     }
 
     SharedIO& operator=(SharedIO&& io)
     {
-        segment.swap(io.getSegment());
+        swap(io);
         return *this;
     }
 
@@ -50,6 +110,84 @@ public:
         return segment;
     }
 
+    // Manager of either segment, nullptr if it wasn't opened
+    segment_manager_t * getManager()
+    {
+        return _addr ? fd_segment.get_segment_manager() : segment.get_segment_manager();
+    }
+
+    // Memory descriptor to pass to other process, -1 for named segment
+    int getFd() const
+    {
+        return _fd;
+    }
+
+    /*
+     * Prefaults [addr, addr + length) of this mapping in background thread, so that data path doesn't take page faults
+     * and caller doesn't wait for it. Memory content isn't changed, it may be used meanwhile.
+     */
+    void populate(void * addr, size_t length)
+    {
+        if(_populate_thread.joinable()) {
+            return;
+        }
+        size_t page = sysconf(_SC_PAGESIZE);
+        uint8_t * begin = (uint8_t *)((uintptr_t)addr / page * page);
+        length += (uint8_t *)addr - begin;
+
+        _populate_stop = std::make_shared<std::atomic<bool>>(false);
+        auto stop = _populate_stop;
+        _populate_thread = std::thread([stop, begin, length, page]() {
+            size_t step = HUGE_PAGE_SIZE;
+            for(size_t offset = 0; offset < length && !stop->load(std::memory_order_relaxed); offset += step) {
+                size_t size = std::min(step, length - offset);
+                if(madvise(begin + offset, size, MADV_POPULATE_WRITE) < 0) {
+                    // Kernel before 5.14: read fault allocates page, write to it is a cheap fault later
+                    for(size_t i = 0; i < size; i += page) {
+                        (void)*(volatile uint8_t *)(begin + offset + i);
+                    }
+                }
+            }
+        });
+    }
+
+    /*
+     * Anonymous memory for SharedIO(fd), -1 on error. With hugepages `length` is rounded up to huge page,
+     * the pool (vm.nr_hugepages) must have enough pages.
+     */
+    static int createMemFd(const char * name, size_t & length, const bool & hugepages = false)
+    {
+        int fd = memfd_create(name, MFD_CLOEXEC | (hugepages ? MFD_HUGETLB : 0));
+        if(fd < 0) {
+            return -1;
+        }
+        if(hugepages) {
+            length = (length + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        }
+        if(ftruncate(fd, length) < 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
 private:
     managed_shared_memory segment;
+    managed_fd_memory fd_segment;
+    int _fd;
+    void * _addr;
+    size_t _length;
+    std::thread _populate_thread;
+    std::shared_ptr<std::atomic<bool>> _populate_stop;
+
+    void swap(SharedIO & io)
+    {
+        _populate_thread.swap(io._populate_thread);
+        _populate_stop.swap(io._populate_stop);
+        segment.swap(io.segment);
+        fd_segment.swap(io.fd_segment);
+        std::swap(_fd, io._fd);
+        std::swap(_addr, io._addr);
+        std::swap(_length, io._length);
+    }
 };
@@ -33,8 +33,9 @@ public:
             _shm_mutex = getSegment().template construct<interprocess_mutex>("shm_mutex")();
         }
         else {
-            _mmap = offset_ptr<shmMultimap>(getSegment().template find<shmMultimap>(std::string(shm_name + "_map").c_str()).first);
-            _shm_mutex = getSegment().template find<interprocess_mutex>("shm_mutex").first;
+            // Attach to map left by previous process or start empty one
+            _mmap = offset_ptr<shmMultimap>(getSegment().template find_or_construct<shmMultimap>(std::string(shm_name + "_map").c_str())(std::less<KEY_T>(), _alloc));
+            _shm_mutex = getSegment().template find_or_construct<interprocess_mutex>("shm_mutex")();
         }
     }
     SharedMultimap(const SharedMultimap & sm) = delete;
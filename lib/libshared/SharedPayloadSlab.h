@@ -0,0 +1,80 @@
+// Copyright: https://github.com/mikerez/mediaroom/blob/main/LICENSE
+
+#pragma once
+
+#include "SharedIO.h"
+#include "PayloadSlab.h"
+
+using namespace boost::interprocess;
+
+// PayloadSlab in its own segment: created by publisher, attached by subscribers by name
+class SharedPayloadSlab : public SharedIO
+{
+public:
+    static const size_t DEFAULT_CHUNK_SIZE = 2048;
+    // Part of segment left to segment manager
+    static const size_t RESERVED_SIZE = 1024;
+
+    SharedPayloadSlab() = delete;
+    SharedPayloadSlab(const std::string & filename, size_t length = 0, bool create = false, size_t chunk_size = DEFAULT_CHUNK_SIZE):
+        SharedIO(filename.c_str(), length, create), _mem_name(filename), _mem(nullptr)
+    {
+        if(create && length < RESERVED_SIZE + sizeof(Hdr) + sizeof(PayloadSlabDescriptor) + chunk_size) {
+            shared_memory_object::remove(filename.c_str());
+            throw std::runtime_error("Segment of " + std::to_string(length) + " bytes is too small for payload slab " + filename);
+        }
+
+        auto manager = getManager();
+        Hdr * hdr = nullptr;
+        if(manager && create) {
+            hdr = manager->template construct<Hdr>(std::string(filename + "_slab").c_str())();
+            // Named array would be value-initialized, so every page of it would be touched here
+            size_t mem_size = length - RESERVED_SIZE - sizeof(Hdr);
+            hdr->mem = (uint8_t *)manager->allocate_aligned(mem_size, 64, std::nothrow);
+            _mem = hdr->mem.get();
+            if(_mem) {
+                _slab.set(_mem, mem_size, chunk_size);
+                _slab.clear();
+            }
+        }
+        else if(manager) {
+            hdr = manager->template find<Hdr>(std::string(filename + "_slab").c_str()).first;
+            if(hdr && hdr->mem) {
+                _mem = hdr->mem.get();
+                _slab.attach(_mem);
+            }
+        }
+
+        if(!_mem) {
+            if(create) {
+                shared_memory_object::remove(filename.c_str());
+            }
+            std::string err = "Failed to " + std::string(create ? "create" : "find") + " shared object " + filename + "_slab object!";
+            throw std::runtime_error(err);
+        }
+    }
+
+    SharedPayloadSlab(const SharedPayloadSlab &) = delete;
+    SharedPayloadSlab & operator =(const SharedPayloadSlab &) = delete;
+
+    PayloadSlab & slab()
+    {
+        return _slab;
+    }
+
+    const std::string & name() const
+    {
+        return _mem_name;
+    }
+
+private:
+    struct Hdr
+    {
+        // Slab memory, raw allocation is not touched by creator
+        offset_ptr<uint8_t> mem;
+    };
+
+    std::string _mem_name;
+    uint8_t * _mem;
+    PayloadSlab _slab;
+};
@@ -1,22 +1,44 @@
 #include "SharedServer.h"
 
 #include "sys/ioctl.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <cstring>
+#include <algorithm>
 
 const size_t SharedCtx::default_shmem_size = 1024 * 1024 * 100;
+const uint32_t SharedCtx::default_spill_size = 1024;
+const size_t SharedServer::default_slab_size = 1024 * 1024 * 100;
 
-SharedServer::SharedServer(): _max_sd(SOCKET_ERROR), _work(false), _shm_index(0), _curr_handling_sock(SOCKET_ERROR)
+SharedServer::SharedServer(const std::string & local_path): _local_path(local_path), _unix_sock(SOCKET_ERROR), _epoll(SOCKET_ERROR), _event_fd(SOCKET_ERROR), _spilling(false), _framed(0), _work(false), _shm_index(0), _curr_handling_sock(SOCKET_ERROR)
 {
 }
 
 SharedServer::~SharedServer()
 {
-    _work = false;
+    stop();
     _ctx_map_sock.clear();
+    if(_unix_sock != SOCKET_ERROR)
+    {
+        close(_unix_sock);
+        if(_local_path[0] != '@')
+        {
+            unlink(_local_path.c_str());
+        }
+    }
 }
 
 bool SharedServer::create()
 {
+    // Two servers must not share local socket: the second one would take it over from clients of the first one
+    if(!createLocal())
+    {
+        return false;
+    }
+
     int enable = 1;
     _sock = socket(AF_INET, SOCK_STREAM, 0);
     if(_sock < 0)
@@ -55,7 +77,7 @@ bool SharedServer::create()
         return false;
     }
 
-    rc = listen(_sock, 5);
+    rc = listen(_sock, SOMAXCONN);
     if(rc < 0)
     {
         LOG_ERR(DEBUG_SHARED_SERVER,"Failed to listen socket!\n");
@@ -63,9 +85,23 @@ bool SharedServer::create()
         return false;
     }
 
-    FD_ZERO(&_main_set);
-    _max_sd = _sock;
-    FD_SET(_sock, &_main_set);
+    _epoll = epoll_create1(EPOLL_CLOEXEC);
+    _event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(_epoll < 0 || _event_fd < 0)
+    {
+        LOG_ERR(DEBUG_SHARED_SERVER,"Failed to create epoll or eventfd %s(%i)!\n", strerror(errno), errno);
+        closeSocket();
+        return false;
+    }
+
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = _sock;
+    epoll_ctl(_epoll, EPOLL_CTL_ADD, _sock, &ev);
+    ev.data.fd = _event_fd;
+    epoll_ctl(_epoll, EPOLL_CTL_ADD, _event_fd, &ev);
+    ev.data.fd = _unix_sock;
+    epoll_ctl(_epoll, EPOLL_CTL_ADD, _unix_sock, &ev);
 
     _handler_thread = std::thread(&SharedServer::start, this);
     _handler_thread.detach();
@@ -73,76 +109,219 @@ bool SharedServer::create()
     return true;
 }
 
+bool SharedServer::createLocal()
+{
+    struct sockaddr_un addr;
+    auto addr_len = localAddr(_local_path, addr);
+    if(!addr_len)
+    {
+        LOG_ERR(DEBUG_SHARED_SERVER, "Bad local socket path %s!\n", _local_path.c_str());
+        return false;
+    }
+
+    bool abstract = _local_path[0] == '@';
+    if(!abstract)
+    {
+        // Only socket left by dead server is removed: live one answers, anything else is not ours
+        struct stat st;
+        if(lstat(_local_path.c_str(), &st) == 0)
+        {
+            auto probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            bool answered = probe >= 0 && connect(probe, (struct sockaddr *)&addr, addr_len) == 0;
+            if(probe >= 0)
+            {
+                close(probe);
+            }
+            if(answered || !S_ISSOCK(st.st_mode))
+            {
+                LOG_ERR(DEBUG_SHARED_SERVER, "Local socket %s is %s!\n", _local_path.c_str(), answered ? "served by another process" : "not a socket");
+                return false;
+            }
+            unlink(_local_path.c_str());
+        }
+    }
+
+    _unix_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(_unix_sock < 0 || bind(_unix_sock, (struct sockaddr *)&addr, addr_len) < 0 ||
+            (!abstract && chmod(_local_path.c_str(), S_IRUSR | S_IWUSR) < 0) || listen(_unix_sock, SOMAXCONN) < 0)
+    {
+        // Abstract name of live server gives EADDRINUSE
+        LOG_ERR(DEBUG_SHARED_SERVER, "Failed to listen local socket %s %s(%i)!\n", _local_path.c_str(), strerror(errno), errno);
+        if(_unix_sock >= 0)
+        {
+            close(_unix_sock);
+        }
+        _unix_sock = SOCKET_ERROR;
+        return false;
+    }
+    return true;
+}
+
 void SharedServer::start()
 {
+    const int MAX_EVENTS = 64;
+    struct epoll_event events[MAX_EVENTS];
+
     _work = true;
     do
     {
-        std::memcpy(&_work_set, &_main_set, sizeof (fd_set));
-        auto rc = select(_max_sd + 1, &_work_set, nullptr, nullptr, nullptr);
+        // Handler sleeps until command, connection, stop() or notification, spilled records are flushed meanwhile
+        auto rc = epoll_wait(_epoll, events, MAX_EVENTS, _spilling ? SPILL_FLUSH_MS : -1);
         if(rc < 0)
         {
-            LOG_ERR(DEBUG_SHARED_SERVER, "Select failed %i!\n", rc);
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            LOG_ERR(DEBUG_SHARED_SERVER, "Epoll wait failed %s(%i)!\n", strerror(errno), errno);
             closeSocket();
             break;
-
-        }
-        else if(rc == 0)
-        {
-            LOG_ERR(DEBUG_SHARED_SERVER, "Select timeout!\n");
         }
 
-        auto num_of_ready_sd = rc;
-        for(int i =0 ; i <= _max_sd && num_of_ready_sd > 0; i++)
+        for(int i = 0; i < rc && _work; i++)
         {
-            if(FD_ISSET(i, &_work_set))
+            auto sd = events[i].data.fd;
+            // This is server socket. Accept all
+            if(sd == _sock || sd == _unix_sock)
             {
-                num_of_ready_sd--;
-                // This is server socket. Accept all
-                if(i == _sock)
+                if(!acceptConnections(sd))
                 {
-                    if(!acceptConnections())
-                    {
-                        LOG_ERR(DEBUG_SHARED_SERVER, "Error during accept new connections! Closing listen socket...\n");
-                        closeSocket();
-                        stop();
-                        break;
-                    }
+                    LOG_ERR(DEBUG_SHARED_SERVER, "Error during accept new connections! Closing listen socket...\n");
+                    closeSocket();
+                    stop();
+                    break;
                 }
-                else
+            }
+            else if(sd == _event_fd)
+            {
+                uint64_t count;
+                while(::read(_event_fd, &count, sizeof (count)) == sizeof (count));
+                sendNotifications();
+            }
+            else
+            {
+                if(events[i].events & EPOLLOUT)
                 {
-                    auto it_pd = _partial_data.find(i);
-                    if(it_pd == _partial_data.end()) {
-                        it_pd = _partial_data.insert({i, data_size_pair_t()}).first;
-                    }
-
-                    auto read = SharedSocket::read(i, it_pd->second.first.data() + it_pd->second.second, sizeof (ss_cmd) - it_pd->second.second);
-                    if(read == SOCKET_ERROR)
-                    {
-                        closeConnection(i);
-                    }
-                    else
-                    {
-                        if(it_pd->second.second + read == sizeof (ss_cmd))
-                        {
-                            LOG_MESS(DEBUG_SHARED_SERVER, "[%i]: Got %i bytes. Buffer complete. Process cmd...\n", i, read);
-                            _curr_handling_sock = i;
-                            processCommands(*(struct ss_cmd *)it_pd->second.first.data());
-                            it_pd->second.second = 0;
-                            _curr_handling_sock = SOCKET_ERROR;
-                        }
-                        else
-                        {
-                            it_pd->second.second += read;
-                            LOG_MESS(DEBUG_SHARED_SERVER, "[%i]: Got %i bytes. Buffer size %lu\n", i, read, it_pd->second.second);
-                        }
-                    }
+                    writePending(sd);
+                }
+                if(events[i].events & ~EPOLLOUT)
+                {
+                    readCommands(sd);
                 }
             }
         }
+
+        if(_spilling && _work)
+        {
+            flushSpills();
+        }
     } while(_work);
 }
 
+void SharedServer::readCommands(sock_desc_t sd)
+{
+    // Event of connection closed by previous event
+    auto it = _socket_ctx_map.find(sd);
+    while(it != _socket_ctx_map.end())
+    {
+        auto & ctx = it->second;
+        auto read = SharedSocket::read(sd, ctx.partial_cmd.data() + ctx.partial_size, sizeof (ss_cmd) - ctx.partial_size);
+        if(read == SOCKET_ERROR)
+        {
+            closeConnection(sd);
+            return;
+        }
+        if(read == 0)
+        {
+            // Nothing more for now
+            return;
+        }
+
+        ctx.partial_size += read;
+        if(ctx.partial_size < sizeof (ss_cmd))
+        {
+            LOG_MESS(DEBUG_SHARED_SERVER, "[%i]: Got %i bytes. Buffer size %lu\n", sd, read, ctx.partial_size);
+            return;
+        }
+
+        LOG_MESS(DEBUG_SHARED_SERVER, "[%i]: Got %i bytes. Buffer complete. Process cmd...\n", sd, read);
+        ss_cmd cmd;
+        std::memcpy(&cmd, ctx.partial_cmd.data(), sizeof (ss_cmd));
+        ctx.partial_size = 0;
+        _curr_handling_sock = sd;
+        processCommands(cmd);
+        _curr_handling_sock = SOCKET_ERROR;
+        // Command may close connection
+        it = _socket_ctx_map.find(sd);
+    }
+}
+
+void SharedServer::notify(const std::shared_ptr<SharedCtx> & ctx)
+{
+    if(!ctx->disarm())
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_notify_mutex);
+        _notify_queue.push_back(ctx);
+    }
+    uint64_t one = 1;
+    auto rc = ::write(_event_fd, &one, sizeof (one));
+    (void)rc;
+}
+
+void SharedServer::sendNotifications()
+{
+    std::vector<std::shared_ptr<SharedCtx>> queue;
+    {
+        std::lock_guard<std::mutex> lock(_notify_mutex);
+        queue.swap(_notify_queue);
+    }
+
+    for(auto & ctx : queue)
+    {
+        // Client or channel may be gone meanwhile, and descriptor reused by other client
+        auto owned = _ctx_map_sock.equal_range(ctx->getOwner());
+        if(std::any_of(owned.first, owned.second, [&](const _ctx_map_sock_t::value_type & chan) { return chan.second == ctx; }))
+        {
+            ss_cmd note = { (uint64_t)ss_proto::SS_NOTIFY, ctx->getId() };
+            writeData(ctx->getOwner(), (uint8_t *)&note, sizeof (ss_cmd));
+        }
+    }
+}
+
+void SharedServer::wakeFlush(const std::shared_ptr<SharedCtx> & ctx)
+{
+    if(!ctx->spilling() || _spilling.load(std::memory_order_relaxed) || _spilling.exchange(true))
+    {
+        return;
+    }
+    uint64_t one = 1;
+    auto rc = ::write(_event_fd, &one, sizeof (one));
+    (void)rc;
+}
+
+void SharedServer::flushSpills()
+{
+    // Sender spilling after this wakes handler again
+    _spilling = false;
+    bool left = false;
+    for(auto & it : _ctx_map_sock)
+    {
+        if(it.second->flush())
+        {
+            notify(it.second);
+        }
+        left = left || it.second->spilling();
+    }
+    if(left)
+    {
+        _spilling = true;
+    }
+}
+
 void SharedServer::processCommands(ss_cmd cmd)
 {
     if(_curr_handling_sock == SOCKET_ERROR)
@@ -179,20 +358,42 @@ void SharedServer::processCommands(ss_cmd cmd)
         break;
     }
     case ss_proto::SS_NEWRCHAN:
-    {
-        newRChan(std::string(cmd.text + sizeof (uint32_t)), *(uint32_t *)(cmd.text));
-        break;
-    }
     case ss_proto::SS_NEWWCHAN:
     {
-        newWChan(std::string(cmd.text + sizeof (uint32_t)), *(uint32_t *)(cmd.text));
+        ss_chan_params params;
+        std::memcpy(&params, cmd.text, sizeof (ss_chan_params));
+        const char * prefix = cmd.text + sizeof (ss_chan_params);
+        std::string prefix_str(prefix, strnlen(prefix, sizeof (cmd.text) - sizeof (ss_chan_params)));
+        if((ss_proto)cmd.cmd == ss_proto::SS_NEWRCHAN) {
+            newRChan(prefix_str, params);
+        }
+        else {
+            newWChan(prefix_str, params);
+        }
         break;
     }
     case ss_proto::SS_BINDCHAN:
+    case ss_proto::SS_BINDRANGE:
+    case ss_proto::SS_BINDMASK:
+    case ss_proto::SS_SUBSCRIBE:
     {
-        hash_t hash;
-        std::memcpy(&hash, cmd.text, sizeof (hash_t));
-        bindChan(cmd.id, hash);
+        hash_t first, second;
+        ss_bind_params params;
+        std::memcpy(&first, cmd.text, sizeof (hash_t));
+        std::memcpy(&second, cmd.text + sizeof (hash_t), sizeof (hash_t));
+        std::memcpy(&params, cmd.text + 2 * sizeof (hash_t), sizeof (ss_bind_params));
+        if((ss_proto)cmd.cmd == ss_proto::SS_BINDCHAN) {
+            bindChan(cmd.id, first, params);
+        }
+        else if((ss_proto)cmd.cmd == ss_proto::SS_BINDRANGE) {
+            bindRange(cmd.id, first, second, params);
+        }
+        else if((ss_proto)cmd.cmd == ss_proto::SS_BINDMASK) {
+            bindMask(cmd.id, first, second, params);
+        }
+        else {
+            subscribe(cmd.id, first, second);
+        }
         break;
     }
     case ss_proto::SS_CLOSECHAN:
@@ -207,119 +408,289 @@ void SharedServer::processCommands(ss_cmd cmd)
     }
 }
 
-bool SharedServer::bindChan(const shm_id_t &id, const hash_t & hash)
+bool SharedServer::bindChan(const shm_id_t &id, const hash_t & hash, const ss_bind_params & params)
 {
     // ss_cmd::text containts hash for packets
-    auto results = _ctx_map_sock.equal_range(_curr_handling_sock);
-    if(results.first == results.second)
+    return bindRoute(id, params, [&](_ctx_map_hash_t::table_t & routes, const std::shared_ptr<SharedCtx> & ctx) {
+        return routes.bind(hash, ctx);
+    });
+}
+
+bool SharedServer::bindRange(const shm_id_t &id, const hash_t &lo, const hash_t &hi, const ss_bind_params & params)
+{
+    return bindRoute(id, params, [&](_ctx_map_hash_t::table_t & routes, const std::shared_ptr<SharedCtx> & ctx) {
+        return routes.bindRange(lo, hi, ctx);
+    });
+}
+
+bool SharedServer::bindMask(const shm_id_t &id, const hash_t &mask, const hash_t &value, const ss_bind_params & params)
+{
+    return bindRoute(id, params, [&](_ctx_map_hash_t::table_t & routes, const std::shared_ptr<SharedCtx> & ctx) {
+        return routes.bindMask(mask, value, ctx);
+    });
+}
+
+void SharedServer::flush()
+{
+    if(!_framed.load(std::memory_order_relaxed))
     {
-        ss_cmd ack = { (uint64_t)ss_proto::SS_NACK };
-        writeData(_curr_handling_sock, (uint8_t *)&ack, sizeof (ss_cmd));
+        return;
     }
 
-    bool sh_ctx_found = false;
-    for(auto it = results.first; it != results.second; it++)
+    auto now = TimeHandler::Instance()->get_time_usecs();
+    std::lock_guard<std::mutex> lock(_ctx_map_mutex);
+    for(auto & it : _ctx_map_sock)
     {
-        if(it->second->getId() == id)
+        if(it.second->flushFrame(now))
         {
-            sh_ctx_found = true;
-            // TODO: Can shmem have multiple conditions???
-            _ctx_map_hash_mutex.lock();
-            auto hash_ctx_map_it = _ctx_map_hash.find(hash);
-            if(hash_ctx_map_it == _ctx_map_hash.end())
-            {
-                _ctx_map_hash.emplace(hash, it->second);
-                _shmid_hash_map.emplace(id, std::vector<hash_t>() = { hash });
-                _ctx_map_hash_mutex.unlock();
+            notify(it.second);
+        }
+    }
+}
 
-                ss_cmd ack = { (uint64_t)ss_proto::SS_ACK, id };
-                writeData(_curr_handling_sock, (uint8_t *)&ack, sizeof (ss_cmd));
-                break;
+bool SharedServer::subscribe(const shm_id_t &id, const hash_t &mask, const hash_t &value)
+{
+    auto ctx = findChan(id);
+    bool subscribed = false;
+    // Refs dropped by SS_DROP_OLDEST would never be released, frames are not refs
+    if(ctx && ctx->getDirection() == ss_direction::SS_WRITE && ctx->getBackpressure() != ss_backpressure::SS_DROP_OLDEST && !ctx->framed())
+    {
+        try {
+            // Segment name, like channel names, is a shm_open name without '/'
+            if(!_slab) {
+                _slab.reset(new SharedPayloadSlab("shm_ss_slab", default_slab_size, true));
             }
-            else
-            {
-                _ctx_map_hash_mutex.unlock();
-                ss_cmd ack = { (uint64_t)ss_proto::SS_NACK, id };
-                writeData(_curr_handling_sock, (uint8_t *)&ack, sizeof (ss_cmd));
-                break;
+            subscribed = _subscribers.update([&](_subscribers_t::table_t & subscribers) {
+                subscribers.push_back(Subscriber{ mask, value, ctx });
+                return true;
+            });
+            // Policy is changed by this thread only, so channel can't turn SS_DROP_OLDEST before it is marked
+            if(subscribed) {
+                ctx->setSubscribed();
             }
+        }  catch (std::exception &e) {
+            LOG_ERR(DEBUG_SHARED_SERVER, "[%i]: Failed to create payload slab! Err: %s\n", _curr_handling_sock, e.what());
         }
     }
 
-    if(!sh_ctx_found)
+    ss_cmd ack = { (uint64_t)(subscribed ? ss_proto::SS_ACK : ss_proto::SS_NACK), id };
+    if(subscribed)
     {
-        ss_cmd ack = { (uint64_t)ss_proto::SS_NACK };
-        writeData(_curr_handling_sock, (uint8_t *)&ack, sizeof (ss_cmd));
-        return false;
+        std::strncpy(ack.text, _slab->name().c_str(), sizeof (ack.text) - 1);
+        ack.text[sizeof (ack.text) - 1] = '\0';
     }
-    return true;
+    writeData(_curr_handling_sock, (uint8_t *)&ack, sizeof (ss_cmd));
+    return subscribed;
+}
+
+std::shared_ptr<SharedCtx> SharedServer::findChan(const shm_id_t &id)
+{
+    auto results = _ctx_map_sock.equal_range(_curr_handling_sock);
+    for(auto it = results.first; it != results.second; it++)
+    {
+        if(it->second->getId() == id)
+        {
+            return it->second;
+        }
+    }
+    return nullptr;
+}
+
+template<typename BIND>
+bool SharedServer::bindRoute(const shm_id_t &id, const ss_bind_params & params, BIND bind)
+{
+    auto ctx = findChan(id);
+
+    // Colliding route of the same kind is not replaced
+    bool bound = ctx && ctx->supports(params.policy) && _ctx_map_hash.update([&](_ctx_map_hash_t::table_t & routes) {
+        return bind(routes, ctx);
+    });
+    if(bound)
+    {
+        ctx->setBackpressure(params);
+    }
+
+    ss_cmd ack = { (uint64_t)(bound ? ss_proto::SS_ACK : ss_proto::SS_NACK), id };
+    writeData(_curr_handling_sock, (uint8_t *)&ack, sizeof (ss_cmd));
+    return bound;
 }
 
 void SharedServer::stop()
 {
     _work = false;
+    if(_event_fd != SOCKET_ERROR)
+    {
+        uint64_t one = 1;
+        auto rc = ::write(_event_fd, &one, sizeof (one));
+        (void)rc;
+    }
 }
 
 bool SharedServer::send(const hash_t &hash, uint8_t *data, const size_t &size)
 {
-    std::lock_guard<std::mutex> lock(_ctx_map_hash_mutex);
-    auto it = _ctx_map_hash.find(hash);
-    if(it != _ctx_map_hash.end() && it->second->getDirection() == ss_direction::SS_WRITE) {
-        return it->second->push(data, size);
+    _ctx_map_hash_t::Reader routes(_ctx_map_hash);
+    auto ctx = routes->find(hash);
+    if(ctx && (*ctx)->getDirection() == ss_direction::SS_WRITE && (*ctx)->push(data, size)) {
+        notify(*ctx);
+        wakeFlush(*ctx);
+        return true;
     }
 
     return false;
 }
 
-bool SharedServer::hasClients() const
+size_t SharedServer::sendBurst(const hash_t * hash, const SharedCircularBuffer::Message * messages, const size_t & n)
 {
-    return !_socket_ctx_map.empty();
+    size_t sent = 0;
+    _ctx_map_hash_t::Reader routes(_ctx_map_hash);
+    for(size_t i = 0; i < n; )
+    {
+        size_t run = 1;
+        while(i + run < n && hash[i + run] == hash[i])
+        {
+            run++;
+        }
+
+        auto ctx = routes->find(hash[i]);
+        if(ctx && (*ctx)->getDirection() == ss_direction::SS_WRITE)
+        {
+            auto pushed = (*ctx)->pushBurst(messages + i, run);
+            if(pushed)
+            {
+                sent += pushed;
+                notify(*ctx);
+                wakeFlush(*ctx);
+            }
+        }
+        i += run;
+    }
+
+    return sent;
 }
 
-bool SharedServer::newRChan(const std::string & prefix, const size_t & shm_size)
+size_t SharedServer::publish(const hash_t &hash, const uint8_t *data, const size_t &size)
 {
-    auto id = getShmemIndex();
-    //std::string name = "/dev/shm/" + prefix + "_r_" + std::to_string(id);
-    std::string name = "shm_" + prefix + "_r_" + std::to_string(id);
+    _subscribers_t::Reader subscribers(_subscribers);
+    uint32_t matched = 0;
+    for(auto & subscriber : *subscribers)
+    {
+        if((hash & subscriber.mask) == subscriber.value)
+        {
+            matched++;
+        }
+    }
+    if(!matched || size > _slab->slab().chunkData())
+    {
+        return 0;
+    }
 
-    try {
-        // NOTE: Invert direction for server side
-        auto new_ctx = std::make_shared<SharedCtx>(name, id, ss_direction::SS_WRITE, shm_size ? shm_size : SharedCtx::default_shmem_size);
-        _ctx_map_sock.emplace(_curr_handling_sock, new_ctx);
+    auto & slab = _slab->slab();
+    auto chunk = slab.alloc(matched);
+    if(chunk == PayloadSlab::NO_CHUNK)
+    {
+        return 0;
+    }
+    std::memcpy(slab.data(chunk), data, size);
 
-        ss_cmd ack = { (uint64_t)ss_proto::SS_ACK, id };
-        std::memcpy(ack.text, name.c_str(), name.size());
-        ack.text[name.size()] = '\0';
-        writeData(_curr_handling_sock, (uint8_t *)&ack, sizeof (ss_cmd));
-    }  catch (std::exception &e) {
-        ss_cmd ack = { (uint64_t)ss_proto::SS_NACK };
-        writeData(_curr_handling_sock, (uint8_t *)&ack, sizeof (ss_cmd));
+    PayloadSlab::Ref ref = { chunk, (uint32_t)size };
+    uint32_t sent = 0;
+    for(auto & subscriber : *subscribers)
+    {
+        if((hash & subscriber.mask) == subscriber.value && subscriber.ctx->push((uint8_t *)&ref, sizeof (ref)))
+        {
+            sent++;
+            notify(subscriber.ctx);
+            wakeFlush(subscriber.ctx);
+        }
+    }
+    // Full subscriber rings don't hold the payload
+    if(sent < matched)
+    {
+        slab.release(chunk, matched - sent);
+    }
+    return sent;
+}
+
+std::shared_ptr<SharedCtx> SharedServer::channel(const hash_t &hash)
+{
+    _ctx_map_hash_t::Reader routes(_ctx_map_hash);
+    auto ctx = routes->find(hash);
+    if(ctx && (*ctx)->getDirection() == ss_direction::SS_WRITE) {
+        return *ctx;
+    }
 
+    return nullptr;
+}
 
-        LOG_ERR(DEBUG_SHARED_SERVER, "[%i]: Failed to create SharedCtx(READ) with name %s and size %li! Err: %s\n", _curr_handling_sock, name.c_str(), shm_size, e.what());
-        return false;
+bool SharedServer::hasClients() const
+{
+    return !_socket_ctx_map.empty();
+}
+
+void SharedServer::print(FILE * file)
+{
+    static const char * policies[] = { "drop-newest", "drop-oldest", "spill" };
+    std::lock_guard<std::mutex> lock(_ctx_map_mutex);
+    fprintf(file, "Shared channels (%lu):\n", _ctx_map_sock.size());
+    for(auto & it : _ctx_map_sock)
+    {
+        auto & ctx = it.second;
+        if(ctx->getDirection() != ss_direction::SS_WRITE)
+        {
+            continue;
+        }
+        auto stats = ctx->stats();
+        fprintf(file, "  [%i] chan %lu %s: enqueued %lu, dropped %lu, high-watermark %lu of %lu, spilled %lu\n",
+                it.first, ctx->getId(), policies[(uint32_t)ctx->getBackpressure()], stats.enqueued, stats.dropped,
+                stats.high_watermark, stats.capacity, stats.spilled);
     }
-    return true;
 }
 
-bool SharedServer::newWChan(const std::string & prefix, const size_t & shm_size)
+bool SharedServer::newRChan(const std::string & prefix, const ss_chan_params & params)
+{
+    // NOTE: Invert direction for server side
+    return newChan(ss_direction::SS_WRITE, "_r_", prefix, params);
+}
+
+bool SharedServer::newWChan(const std::string & prefix, const ss_chan_params & params)
+{
+    return newChan(ss_direction::SS_READ, "_w_", prefix, params);
+}
+
+bool SharedServer::newChan(const ss_direction & side, const char * tag, const std::string & prefix, const ss_chan_params & params)
 {
     auto id = getShmemIndex();
-    std::string name = "/dev/shm/" + prefix + "_w_" + std::to_string(id);
+    std::string name = "shm_" + prefix + tag + std::to_string(id);
+    bool local = _socket_ctx_map[_curr_handling_sock].local;
 
     try {
-        auto new_ctx = std::make_shared<SharedCtx>(name, id, ss_direction::SS_READ, shm_size ? shm_size : SharedCtx::default_shmem_size);
-        _ctx_map_sock.emplace(_curr_handling_sock, new_ctx);
+        if((params.flags & SS_CHAN_HUGETLB) && !local) {
+            throw std::runtime_error("huge pages are for local clients only");
+        }
+        auto new_ctx = std::make_shared<SharedCtx>(name, id, side, params, local);
+        new_ctx->setOwner(_curr_handling_sock);
+        {
+            std::lock_guard<std::mutex> lock(_ctx_map_mutex);
+            _ctx_map_sock.emplace(_curr_handling_sock, new_ctx);
+        }
+        if(new_ctx->framed())
+        {
+            _framed++;
+        }
 
+        // Local client gets channel memory with ACK, name only identifies objects inside
         ss_cmd ack = { (uint64_t)ss_proto::SS_ACK, id };
         std::memcpy(ack.text, name.c_str(), name.size());
         ack.text[name.size()] = '\0';
-        writeData(_curr_handling_sock, (uint8_t *)&ack, sizeof (ss_cmd));
+        if(!writeData(_curr_handling_sock, (uint8_t *)&ack, sizeof (ss_cmd), true, new_ctx->getFd()))
+        {
+            return false;
+        }
     }  catch (std::exception &e) {
         ss_cmd ack = { (uint64_t)ss_proto::SS_NACK };
         writeData(_curr_handling_sock, (uint8_t *)&ack, sizeof (ss_cmd));
 
-        LOG_ERR(DEBUG_SHARED_SERVER, "[%i]: Failed to create SharedCtx(WRITE) with name %s and size %li! Err: %s\n", _curr_handling_sock, name.c_str(), shm_size, e.what());
+        LOG_ERR(DEBUG_SHARED_SERVER, "[%i]: Failed to create SharedCtx with name %s and size %u! Err: %s\n", _curr_handling_sock, name.c_str(), params.shm_size, e.what());
         return false;
     }
     return true;
@@ -327,37 +698,71 @@ bool SharedServer::newWChan(const std::string & prefix, const size_t & shm_size)
 
 bool SharedServer::closeChan(const shm_id_t &id)
 {
+    std::vector<std::shared_ptr<SharedCtx>> closed;
     auto results = _ctx_map_sock.equal_range(_curr_handling_sock);
     for(auto it = results.first; it != results.second; it++)
     {
         if(it->second->getId() == id)
         {
+            closed.push_back(it->second);
+            std::lock_guard<std::mutex> lock(_ctx_map_mutex);
             _ctx_map_sock.erase(it);
             break;
         }
     }
-
-    _ctx_map_hash_mutex.lock();
-    auto it = _shmid_hash_map.find(id);
-    if(it != _shmid_hash_map.end()) {
-        for(auto & hash : it->second) {
-            _ctx_map_hash.erase(hash);
-        }
-    }
-    _shmid_hash_map.erase(id);
-    _ctx_map_hash_mutex.unlock();
+    dropChans(closed);
 
     ss_cmd ack = { (uint64_t)ss_proto::SS_ACK, id};
     writeData(_curr_handling_sock, (uint8_t *)&ack, sizeof (ss_cmd));
     return true;
 }
 
-bool SharedServer::acceptConnections()
+void SharedServer::dropChans(const std::vector<std::shared_ptr<SharedCtx>> & chans)
+{
+    if(chans.empty())
+    {
+        return;
+    }
+    auto dropped = [&](const std::shared_ptr<SharedCtx> & ctx) {
+        return std::find(chans.begin(), chans.end(), ctx) != chans.end();
+    };
+    _framed -= std::count_if(chans.begin(), chans.end(), [](const std::shared_ptr<SharedCtx> & ctx) { return ctx->framed(); });
+
+    // Senders still routing to the channels keep them alive until update returns
+    _ctx_map_hash.update([&](_ctx_map_hash_t::table_t & routes) {
+        return routes.eraseIf(dropped) > 0;
+    });
+
+    std::vector<std::shared_ptr<SharedCtx>> unsubscribed;
+    _subscribers.update([&](_subscribers_t::table_t & subscribers) {
+        for(auto & subscriber : subscribers) {
+            if(dropped(subscriber.ctx)) {
+                unsubscribed.push_back(subscriber.ctx);
+            }
+        }
+        subscribers.erase(std::remove_if(subscribers.begin(), subscribers.end(),
+                                         [&](const Subscriber & subscriber) { return dropped(subscriber.ctx); }), subscribers.end());
+        return !unsubscribed.empty();
+    });
+    // Publishers are done with the channels, payloads of unread refs go back to slab
+    for(auto & ctx : unsubscribed)
+    {
+        ctx->drain([this](const uint8_t * data, const uint32_t & size) {
+            PayloadSlab::Ref ref;
+            if(size == sizeof (ref)) {
+                std::memcpy(&ref, data, sizeof (ref));
+                _slab->slab().release(ref.chunk);
+            }
+        });
+    }
+}
+
+bool SharedServer::acceptConnections(sock_desc_t listen_sd)
 {
     sock_desc_t new_sd = -1;
     do
     {
-        new_sd = accept(_sock, NULL, NULL);
+        new_sd = accept4(listen_sd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
         if(new_sd < 0)
         {
             if(errno != EWOULDBLOCK)
@@ -368,18 +773,33 @@ bool SharedServer::acceptConnections()
             break;
         }
 
-        LOG_MESS(DEBUG_SHARED_SERVER, "Incomming connection %i.\n", new_sd);
-        FD_SET(new_sd, &_main_set);
-        if(new_sd > _max_sd)
+        if(listen_sd == _unix_sock)
         {
-            _max_sd = new_sd;
+            // Socket in abstract namespace has no permissions, file one may be reached before chmod
+            struct ucred cred = {};
+            socklen_t cred_len = sizeof (cred);
+            if(getsockopt(new_sd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0 || (cred.uid != geteuid() && cred.uid != 0))
+            {
+                LOG_ERR(DEBUG_SHARED_SERVER, "Local connection of uid %u is refused.\n", cred.uid);
+                close(new_sd);
+                continue;
+            }
         }
 
-        struct timeval timeout = {0, 10};
-        setsockopt(new_sd, SOL_SOCKET, SO_RCVTIMEO, (const uint8_t *)&timeout, sizeof timeout);
+        LOG_MESS(DEBUG_SHARED_SERVER, "Incomming connection %i.\n", new_sd);
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.fd = new_sd;
+        if(epoll_ctl(_epoll, EPOLL_CTL_ADD, new_sd, &ev) < 0)
+        {
+            LOG_ERR(DEBUG_SHARED_SERVER, "Failed to watch connection %i %s(%i).\n", new_sd, strerror(errno), errno);
+            close(new_sd);
+            continue;
+        }
 
         auto it = _socket_ctx_map.insert({new_sd, SocketCtx()}).first;
         it->second.setState(SocketCtx::ss_state::SS_CONNECTED);
+        it->second.local = listen_sd == _unix_sock;
 
     } while(new_sd != SOCKET_ERROR);
 
@@ -388,21 +808,67 @@ bool SharedServer::acceptConnections()
 
 void SharedServer::closeConnection(sock_desc_t sd)
 {
-    _socket_ctx_map.erase(sd);
-    _partial_data.erase(sd);
-    close(sd);
-    FD_CLR(sd, &_main_set);
-    if(sd == _max_sd)
+    std::vector<std::shared_ptr<SharedCtx>> closed;
+    auto results = _ctx_map_sock.equal_range(sd);
+    for(auto it = results.first; it != results.second; it++)
+    {
+        closed.push_back(it->second);
+    }
+    {
+        std::lock_guard<std::mutex> lock(_ctx_map_mutex);
+        _ctx_map_sock.erase(sd);
+    }
+    dropChans(closed);
+
+    auto socket_ctx_it = _socket_ctx_map.find(sd);
+    if(socket_ctx_it != _socket_ctx_map.end())
     {
-        while (!FD_ISSET(_max_sd, &_main_set)) {
-            _max_sd--;
+        for(auto & reply : socket_ctx_it->second.pending)
+        {
+            if(reply.fd >= 0)
+            {
+                close(reply.fd);
+            }
         }
+        _socket_ctx_map.erase(socket_ctx_it);
     }
+    epoll_ctl(_epoll, EPOLL_CTL_DEL, sd, nullptr);
+    close(sd);
 }
 
-void SharedServer::writeData(sock_desc_t sd, uint8_t *data, size_t size, bool close_on_error)
+bool SharedServer::writeData(sock_desc_t sd, uint8_t *data, size_t size, bool close_on_error, int fd)
 {
-    auto written = SharedSocket::write(sd, data, size);
+    auto it = _socket_ctx_map.find(sd);
+    int written = 0;
+    // Replies keep order: the new one waits behind pending ones
+    if(it == _socket_ctx_map.end() || it->second.pending.empty())
+    {
+        written = fd < 0 ? SharedSocket::write(sd, data, size) : SharedSocket::writeFd(sd, data, size, fd);
+    }
+
+    if(written != SOCKET_ERROR && (size_t)written < size)
+    {
+        if(it == _socket_ctx_map.end() || it->second.pending.size() >= MAX_PENDING_REPLIES)
+        {
+            LOG_ERR(DEBUG_SHARED_SERVER, "[%i]: Client doesn't read replies!\n", sd);
+            written = SOCKET_ERROR;
+        }
+        else
+        {
+            // Descriptor is passed with the first byte, channel may be closed before it is sent
+            int pending_fd = fd >= 0 && !written ? fcntl(fd, F_DUPFD_CLOEXEC, 0) : -1;
+            it->second.pending.push_back({ std::vector<uint8_t>(data + written, data + size), pending_fd });
+            if(it->second.pending.size() == 1)
+            {
+                struct epoll_event ev = {};
+                ev.events = EPOLLIN | EPOLLRDHUP | EPOLLOUT;
+                ev.data.fd = sd;
+                epoll_ctl(_epoll, EPOLL_CTL_MOD, sd, &ev);
+            }
+            return true;
+        }
+    }
+
     if(written == SOCKET_ERROR)
     {
         LOG_ERR(DEBUG_SHARED_SERVER, "[%i]: Write error!\n", sd);
@@ -410,7 +876,49 @@ void SharedServer::writeData(sock_desc_t sd, uint8_t *data, size_t size, bool cl
         {
             closeConnection(sd);
         }
+        return false;
     }
+    return true;
+}
+
+void SharedServer::writePending(sock_desc_t sd)
+{
+    auto it = _socket_ctx_map.find(sd);
+    if(it == _socket_ctx_map.end())
+    {
+        return;
+    }
+
+    auto & pending = it->second.pending;
+    while(!pending.empty())
+    {
+        auto & reply = pending.front();
+        auto written = reply.fd < 0 ? SharedSocket::write(sd, reply.data.data(), reply.data.size())
+                                    : SharedSocket::writeFd(sd, reply.data.data(), reply.data.size(), reply.fd);
+        if(written == SOCKET_ERROR)
+        {
+            LOG_ERR(DEBUG_SHARED_SERVER, "[%i]: Write error!\n", sd);
+            closeConnection(sd);
+            return;
+        }
+        if(written && reply.fd >= 0)
+        {
+            close(reply.fd);
+            reply.fd = -1;
+        }
+        reply.data.erase(reply.data.begin(), reply.data.begin() + written);
+        if(!reply.data.empty())
+        {
+            // Still full
+            return;
+        }
+        pending.pop_front();
+    }
+
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.fd = sd;
+    epoll_ctl(_epoll, EPOLL_CTL_MOD, sd, &ev);
 }
 
 shm_id_t SharedServer::getShmemIndex()
@@ -420,10 +928,30 @@ shm_id_t SharedServer::getShmemIndex()
     return index;
 }
 
-SharedCtx::SharedCtx(const std::string &name, const shm_id_t & id, const ss_direction &side, const size_t & shm_size):
-    _io(nullptr), _name(name), _id(id), _dir(side)
+SharedCtx::SharedCtx(const std::string &name, const shm_id_t & id, const ss_direction &side, const ss_chan_params & params, const bool & anonymous):
+    _io(nullptr), _name(name), _id(id), _dir(side), _policy(ss_backpressure::SS_DROP_NEWEST), _enqueued(0), _dropped(0), _high_watermark(0),
+    _spill_size(default_spill_size), _spilled(0), _single_producer(params.ring == SharedCircularBuffer::Ring::SPSC),
+    _frame_size(params.frame_size < FrameBuilder::MAX_FRAME_SIZE ? params.frame_size : FrameBuilder::MAX_FRAME_SIZE), _frame_usecs(params.frame_usecs), _frame_span(), _frame_deadline(0),
+    _frame_published(false)
 {
-    _io = new SharedCircularBuffer(name.c_str(), shm_size, true);
+    // Frame is reserved in ring while it is filled, and frames are appended in place only in SPSC ring
+    if(_frame_size && params.ring != SharedCircularBuffer::Ring::SPSC)
+    {
+        throw std::runtime_error("framed channel must be SPSC");
+    }
+    size_t shm_size = params.shm_size ? params.shm_size : default_shmem_size;
+    if(!anonymous)
+    {
+        _io = new SharedCircularBuffer(name.c_str(), shm_size, true, params.ring, params.slot_size, params.flags & SS_CHAN_POPULATE);
+        return;
+    }
+
+    int fd = SharedIO::createMemFd(name.c_str(), shm_size, params.flags & SS_CHAN_HUGETLB);
+    if(fd < 0)
+    {
+        throw std::runtime_error("Failed to create memfd: " + std::string(strerror(errno)));
+    }
+    _io = new SharedCircularBuffer(fd, name, shm_size, true, params.ring, params.slot_size, params.flags & SS_CHAN_POPULATE);
 }
 
 SharedCtx::~SharedCtx()
@@ -439,28 +967,253 @@ shm_id_t SharedCtx::getId() const
     return _id;
 }
 
+int SharedCtx::getFd() const
+{
+    return (*_io).getFd();
+}
+
 ss_direction SharedCtx::getDirection() const
 {
     return _dir;
 }
 
+void SharedCtx::setOwner(const sock_desc_t &sock)
+{
+    _owner = sock;
+}
+
+sock_desc_t SharedCtx::getOwner() const
+{
+    return _owner;
+}
+
+bool SharedCtx::disarm()
+{
+    // Messages of open frame are invisible for consumer yet
+    if(_frame_size)
+    {
+        if(!_frame_published)
+        {
+            return false;
+        }
+        _frame_published = false;
+    }
+    return (*_io).disarm();
+}
+
+bool SharedCtx::supports(const ss_backpressure & policy) const
+{
+    switch(policy)
+    {
+    case ss_backpressure::SS_DROP_NEWEST:
+        return true;
+    case ss_backpressure::SS_SPILL:
+        // Handler thread can't push spilled records while frame is reserved
+        return !_frame_size;
+    case ss_backpressure::SS_DROP_OLDEST:
+        return (*_io).ring() == SharedCircularBuffer::Ring::MPMC && !_subscribed && !_frame_size;
+    default:
+        return false;
+    }
+}
+
+void SharedCtx::setBackpressure(const ss_bind_params & params)
+{
+    _spill_size.store(params.spill_size ? params.spill_size : default_spill_size, std::memory_order_relaxed);
+    _policy.store(params.policy, std::memory_order_relaxed);
+}
+
+ss_backpressure SharedCtx::getBackpressure() const
+{
+    return _policy.load(std::memory_order_relaxed);
+}
+
+void SharedCtx::setSubscribed()
+{
+    _subscribed = true;
+}
+
+bool SharedCtx::framed() const
+{
+    return _frame_size != 0;
+}
+
+bool SharedCtx::flushFrame(const TimeHandler::usecs_t & now)
+{
+    if(!_frame.started() || now < _frame_deadline)
+    {
+        return false;
+    }
+    publishFrame();
+    return true;
+}
+
+SharedCtx::Stats SharedCtx::stats()
+{
+    return { _enqueued.load(std::memory_order_relaxed), _dropped.load(std::memory_order_relaxed), _high_watermark.load(std::memory_order_relaxed),
+             (*_io).capacity(), _spilled.load(std::memory_order_relaxed) };
+}
+
+bool SharedCtx::spilling() const
+{
+    // Pairs with release of empty spill queue: sender pushing without _spill_mutex sees ring state left by handler thread
+    return _spilled.load(std::memory_order_acquire) != 0;
+}
+
 bool SharedCtx::push(uint8_t *data, size_t size)
 {
-    if(_dir == ss_direction::SS_WRITE)
+    if(_dir != ss_direction::SS_WRITE)
+    {
+        return false;
+    }
+    if(_frame_size)
+    {
+        return pushFramed(data, size);
+    }
+
+    // Records left in spill queue after policy change go first as well
+    auto policy = _policy.load(std::memory_order_relaxed);
+    if(policy == ss_backpressure::SS_SPILL || spilling())
+    {
+        return spill(data, size);
+    }
+
+    bool pushed = (*_io).push(data, size);
+    // Other producers of MPMC ring may take the room meanwhile
+    size_t dropped = 0;
+    while(!pushed && policy == ss_backpressure::SS_DROP_OLDEST && (*_io).dropOldest(size))
+    {
+        dropped++;
+        pushed = (*_io).push(data, size);
+    }
+    account(pushed, dropped + !pushed);
+    return pushed;
+}
+
+bool SharedCtx::spill(const uint8_t * data, const size_t & size)
+{
+    std::lock_guard<std::mutex> lock(_spill_mutex);
+    // Spilled records go first
+    flushSpill();
+    if(_spill.empty() && (*_io).push(data, size))
     {
-        return (*_io).push(data, size);
+        account(1, 0);
+        return true;
     }
-    else
+    if(_spill.size() < _spill_size.load(std::memory_order_relaxed))
     {
+        _spill.emplace_back(data, data + size);
+        _spilled.store(_spill.size(), std::memory_order_relaxed);
+        return true;
+    }
+    account(0, 1);
+    return false;
+}
+
+bool SharedCtx::pushFramed(const uint8_t * data, const size_t & size)
+{
+    if(_frame.started() && _frame.add(data, size))
+    {
+        account(1, 0);
+        return true;
+    }
+    publishFrame();
+
+    // Frame of one bigger message, or of just this message when there is no room for full frame
+    size_t single = FrameBuilder::frameSize(size);
+    size_t frame = std::max<size_t>(_frame_size, single);
+    bool reserved = single <= FrameBuilder::MAX_FRAME_SIZE && (*_io).reserve(frame, _frame_span);
+    if(!reserved && single <= FrameBuilder::MAX_FRAME_SIZE && frame > single)
+    {
+        frame = single;
+        reserved = (*_io).reserve(frame, _frame_span);
+    }
+    if(!reserved)
+    {
+        account(0, 1);
         return false;
     }
+    _frame.start(_frame_span.data, frame);
+    _frame.add(data, size);
+    _frame_deadline = TimeHandler::Instance()->get_time_usecs() + _frame_usecs;
+    account(1, 0);
+    return true;
+}
+
+void SharedCtx::publishFrame()
+{
+    if(_frame.started())
+    {
+        (*_io).commit(_frame_span, _frame.finish());
+        _frame_published = true;
+    }
+}
+
+bool SharedCtx::flush()
+{
+    std::lock_guard<std::mutex> lock(_spill_mutex);
+    return flushSpill() > 0;
+}
+
+size_t SharedCtx::flushSpill()
+{
+    size_t moved = 0;
+    while(!_spill.empty() && (*_io).push(_spill.front().data(), _spill.front().size()))
+    {
+        _spill.pop_front();
+        moved++;
+    }
+    if(moved)
+    {
+        _spilled.store(_spill.size(), std::memory_order_release);
+        account(moved, 0);
+    }
+    return moved;
+}
+
+void SharedCtx::account(const size_t & enqueued, const size_t & dropped)
+{
+    uint64_t fill = 0;
+    if(enqueued)
+    {
+        // SPSC ring has one producer, counter is changed without locked instruction then
+        uint64_t total = _enqueued.load(std::memory_order_relaxed) + enqueued;
+        if(_single_producer)
+        {
+            _enqueued.store(total, std::memory_order_relaxed);
+        }
+        else
+        {
+            total = _enqueued.fetch_add(enqueued, std::memory_order_relaxed) + enqueued;
+        }
+        // Ring fill is read from consumer cache line, so only sometimes
+        if(total / HWM_SAMPLE != (total - enqueued) / HWM_SAMPLE)
+        {
+            fill = (*_io).length();
+        }
+    }
+    if(dropped)
+    {
+        _dropped.fetch_add(dropped, std::memory_order_relaxed);
+        fill = (*_io).length();
+    }
+    if(!fill)
+    {
+        return;
+    }
+
+    auto seen = _high_watermark.load(std::memory_order_relaxed);
+    while(fill > seen && !_high_watermark.compare_exchange_weak(seen, fill, std::memory_order_relaxed));
 }
 
 const uint8_t * SharedCtx::pop(size_t & size)
 {
     if(_dir == ss_direction::SS_READ)
     {
-        return (*_io).pop(*(uint16_t *)&size);
+        uint32_t length = 0;
+        auto data = (*_io).pop(length);
+        size = length;
+        return data;
     }
     else
     {
@@ -469,7 +1222,7 @@ const uint8_t * SharedCtx::pop(size_t & size)
     }
 }
 
-SocketCtx::SocketCtx(): _state(ss_state::SS_DISCONNECTED)
+SocketCtx::SocketCtx(): partial_size(0), local(false), _state(ss_state::SS_DISCONNECTED)
 {
 
 }
@@ -483,3 +1236,96 @@ bool SocketCtx::inited() const
 {
     return _state == ss_state::SS_INITED;
 }
+
+bool SharedCtx::reserve(const uint32_t & size, SharedCircularBuffer::Span & span)
+{
+    // Handler thread flushes spilled records to ring meanwhile, ring is full for zero-copy sender till then
+    if(_dir == ss_direction::SS_WRITE && !spilling() && !_frame_size)
+    {
+        return (*_io).reserve(size, span);
+    }
+    else
+    {
+        return false;
+    }
+}
+
+void SharedCtx::commit(const SharedCircularBuffer::Span & span, const uint32_t & size)
+{
+    (*_io).commit(span, size);
+    account(1, 0);
+}
+
+bool SharedCtx::peek(SharedCircularBuffer::Record & record)
+{
+    if(_dir == ss_direction::SS_READ)
+    {
+        return (*_io).peek(record);
+    }
+    else
+    {
+        return false;
+    }
+}
+
+void SharedCtx::release(const SharedCircularBuffer::Record & record)
+{
+    (*_io).release(record);
+}
+
+size_t SharedCtx::pushBurst(const SharedCircularBuffer::Message * messages, const size_t & n)
+{
+    if(_dir != ss_direction::SS_WRITE)
+    {
+        return 0;
+    }
+
+    // Spilled records go first, so the whole burst goes through spill then
+    size_t pushed = 0;
+    if(_policy.load(std::memory_order_relaxed) != ss_backpressure::SS_SPILL && !spilling() && !_frame_size)
+    {
+        pushed = (*_io).pushBurst(messages, n);
+        account(pushed, 0);
+    }
+
+    size_t sent = pushed;
+    for(size_t i = pushed; i < n; i++)
+    {
+        sent += push((uint8_t *)messages[i].data, messages[i].length);
+    }
+    return sent;
+}
+
+size_t SharedCtx::popBurst(SharedCircularBuffer::Record * records, const size_t & n)
+{
+    if(_dir == ss_direction::SS_READ)
+    {
+        return (*_io).popBurst(records, n);
+    }
+    else
+    {
+        return 0;
+    }
+}
+
+void SharedCtx::releaseBurst(const SharedCircularBuffer::Record * records, const size_t & n)
+{
+    (*_io).releaseBurst(records, n);
+}
+
+void SharedCtx::drain(const std::function<void(const uint8_t *, const uint32_t &)> & handle)
+{
+    uint32_t length = 0;
+    while(auto data = (*_io).pop(length))
+    {
+        handle(data, length);
+    }
+
+    std::lock_guard<std::mutex> lock(_spill_mutex);
+    for(auto & record : _spill)
+    {
+        handle(record.data(), record.size());
+    }
+    _spill.clear();
+    _spilled.store(0, std::memory_order_release);
+}
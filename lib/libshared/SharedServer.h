@@ -2,25 +2,83 @@
 
 #include "SharedSocket.h"
 #include "SharedCycleBuffer.h"
+#include "RouteTable.h"
+#include "HashRoutes.h"
+#include "SharedPayloadSlab.h"
+#include "RecordFrame.h"
+#include "../TimeHandler.h"
 
 
 #include <map>
+#include <deque>
+#include <mutex>
 #include <unordered_map>
 #include <thread>
 #include <array>
 #include <vector>
+#include <functional>
 
 class SharedCtx
 {
 public:
-    SharedCtx(const std::string &name, const shm_id_t &id, const ss_direction &side, const size_t & shm_size = default_shmem_size);
+    struct Stats
+    {
+        // Records which got to ring
+        uint64_t enqueued;
+        // New records, or enqueued ones dropped from ring by SS_DROP_OLDEST
+        uint64_t dropped;
+        // The biggest ring fill seen, sampled every HWM_SAMPLE records and on every full ring. Units of capacity.
+        uint64_t high_watermark;
+        // Bytes of SPSC ring, records of MPMC ring
+        uint64_t capacity;
+        // Records in spill queue now
+        uint64_t spilled;
+    };
+    static const uint64_t HWM_SAMPLE = 64;
+    static const uint32_t default_spill_size;
+
+    // Anonymous channel is in memfd (see getFd()), named one in shared memory segment `name`
+    SharedCtx(const std::string &name, const shm_id_t &id, const ss_direction &side, const ss_chan_params & params, const bool & anonymous = false);
     ~SharedCtx();
 
     shm_id_t getId() const;
+    // Memory descriptor of anonymous channel, -1 for named one
+    int getFd() const;
     ss_direction getDirection() const;
+    // Control connection of channel client
+    void setOwner(const sock_desc_t & sock);
+    sock_desc_t getOwner() const;
+    // True once after consumer armed waiting, it has to be notified then. Framed channel: only after frame is published.
+    bool disarm();
+
+    // Policy can be applied to ring of this channel
+    bool supports(const ss_backpressure & policy) const;
+    void setBackpressure(const ss_bind_params & params);
+    ss_backpressure getBackpressure() const;
+    // Channel carries PayloadSlab::Ref records, they can't be dropped without release
+    void setSubscribed();
+    bool framed() const;
+    // Sender thread: publishes frame opened before `now` - frame_usecs, returns true if it did
+    bool flushFrame(const TimeHandler::usecs_t & now);
+    Stats stats();
+    bool spilling() const;
+    // Moves spilled records to ring while they fit, returns true if any was moved
+    bool flush();
 
+    // Full ring is handled by backpressure policy, false if record is dropped
     bool push(uint8_t * data, size_t size);
     const uint8_t * pop(size_t & size);
+    // Zero-copy: writer builds record in channel memory, reader parses it in place. Not for framed channel.
+    bool reserve(const uint32_t & size, SharedCircularBuffer::Span & span);
+    void commit(const SharedCircularBuffer::Span & span, const uint32_t & size);
+    bool peek(SharedCircularBuffer::Record & record);
+    void release(const SharedCircularBuffer::Record & record);
+    // Burst: many records with one ring position update, the rest goes through policy. Returns number of not dropped.
+    size_t pushBurst(const SharedCircularBuffer::Message * messages, const size_t & n);
+    size_t popBurst(SharedCircularBuffer::Record * records, const size_t & n);
+    void releaseBurst(const SharedCircularBuffer::Record * records, const size_t & n);
+    // Reads out records left in channel and its spill queue, whatever its direction is
+    void drain(const std::function<void(const uint8_t *, const uint32_t &)> & handle);
 
     static const size_t default_shmem_size;
 private:
@@ -28,6 +86,36 @@ private:
     std::string _name;
     uint64_t _id;
     ss_direction _dir = ss_direction::SS_UNDEFINED;
+    sock_desc_t _owner = SOCKET_ERROR;
+    std::atomic<ss_backpressure> _policy;
+    bool _subscribed = false;
+    std::atomic<uint64_t> _enqueued;
+    std::atomic<uint64_t> _dropped;
+    std::atomic<uint64_t> _high_watermark;
+    // SS_SPILL queue, senders and handler thread flush it in order before new records
+    std::mutex _spill_mutex;
+    std::deque<std::vector<uint8_t>> _spill;
+    std::atomic<uint32_t> _spill_size;
+    std::atomic<uint64_t> _spilled;
+    /*
+     * SPSC ring: sender pushes without _spill_mutex only while spill queue is empty, so there is one producer at a time.
+     * Handler thread stores empty _spilled with release after its last push, sender loads it with acquire.
+     */
+    bool _single_producer;
+    // Framed channel: frame being filled in reserved span, touched by sender thread only
+    uint32_t _frame_size;
+    TimeHandler::usecs_t _frame_usecs;
+    FrameBuilder _frame;
+    SharedCircularBuffer::Span _frame_span;
+    TimeHandler::usecs_t _frame_deadline;
+    bool _frame_published;
+
+    bool spill(const uint8_t * data, const size_t & size);
+    bool pushFramed(const uint8_t * data, const size_t & size);
+    void publishFrame();
+    // Under _spill_mutex
+    size_t flushSpill();
+    void account(const size_t & enqueued, const size_t & dropped);
 };
 
 class SocketCtx
@@ -44,6 +132,21 @@ public:
 
     void setState(const ss_state & state);
     bool inited() const;
+
+    // Command received partially, nonblocking socket gives the rest later
+    std::array<uint8_t, sizeof (ss_cmd)> partial_cmd;
+    size_t partial_size;
+    // Connected to local socket, channels are passed as memfd
+    bool local;
+
+    // Part of reply which didn't fit to nonblocking socket, fd is descriptor to pass with its first byte
+    struct Pending
+    {
+        std::vector<uint8_t> data;
+        int fd;
+    };
+    // Sent in order when socket is writable (EPOLLOUT)
+    std::deque<Pending> pending;
 private:
     ss_state _state;
 };
@@ -51,53 +154,126 @@ private:
 class SharedServer: public SharedSocket
 {
   public:
-    SharedServer();
+    // Local control socket is at `local_path`, see UNIX_SOCKET_ENV
+    SharedServer(const std::string & local_path = SharedSocket::localPath());
     ~SharedServer();
 
     typedef std::multimap<sock_desc_t, std::shared_ptr<SharedCtx>> _ctx_map_sock_t;
-    typedef std::unordered_map<hash_t, std::shared_ptr<SharedCtx>> _ctx_map_hash_t;
+    typedef RouteTable<HashRoutes<std::shared_ptr<SharedCtx>>> _ctx_map_hash_t;
 
+    // Fails if local control socket is served by another process
     bool create();
     void stop();
+    /*
+     * Senders (send(), sendBurst(), channel(), publish()) may be called from up to RouteTable::MAX_READERS threads
+     * running at the same time: each of them holds reader slot of route tables until it exits, one more throws.
+     */
     bool send(const hash_t & hash, uint8_t * data, const size_t & size);
+    /*
+     * Sends messages[i] to channel bound to hash[i] under one lock. Every run of equal hashes is looked up once
+     * and published with one ring position update. Returns number of sent messages.
+     */
+    size_t sendBurst(const hash_t * hash, const SharedCircularBuffer::Message * messages, const size_t & n);
+    // Write channel bound to hash for zero-copy send (reserve/commit), nullptr if there is none
+    std::shared_ptr<SharedCtx> channel(const hash_t & hash);
+    /*
+     * Fan-out: payload is copied once to the payload slab and every subscriber matching hash gets PayloadSlab::Ref
+     * to it. Returns number of subscribers which got it.
+     */
+    size_t publish(const hash_t & hash, const uint8_t * data, const size_t & size);
+    /*
+     * Sends SS_NOTIFY to consumer of channel if it armed waiting. send(), sendBurst() and publish() do it themselves,
+     * zero-copy sender calls it after commit(). Handler thread sends notification, data path only queues it.
+     */
+    void notify(const std::shared_ptr<SharedCtx> & ctx);
+    /*
+     * Publishes frames of framed channels which are open for longer than their frame_usecs. Called by the thread
+     * which sends to framed channels, e.g. from its idle loop.
+     */
+    void flush();
+
+    static const size_t default_slab_size;
+    static const int SPILL_FLUSH_MS = 1;
+    // Client which doesn't read replies is disconnected when it has more of them pending
+    static const size_t MAX_PENDING_REPLIES = 4096;
 
     // Tmp for test connection
     bool hasClients() const;
+    // Channel counters for stats file
+    void print(FILE * file);
   private:
-    // Contains all SharedCtx for special socked descriptor
+    // Contains all SharedCtx for special socked descriptor. Changed by handler thread under _ctx_map_mutex, print() reads it.
     _ctx_map_sock_t _ctx_map_sock;
-    /*
-     * This map used to correlate hashes and shm id.
-     * Need to remove all corresponds hashes if shared ctx with id will be removed;
-     */
-    std::unordered_map<shm_id_t, std::vector<hash_t>> _shmid_hash_map;
-    // Correspond hash with SharedCtx
-    std::mutex _ctx_map_hash_mutex;
+    std::mutex _ctx_map_mutex;
+    // Correspond hash (exact, range or mask) with SharedCtx, changed by handler thread only, read by senders without lock
     _ctx_map_hash_t _ctx_map_hash;
-    fd_set _main_set;
-    fd_set _work_set;
-    sock_desc_t _max_sd;
-    bool _work;
+
+    struct Subscriber
+    {
+        hash_t mask;
+        hash_t value;
+        std::shared_ptr<SharedCtx> ctx;
+    };
+    typedef RouteTable<std::vector<Subscriber>> _subscribers_t;
+    // Subscriber channels, changed by handler thread only, read by publishers without lock
+    _subscribers_t _subscribers;
+    // Created on the first subscription, before it is visible to publishers
+    std::unique_ptr<SharedPayloadSlab> _slab;
+    // Local listen socket at _local_path, only clients of the same user (or root) are accepted by it
+    std::string _local_path;
+    sock_desc_t _unix_sock;
+    // Handler thread waits for listen sockets, clients and _event_fd
+    int _epoll;
+    // Wakes handler thread: stop() and queued notifications
+    int _event_fd;
+    std::mutex _notify_mutex;
+    std::vector<std::shared_ptr<SharedCtx>> _notify_queue;
+    // Some channel has spilled records, handler thread flushes them every SPILL_FLUSH_MS
+    std::atomic<bool> _spilling;
+    // Number of framed channels, flush() does nothing without them
+    std::atomic<size_t> _framed;
+    std::atomic<bool> _work;
     std::thread _handler_thread;
     shm_id_t _shm_index;
     sock_desc_t _curr_handling_sock;
     std::unordered_map<sock_desc_t, SocketCtx> _socket_ctx_map;
 
-    // key: socket descriptor, value: data, size
-    typedef std::pair<std::array<uint8_t, sizeof (ss_cmd)>, size_t> data_size_pair_t;
-    std::unordered_map<sock_desc_t, data_size_pair_t> _partial_data;
-
-    bool newRChan(const std::string & prefix, const size_t & shm_size);
-    bool newWChan(const std::string & prefix, const size_t & shm_size);
-    bool bindChan(const shm_id_t & id, const hash_t &hash);
+    bool newRChan(const std::string & prefix, const ss_chan_params & params);
+    bool newWChan(const std::string & prefix, const ss_chan_params & params);
+    // Channel of current socket, `side` is server side of it
+    bool newChan(const ss_direction & side, const char * tag, const std::string & prefix, const ss_chan_params & params);
+    bool bindChan(const shm_id_t & id, const hash_t &hash, const ss_bind_params & params = ss_bind_params());
+    bool bindRange(const shm_id_t & id, const hash_t & lo, const hash_t & hi, const ss_bind_params & params = ss_bind_params());
+    bool bindMask(const shm_id_t & id, const hash_t & mask, const hash_t & value, const ss_bind_params & params = ss_bind_params());
+    bool subscribe(const shm_id_t & id, const hash_t & mask, const hash_t & value);
+    // Channel `id` of current socket
+    std::shared_ptr<SharedCtx> findChan(const shm_id_t & id);
+    // Adds route to channel `id` of current socket by `bind` and sets its policy, replies ACK or NACK
+    template<typename BIND>
+    bool bindRoute(const shm_id_t & id, const ss_bind_params & params, BIND bind);
     bool closeChan(const shm_id_t & id);
+    // Removes routes and subscriptions of channels, returns payloads of their unread refs
+    void dropChans(const std::vector<std::shared_ptr<SharedCtx>> & chans);
 
+    bool createLocal();
     void start();
-    bool acceptConnections();
+    bool acceptConnections(sock_desc_t listen_sd);
+    void readCommands(sock_desc_t sd);
+    void sendNotifications();
+    // Sender found spilled records: handler starts flushing
+    void wakeFlush(const std::shared_ptr<SharedCtx> & ctx);
+    void flushSpills();
     void processCommands(ss_cmd cmd);
 
+    // Client channels are dropped with connection, so dead consumer doesn't hold them
     void closeConnection(sock_desc_t sd);
-    void writeData(sock_desc_t sd, uint8_t * data, size_t size, bool close_on_error = true);
+    /*
+     * Sends reply, the rest of it waits in SocketCtx::pending when socket is full. `fd` is passed with it over local socket.
+     * Returns false if connection is broken.
+     */
+    bool writeData(sock_desc_t sd, uint8_t * data, size_t size, bool close_on_error = true, int fd = -1);
+    // Socket is writable again
+    void writePending(sock_desc_t sd);
     shm_id_t getShmemIndex();
 };
 
@@ -1,6 +1,8 @@
 ﻿#include "SharedSocket.h"
 
 #include "sys/ioctl.h"
+#include <string.h>
+#include <stddef.h>
 
 SharedSocket::SharedSocket(uint16_t port): _port(port), _sock(SOCKET_ERROR)
 {
@@ -63,9 +65,15 @@ int SharedSocket::write(sock_desc_t sock, uint8_t *data, size_t size)
     size_t total_sent = 0;
     while (total_sent != size)
     {
-        auto sent = send(sock, data + total_sent, size - total_sent, 0);
+        // Closed peer gives EPIPE, not SIGPIPE
+        auto sent = send(sock, data + total_sent, size - total_sent, MSG_NOSIGNAL);
         if (sent == -1)
         {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                // Nonblocking socket is full
+                return total_sent;
+            }
             return SOCKET_ERROR;
         }
         else if (sent == (ssize_t)(size - total_sent))
@@ -80,3 +88,117 @@ int SharedSocket::write(sock_desc_t sock, uint8_t *data, size_t size)
 
     return SOCKET_ERROR;
 }
+
+int SharedSocket::readFd(sock_desc_t sock, uint8_t * data, size_t read_size, int & fd)
+{
+    fd = -1;
+    char control[CMSG_SPACE(sizeof(int))];
+    iovec iov = { data, read_size };
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    auto rc = recvmsg(sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    if(rc <= 0)
+    {
+        return SOCKET_ERROR;
+    }
+
+    cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+    if(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    {
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    if((size_t)rc < read_size)
+    {
+        // Descriptor comes with the first bytes only
+        auto rest = read(sock, data + rc, read_size - rc);
+        if(rest == SOCKET_ERROR)
+        {
+            return SOCKET_ERROR;
+        }
+        rc += rest;
+    }
+    return rc;
+}
+
+int SharedSocket::writeFd(sock_desc_t sock, uint8_t * data, size_t size, int fd)
+{
+    if(fd < 0)
+    {
+        return write(sock, data, size);
+    }
+    if(!data || sock == SOCKET_ERROR)
+    {
+        return SOCKET_ERROR;
+    }
+
+    char control[CMSG_SPACE(sizeof(int))] = {};
+    iovec iov = { data, size };
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    auto sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    if(sent < 0)
+    {
+        // Nothing is sent to full nonblocking socket, descriptor neither
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : SOCKET_ERROR;
+    }
+    if((size_t)sent < size)
+    {
+        // Descriptor is passed with the first part
+        auto rest = write(sock, data + sent, size - sent);
+        if(rest == SOCKET_ERROR)
+        {
+            return SOCKET_ERROR;
+        }
+        sent += rest;
+    }
+    return sent;
+}
+
+std::string SharedSocket::localPath()
+{
+    auto path = getenv(UNIX_SOCKET_ENV);
+    if(path && *path)
+    {
+        return path;
+    }
+    auto dir = getenv("XDG_RUNTIME_DIR");
+    if(dir && *dir)
+    {
+        return std::string(dir) + "/" + UNIX_SOCKET_NAME;
+    }
+    // Nobody else may create it in abstract namespace first: server checks peer of every connection
+    return "@" + std::to_string(getuid()) + "-" + UNIX_SOCKET_NAME;
+}
+
+socklen_t SharedSocket::localAddr(const std::string & path, struct sockaddr_un & addr)
+{
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(path.empty() || path.size() >= sizeof(addr.sun_path))
+    {
+        return 0;
+    }
+    memcpy(addr.sun_path, path.c_str(), path.size());
+    if(path[0] == '@')
+    {
+        // Abstract name is not terminated, its length is in address length
+        addr.sun_path[0] = '\0';
+        return offsetof(struct sockaddr_un, sun_path) + path.size();
+    }
+    return sizeof(addr);
+}
@@ -1,9 +1,11 @@
 #pragma once
 
 #include "SharedIO.h"
+#include "SharedCycleBuffer.h"
 
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <memory>
@@ -13,6 +15,13 @@
 #define BASE_PORT           10105
 #define SOCKET_ERROR        -1
 #define INIT_KEYWORD        "hi!"
+/*
+ * Local control socket, channels of its clients are in memfd passed with ACK. Path is taken from UNIX_SOCKET_ENV,
+ * otherwise socket is UNIX_SOCKET_NAME in private runtime dir ($XDG_RUNTIME_DIR) or in abstract namespace per user.
+ * Path starting with '@' is in abstract namespace.
+ */
+#define UNIX_SOCKET_ENV     "MEDIAROOM_SOCKET"
+#define UNIX_SOCKET_NAME    "mediaroom.sock"
 
 // basic methods for IO allocation when control socket is connected
 
@@ -23,8 +32,16 @@ enum class ss_proto
     SS_NACK,
     SS_NEWRCHAN,
     SS_NEWWCHAN,
+    // ss_cmd::text is hash_t, ss_bind_params follows two hash_t
     SS_BINDCHAN,
     SS_CLOSECHAN,
+    // ss_cmd::text is two hash_t: lo, hi of range / mask, value, then ss_bind_params
+    SS_BINDRANGE,
+    SS_BINDMASK,
+    // ss_cmd::text is mask, value. Channel gets PayloadSlab::Ref records, ACK text is payload slab name
+    SS_SUBSCRIBE,
+    // Server to client: consumer of channel ss_cmd::id armed waiting and channel got data
+    SS_NOTIFY,
 };
 
 enum class ss_direction
@@ -41,6 +58,51 @@ struct ss_cmd
     char text[128];
 };
 
+// Beginning of ss_cmd::text of SS_NEWRCHAN and SS_NEWWCHAN, channel name prefix follows it
+struct ss_chan_params
+{
+    uint32_t shm_size = 0;
+    SharedCircularBuffer::Ring ring = SharedCircularBuffer::Ring::SPSC;
+    // Max record size of MPMC ring
+    uint32_t slot_size = SharedCircularBuffer::DEFAULT_SLOT_SIZE;
+    // ss_chan_flag bits
+    uint32_t flags = 0;
+    /*
+     * Framed SPSC channel: every record is RecordFrame of messages up to frame_size bytes, read by FrameReader.
+     * Frame is published when the next message doesn't fit or by SharedServer::flush() frame_usecs after its first message.
+     * 0 is channel of single records.
+     */
+    uint32_t frame_size = 0;
+    uint32_t frame_usecs = 100;
+};
+
+enum ss_chan_flag : uint32_t
+{
+    // Channel memfd is in huge pages (local control socket only)
+    SS_CHAN_HUGETLB = 1 << 0,
+    // Channel memory is prefaulted in background by server and client, otherwise it is allocated by the first writes
+    SS_CHAN_POPULATE = 1 << 1,
+};
+
+// What write channel does with record which doesn't fit to its ring
+enum class ss_backpressure : uint32_t
+{
+    // Record is dropped
+    SS_DROP_NEWEST,
+    // The oldest records are dropped to make room (MPMC ring only: SPSC consumer reads records in place)
+    SS_DROP_OLDEST,
+    // Record waits in bounded server queue until ring has room, dropped if queue is full
+    SS_SPILL,
+};
+
+// Channel options chosen at bind time, the last bind of channel sets them
+struct ss_bind_params
+{
+    ss_backpressure policy = ss_backpressure::SS_DROP_NEWEST;
+    // Max records in SS_SPILL queue, 0 is default
+    uint32_t spill_size = 0;
+};
+
 typedef int sock_desc_t;
 typedef uint64_t hash_t;
 typedef uint64_t shm_id_t;
@@ -53,13 +115,25 @@ public:
 
     virtual bool create() = 0;
     void closeSocket();
-    virtual bool newRChan(const std::string & prefix, const size_t & shm_size) = 0;
-    virtual bool newWChan(const std::string & prefix, const size_t & shm_size) = 0;
-    virtual bool bindChan(const shm_id_t & id, const hash_t &hash) = 0;
+    virtual bool newRChan(const std::string & prefix, const ss_chan_params & params) = 0;
+    virtual bool newWChan(const std::string & prefix, const ss_chan_params & params) = 0;
+    virtual bool bindChan(const shm_id_t & id, const hash_t &hash, const ss_bind_params & params = ss_bind_params()) = 0;
+    virtual bool bindRange(const shm_id_t & id, const hash_t & lo, const hash_t & hi, const ss_bind_params & params = ss_bind_params()) = 0;
+    virtual bool bindMask(const shm_id_t & id, const hash_t & mask, const hash_t & value, const ss_bind_params & params = ss_bind_params()) = 0;
+    virtual bool subscribe(const shm_id_t & id, const hash_t & mask, const hash_t & value) = 0;
     virtual bool closeChan(const shm_id_t & id) = 0;
 
     static int read(sock_desc_t sock, uint8_t *data, size_t read_size);
+    // Returns bytes sent before nonblocking socket got full, peer may be gone without SIGPIPE
     static int write(sock_desc_t sock, uint8_t * data, size_t size);
+    // Over AF_UNIX socket: descriptor goes with data (SCM_RIGHTS), fd is -1 if none came
+    static int readFd(sock_desc_t sock, uint8_t * data, size_t read_size, int & fd);
+    // Descriptor is passed only if some bytes are sent
+    static int writeFd(sock_desc_t sock, uint8_t * data, size_t size, int fd);
+    // Default path of local control socket
+    static std::string localPath();
+    // Address of local control socket `path`, returns its length or 0 if path doesn't fit
+    static socklen_t localAddr(const std::string & path, struct sockaddr_un & addr);
 protected:
     uint16_t _port;
     sock_desc_t _sock;
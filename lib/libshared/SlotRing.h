@@ -0,0 +1,226 @@
+// Copyright: https://github.com/mikerez/mediaroom/blob/main/LICENSE
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <atomic>
+#include <new>
+
+/*
+ * Bounded MPMC ring (D. Vyukov) of fixed size slots in external memory, any number of producers and consumers
+ * in any processes. Every slot has a sequence number: producer claims position by CAS when slot seq == pos,
+ * consumer when seq == pos + 1, so a record is taken exactly once and slot is reused only after consumer returned it.
+ * Record is at most slotData() bytes, it never wraps. Records may be written and read in place: reserve()/commit()
+ * and peek()/release() hold slot by ticket, so several threads of one process can do it on the same object.
+ * reserveBurst()/peekBurst() claim a run of consecutive slots with one position update, tickets of the run are consecutive.
+ */
+struct SlotRingDescriptor {
+    static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && sizeof(size_t) == sizeof(long long), "Ring positions must be lock-free to be shared between processes");
+
+    std::atomic<size_t> enqueue_pos;
+    char cacheLineAlign[64 - sizeof(size_t)];
+    std::atomic<size_t> dequeue_pos;
+    char cacheLineAlign1[64 - sizeof(size_t)];
+    size_t mask;
+    size_t slot_size;
+};
+
+class SlotRing
+{
+public:
+    SlotRing(): _desc(nullptr), _slots(nullptr)
+    {
+    }
+
+    // Slot data size is rounded up, number of slots is the biggest power of two fitting to `size` bytes
+    void set(uint8_t * buffer, const size_t & size, const size_t & slot_data)
+    {
+        _desc = (SlotRingDescriptor *)buffer;
+        _slots = buffer + sizeof(SlotRingDescriptor);
+        _slot_size = slotSize(slot_data);
+        size_t slots = (size - sizeof(SlotRingDescriptor)) / _slot_size;
+        _capacity = 1;
+        while(_capacity * 2 <= slots) {
+            _capacity *= 2;
+        }
+    }
+
+    // Only by creator, before producers and consumers start
+    void clear()
+    {
+        for(size_t i = 0; i < _capacity; i++) {
+            new (&slot(i)->seq) std::atomic<size_t>(i);
+        }
+        _desc->mask = _capacity - 1;
+        _desc->slot_size = _slot_size;
+        _desc->enqueue_pos.store(0, std::memory_order_relaxed);
+        _desc->dequeue_pos.store(0, std::memory_order_relaxed);
+    }
+
+    size_t capacity() const
+    {
+        return _desc->mask + 1;
+    }
+
+    // Max record size
+    size_t slotData() const
+    {
+        return _desc->slot_size - sizeof(Slot);
+    }
+
+    // Approximate, exact only when all sides are idle
+    size_t length() const
+    {
+        return _desc->enqueue_pos.load(std::memory_order_relaxed) - _desc->dequeue_pos.load(std::memory_order_relaxed);
+    }
+
+    /*
+     * Zero-copy write: claims slot for record of up to `len` bytes and returns its data, nullptr if ring is full or record
+     * is bigger than slot. `ticket` identifies slot for commit(). Consumers wait for claimed slot, so commit it promptly.
+     */
+    uint8_t * reserve(const uint32_t & len, size_t & ticket)
+    {
+        if(len > slotData() || !claim(_desc->enqueue_pos, 0, 1, ticket)) {
+            return nullptr;
+        }
+        return data(ticket);
+    }
+
+    // Claims up to `n` free slots for writing, returns number of them. Every one is written by data(ticket + i) and commit().
+    size_t reserveBurst(const size_t & n, size_t & ticket)
+    {
+        return claim(_desc->enqueue_pos, 0, n, ticket);
+    }
+
+    uint8_t * data(const size_t & ticket) const
+    {
+        return (uint8_t *)(slot(ticket & _desc->mask) + 1);
+    }
+
+    // Publishes reserved record of `len` bytes
+    void commit(const size_t & ticket, const uint32_t & len)
+    {
+        Slot * s = slot(ticket & _desc->mask);
+        s->len = len;
+        s->seq.store(ticket + 1, std::memory_order_release);
+    }
+
+    // Returns false if ring is full or record is bigger than slot
+    bool write1(const uint8_t * data, const uint32_t & len)
+    {
+        size_t ticket;
+        auto span = reserve(len, ticket);
+        if(!span) {
+            return false;
+        }
+        memcpy(span, data, len);
+        commit(ticket, len);
+        return true;
+    }
+
+    /*
+     * Zero-copy read: takes the oldest record and returns it in place, nullptr if ring is empty.
+     * Record belongs to caller until release(ticket), slot is not reused meanwhile.
+     */
+    const uint8_t * peek(uint32_t & len, size_t & ticket)
+    {
+        if(!claim(_desc->dequeue_pos, 1, 1, ticket)) {
+            return nullptr;
+        }
+        return record(ticket, len);
+    }
+
+    // Takes up to `n` the oldest records, returns number of them. Every one is read by record(ticket + i) and released.
+    size_t peekBurst(const size_t & n, size_t & ticket)
+    {
+        return claim(_desc->dequeue_pos, 1, n, ticket);
+    }
+
+    const uint8_t * record(const size_t & ticket, uint32_t & len) const
+    {
+        Slot * s = slot(ticket & _desc->mask);
+        len = s->len;
+        return (const uint8_t *)(s + 1);
+    }
+
+    void release(const size_t & ticket)
+    {
+        // Slot is free for producer one lap later
+        slot(ticket & _desc->mask)->seq.store(ticket + _desc->mask + 1, std::memory_order_release);
+    }
+
+    // Copies record to `data` of `len` bytes, `len` is set to record size. Returns false if ring is empty.
+    // Record bigger than `len` is dropped.
+    bool read1(uint8_t * data, uint32_t & len)
+    {
+        size_t ticket;
+        uint32_t record_len;
+        auto record = peek(record_len, ticket);
+        if(!record) {
+            return false;
+        }
+        if(record_len <= len) {
+            memcpy(data, record, record_len);
+        }
+        len = record_len;
+        release(ticket);
+        return true;
+    }
+
+    static size_t slotSize(const size_t & slot_data)
+    {
+        return (sizeof(Slot) + slot_data + alignof(Slot) - 1) / alignof(Slot) * alignof(Slot);
+    }
+
+private:
+    struct Slot
+    {
+        std::atomic<size_t> seq;
+        uint32_t len;
+    };
+
+    SlotRingDescriptor * _desc;
+    uint8_t * _slots;
+    size_t _slot_size;
+    size_t _capacity;
+
+    Slot * slot(const size_t & index) const
+    {
+        return (Slot *)(_slots + index * _slot_size);
+    }
+
+    /*
+     * Moves `pos` over up to `n` consecutive slots whose seq == position + lag (free for producer with lag 0,
+     * committed for consumer with lag 1). Counted slots can't change before CAS: only owner of position touches them.
+     */
+    size_t claim(std::atomic<size_t> & pos, const size_t & lag, const size_t & n, size_t & ticket)
+    {
+        size_t start = pos.load(std::memory_order_relaxed);
+        while(n) {
+            size_t ready = 0;
+            intptr_t diff = 0;
+            while(ready < n) {
+                diff = (intptr_t)slot((start + ready) & _desc->mask)->seq.load(std::memory_order_acquire) - (intptr_t)(start + ready + lag);
+                if(diff != 0) {
+                    break;
+                }
+                ready++;
+            }
+            if(ready) {
+                if(pos.compare_exchange_weak(start, start + ready, std::memory_order_relaxed)) {
+                    ticket = start;
+                    return ready;
+                }
+            }
+            else if(diff < 0) {
+                return 0;
+            }
+            else {
+                start = pos.load(std::memory_order_relaxed);
+            }
+        }
+        return 0;
+    }
+};
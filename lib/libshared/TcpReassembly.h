@@ -0,0 +1,201 @@
+// Copyright: https://github.com/mikerez/mediaroom/blob/main/LICENSE
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "../TimeHandler.h"
+#include "../libstack/Block.h"
+
+/*
+ * Out-of-order state of one TCP direction: in-order edge (next expected seq) and sorted array of
+ * out-of-order runs received after a hole. Every run keeps its bytes in a HANDLE (storage block) until
+ * the hole before it is filled or abandoned.
+ *
+ * Seq numbers are compared by serial number arithmetic (RFC 1982): all runs lie less than 2^31 ahead of
+ * the edge, so comparison stays correct across seq wraparound.
+ * Fixed size without pointers: lives in shared memory, every operation is O(SEGMENTS).
+ */
+template<typename HANDLE, size_t SEGMENTS = 8>
+class TcpReassembly
+{
+public:
+    // Received bytes [begin, end)
+    struct Segment
+    {
+        seq_t begin;
+        seq_t end;
+        HANDLE block;
+    };
+
+    // Part of incoming data not received yet
+    struct Part
+    {
+        seq_t seq;
+        uint32_t offset;
+        uint32_t len;
+    };
+    // Runs split data to at most SEGMENTS + 1 parts
+    static const size_t MAX_PARTS = SEGMENTS + 1;
+
+    static bool before(const seq_t & l, const seq_t & r)
+    {
+        return (int32_t)(l - r) < 0;
+    }
+
+    void reset(const seq_t & next)
+    {
+        _next = next;
+        _count = 0;
+        _hole_ts = 0;
+    }
+
+    seq_t next() const
+    {
+        return _next;
+    }
+
+    // In-order bytes up to `seq` are delivered
+    void advance(const seq_t & seq)
+    {
+        _next = seq;
+    }
+
+    /*
+     * Cuts [seq, seq + len) to parts not received yet, in seq order.
+     * Bytes before the edge or covered by runs are retransmission, their number is returned in `duplicate`.
+     */
+    size_t split(const seq_t & seq, const uint32_t & len, Part * parts, uint32_t & duplicate) const
+    {
+        seq_t cur = seq;
+        seq_t end = seq + len;
+        duplicate = 0;
+        if(before(cur, _next)) {
+            cur = before(_next, end) ? _next : end;
+            duplicate += cur - seq;
+        }
+
+        size_t count = 0;
+        for(size_t i = 0; i < _count && before(cur, end); i++) {
+            auto & segment = _segments[i];
+            if(!before(cur, segment.end)) {
+                continue;
+            }
+            if(!before(segment.begin, end)) {
+                break;
+            }
+            if(before(cur, segment.begin)) {
+                parts[count++] = { cur, cur - seq, segment.begin - cur };
+                cur = segment.begin;
+            }
+            seq_t covered_end = before(segment.end, end) ? segment.end : end;
+            duplicate += covered_end - cur;
+            cur = covered_end;
+        }
+        if(before(cur, end)) {
+            parts[count++] = { cur, cur - seq, end - cur };
+        }
+        return count;
+    }
+
+    // Run which can be extended by data starting at `seq`
+    Segment * endingAt(const seq_t & seq)
+    {
+        for(size_t i = 0; i < _count; i++) {
+            if(_segments[i].end == seq) {
+                return &_segments[i];
+            }
+        }
+        return nullptr;
+    }
+
+    // Run which continues data ending at `seq`
+    Segment * startingAt(const seq_t & seq)
+    {
+        for(size_t i = 0; i < _count; i++) {
+            if(_segments[i].begin == seq) {
+                return &_segments[i];
+            }
+        }
+        return nullptr;
+    }
+
+    // Keeps array sorted. Returns nullptr if there is no free entry.
+    Segment * insert(const Segment & segment, const TimeHandler::usecs_t & now)
+    {
+        if(full()) {
+            return nullptr;
+        }
+
+        size_t i = _count;
+        for(; i > 0 && before(segment.begin, _segments[i - 1].begin); i--) {
+            _segments[i] = _segments[i - 1];
+        }
+        _segments[i] = segment;
+        if(!_count++) {
+            _hole_ts = now;
+        }
+        return &_segments[i];
+    }
+
+    // First run after the hole
+    Segment * first()
+    {
+        return _count ? &_segments[0] : nullptr;
+    }
+
+    void popFirst(const TimeHandler::usecs_t & now)
+    {
+        remove(0, now);
+    }
+
+    // Run is dropped together with its block (block erased by reader)
+    bool removeBlock(const HANDLE & block, const TimeHandler::usecs_t & now)
+    {
+        for(size_t i = 0; i < _count; i++) {
+            if(_segments[i].block == block) {
+                remove(i, now);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    size_t size() const
+    {
+        return _count;
+    }
+
+    bool full() const
+    {
+        return _count == SEGMENTS;
+    }
+
+    // Time the current oldest hole is waited for
+    TimeHandler::usecs_t holeTs() const
+    {
+        return _hole_ts;
+    }
+
+private:
+    seq_t _next;
+    uint32_t _count;
+    TimeHandler::usecs_t _hole_ts;
+    Segment _segments[SEGMENTS];
+
+    void remove(const size_t & index, const TimeHandler::usecs_t & now)
+    {
+        for(size_t i = index + 1; i < _count; i++) {
+            _segments[i - 1] = _segments[i];
+        }
+        _count--;
+        if(!_count) {
+            _hole_ts = 0;
+        }
+        else if(!index) {
+            // Wait for the next hole starts from now
+            _hole_ts = now;
+        }
+    }
+};
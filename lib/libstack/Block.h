@@ -9,11 +9,15 @@
 #include "../TimeHandler.h"
 
 /*
- * For L4_PAYLOAD: every message has TCP/UDP hdr. In the beginning of data there is initial sequence number from TCP.
- * For L7_PAYLOAD: transfer only payload
+ * For L4_PAYLOAD: data holds TCP payload only, every message is prefixed with its length. In the beginning of data there is initial sequence number from TCP.
+ * For L7_PAYLOAD: transfer only payload. Data is contiguous byte stream of one flow side starting from seq of block key,
+ * in the beginning of data there is number of bytes lost right before the block (gap marker).
  *
  * START_FLOW: Notify app of start of new flow - send once all headers before (Eth, IPv4/6)
  * END_FLOW: Notify app of end of flow
+ *
+ * Block is a header only: block_size bytes of data follow it in the storage slot.
+ * Storage provides SIZE_CLASSES slot sizes, so slow flows don't hold MAX_DATA_SIZE each.
  */
 
 typedef uint32_t seq_t;
@@ -24,6 +28,8 @@ struct Block {
     static const size_t DEFAULT_TCP_BLOCK_SIZE = 256;
     static const size_t MAX_DATA_SIZE = DEFAULT_TCP_BLOCK_SIZE * DEFAULT_BLOCK_CNT;
     static const size_t DEFAULT_BLOCK_EXPIRATION_TIME_MS = 100;
+    static const size_t SIZE_CLASSES = 3;
+    static const size_t RECORD_HDR_SIZE = sizeof(uint32_t);
 
     enum class BlockType {
         UNKNOWN,
@@ -36,7 +42,23 @@ struct Block {
         END_FLOW,
     };
 
-    Block(const BlockType & block_type)
+    // Data size of class: 512, 2048, 8192 (MAX_DATA_SIZE)
+    static constexpr size_t classSize(size_t size_class)
+    {
+        return MAX_DATA_SIZE >> (2 * (SIZE_CLASSES - 1 - size_class));
+    }
+
+    // Smallest class which can hold one message of `size` bytes
+    static size_t classFor(size_t size)
+    {
+        size_t size_class = 0;
+        while(size_class < SIZE_CLASSES - 1 && classSize(size_class) < size + RECORD_HDR_SIZE) {
+            size_class++;
+        }
+        return size_class;
+    }
+
+    Block(const BlockType & block_type, const uint32_t & data_size): block_size(data_size)
     {
         type = (uint32_t)block_type;
     }
@@ -45,18 +67,26 @@ struct Block {
     uint32_t block_size = 0;
     volatile bool     is_complete = false;
     volatile TimeHandler::usecs_t update_timestamp = 0;
+    uint32_t data_len = 0;
+
+    uint8_t * data()
+    {
+        return (uint8_t *)(this + 1);
+    }
 
-    uint8_t  data[MAX_DATA_SIZE];
-    size_t   data_len = 0;
+    const uint8_t * data() const
+    {
+        return (const uint8_t *)(this + 1);
+    }
 
     void update_ts()
     {
         update_timestamp = TimeHandler::Instance()->get_time_usecs();
     }
 
-    bool hasSpace(const size_t & size)
+    bool hasSpace(const size_t & size) const
     {
-        return data_len + size + size > MAX_DATA_SIZE;
+        return data_len + RECORD_HDR_SIZE + size <= block_size;
     }
 
     bool expired(const TimeHandler::usecs_t & timestamp = TimeHandler::Instance()->get_time_usecs())
@@ -70,13 +100,26 @@ struct Block {
 
     void push(const uint8_t * new_data, const uint32_t & size)
     {
-        memcpy(data + data_len, &size, sizeof (uint32_t));
+        memcpy(data() + data_len, &size, sizeof (uint32_t));
         data_len += sizeof (uint32_t);
-        memcpy(data + data_len, new_data, size);
+        memcpy(data() + data_len, new_data, size);
         data_len += size;
         update_ts();
     }
 
+    // Raw bytes without message header
+    void append(const void * new_data, const uint32_t & size)
+    {
+        memcpy(data() + data_len, new_data, size);
+        data_len += size;
+    }
+
+    // Block is kept by writer (out-of-order data): it doesn't expire until next update_ts()
+    void hold()
+    {
+        update_timestamp = 0;
+    }
+
     void reset()
     {
         data_len = 0;
@@ -100,18 +143,17 @@ public:
         Ok,
         NoBlock,
         NoSpace,
-        InconsistentSeq,
-        BlockClosed,
-        PushError
+        BlockClosed
     };
 
     BlockL4Wrapper() = delete;
     BlockL4Wrapper(Block * block, const uint32_t & curr_seq = 0, const bool & create = false, const uint32_t & isn = 0): block(block)
     {
-        hdr = (L4Hdr *)block;
+        hdr = (L4Hdr *)block->data();
         if(create) {
-            hdr->initial_seq_number = isn;
-            hdr->last_seq_number_in_block = 0;
+            L4Hdr new_hdr = { isn, 0 };
+            block->reset();
+            block->append(&new_hdr, sizeof(L4Hdr));
         }
     }
 
@@ -130,13 +172,9 @@ public:
         return hdr->last_seq_number_in_block;
     }
 
+    // Data must be contiguous with previous message: writer reassembles segments before push
     Code push(const uint8_t * new_data, const uint32_t & size, const uint32_t & new_seq)
     {
-        /*
-         * If there is no missed tcp blocks - try to fill block.
-         * Otherwise - need to close block;
-         */
-
         if(!block) {
             return Code::NoBlock;
         }
@@ -144,18 +182,50 @@ public:
             return Code::BlockClosed;
         }
         else if(!block->hasSpace(size)) {
-            // Close block instantly if there is no space
-            block->is_complete = true;
-            block->update_ts();
+            // Owner closes block, it may need to notify readers
             return Code::NoSpace;
         }
-        else if(block->empty() || (new_seq > hdr->last_seq_number_in_block + 1) || (new_seq == 0 && hdr->last_seq_number_in_block == -1)) {
-            block->push(new_data, size);
-            hdr->last_seq_number_in_block = new_seq;
-            return Code::Ok;
+
+        block->push(new_data, size);
+        hdr->last_seq_number_in_block = new_seq;
+        return Code::Ok;
+    }
+
+    // Messages of `next` block follow messages of this one, false if they don't fit
+    bool merge(const BlockL4Wrapper & next)
+    {
+        uint32_t len = next.block->data_len - sizeof(L4Hdr);
+        if(block->data_len + len > block->block_size) {
+            return false;
         }
 
-        return Code::PushError;
+        block->append(next.block->data() + sizeof(L4Hdr), len);
+        hdr->last_seq_number_in_block = next.getLastSeqInBlock();
+        return true;
+    }
+
+    // Size class of block which can hold L4 header and one message of `size` bytes
+    static size_t classFor(const size_t & size)
+    {
+        return Block::classFor(size + sizeof(L4Hdr));
+    }
+
+    // Message of the biggest size class, longer segment (GRO/TSO) is split to several messages
+    static uint32_t maxMessage()
+    {
+        return Block::classSize(Block::SIZE_CLASSES - 1) - sizeof(L4Hdr) - Block::RECORD_HDR_SIZE;
+    }
+
+    // Size of message which still fits to block, 0 if none does
+    uint32_t space() const
+    {
+        return block->data_len + Block::RECORD_HDR_SIZE < block->block_size ? block->block_size - block->data_len - Block::RECORD_HDR_SIZE : 0;
+    }
+
+    // Only L4 header, no messages yet
+    bool empty() const
+    {
+        return block->data_len <= sizeof(L4Hdr);
     }
 
 public:
@@ -168,3 +238,79 @@ private:
 
     L4Hdr * hdr;
 };
+
+class BlockL7Wrapper
+{
+public:
+    BlockL7Wrapper() = delete;
+    BlockL7Wrapper(Block * block, const bool & create = false, const uint32_t & gap = 0): block(block)
+    {
+        hdr = (L7Hdr *)block->data();
+        if(create) {
+            L7Hdr new_hdr = { gap };
+            block->reset();
+            block->append(&new_hdr, sizeof(L7Hdr));
+        }
+    }
+
+    // Bytes of stream missed between previous block of flow side and this one
+    uint32_t gap() const
+    {
+        return hdr->gap;
+    }
+
+    void setGap(const uint32_t & gap)
+    {
+        hdr->gap = gap;
+    }
+
+    const uint8_t * payload() const
+    {
+        return block->data() + sizeof(L7Hdr);
+    }
+
+    uint32_t payloadLength() const
+    {
+        return block->data_len - sizeof(L7Hdr);
+    }
+
+    uint32_t space() const
+    {
+        return block->block_size - block->data_len;
+    }
+
+    // Appends as much as fits, returns number of bytes taken
+    uint32_t append(const uint8_t * new_data, const uint32_t & size)
+    {
+        uint32_t len = size < space() ? size : space();
+        block->append(new_data, len);
+        block->update_ts();
+        return len;
+    }
+
+    // Payload of `next` block follows payload of this one, false if it doesn't fit
+    bool merge(const BlockL7Wrapper & next)
+    {
+        if(space() < next.payloadLength()) {
+            return false;
+        }
+
+        block->append(next.payload(), next.payloadLength());
+        return true;
+    }
+
+    // Size class of block which can hold `size` bytes of stream
+    static size_t classFor(const size_t & size)
+    {
+        return Block::classFor(size + sizeof(L7Hdr) - Block::RECORD_HDR_SIZE);
+    }
+
+public:
+    Block * block;
+private:
+    struct L7Hdr {
+        uint32_t gap;
+    };
+
+    L7Hdr * hdr;
+};
@@ -103,10 +103,23 @@ class ConfigParser
         bool putValue(const char* new_value) {
             std::stringstream stream;
             stream << new_value;
-            stream >> value;
+            return parse(stream, value);
         }
 
         T value;  // must be global var!
+
+    private:
+        template<typename U>
+        static bool parse(std::stringstream & stream, U & dst) {
+            stream >> dst;
+            return !stream.fail();
+        }
+
+        // Member of Config (CONFIG_COLUMN): there is no object to put value to
+        template<typename C, typename U>
+        static bool parse(std::stringstream &, U C::* &) {
+            return false;
+        }
     };
 
     void registerParam() {}
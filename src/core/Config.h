@@ -13,6 +13,8 @@
 #define CONFIG_PACKET_RESERVE 64
 // flows hash size per core
 #define CONFIG_FLOWHASH_SIZE (128*1024)
+// independently locked parts of shared flow accumulator
+#define CONFIG_FLOWACCUM_SHARDS 16
 // hash bulk before sessions decoding
 //#define CONFIG_HASHBULK_DEFAULT_SIZE (16*1024)
 #endif
@@ -22,6 +24,8 @@
 #define CONFIG_PACKET_RESERVE 64
 // flows hash size per core
 #define CONFIG_FLOWHASH_SIZE (8*1024)
+// independently locked parts of shared flow accumulator
+#define CONFIG_FLOWACCUM_SHARDS 4
 // hash bulk before sessions decoding
 //#define CONFIG_HASHBULK_DEFAULT_SIZE (1024)
 #endif
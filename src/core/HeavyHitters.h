@@ -0,0 +1,306 @@
+// Copyright: https://github.com/mikerez/mediaroom/blob/main/LICENSE
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <mutex>
+
+#include "Chain.h"
+#include "Packet.h"
+#include "../TimeHandler.h"
+
+/*
+ * Count-min sketch (conservative update) with top-K min-heap of heaviest keys.
+ * Fixed memory: DEPTH * WIDTH counters + TOPK entries, no allocations on update.
+ */
+template<size_t DEPTH = 4, size_t WIDTH_BITS = 11, size_t TOPK = 32>
+class FlowSketch
+{
+public:
+    struct Entry
+    {
+        uint64_t key;
+        uint64_t count;
+    };
+
+    FlowSketch()
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        memset(_counters, 0, sizeof(_counters));
+        _heap_size = 0;
+        _total = 0;
+    }
+
+    void update(const uint64_t & key, const uint32_t & weight = 1)
+    {
+        size_t idx[DEPTH];
+        uint64_t min = (uint64_t)-1;
+        for(size_t d = 0; d < DEPTH; d++) {
+            idx[d] = index(key, d);
+            min = std::min(min, _counters[d][idx[d]]);
+        }
+
+        // Conservative update: raise only counters which are below new estimate.
+        // Branchless min/max, counter comparisons are unpredictable for random flows
+        uint64_t estimate = min + weight;
+        for(size_t d = 0; d < DEPTH; d++) {
+            _counters[d][idx[d]] = std::max(_counters[d][idx[d]], estimate);
+        }
+        _total += weight;
+
+        if(_heap_size == TOPK && estimate <= _heap[0].count) {
+            // Fast path for mice flows
+            return;
+        }
+        offer(key, estimate);
+    }
+
+    uint64_t estimate(const uint64_t & key) const
+    {
+        uint64_t min = (uint64_t)-1;
+        for(size_t d = 0; d < DEPTH; d++) {
+            min = std::min(min, _counters[d][index(key, d)]);
+        }
+        return min;
+    }
+
+    // Counters are summed, heavy hitters are re-estimated from merged counters
+    void merge(const FlowSketch & other)
+    {
+        for(size_t d = 0; d < DEPTH; d++) {
+            for(size_t w = 0; w < WIDTH; w++) {
+                _counters[d][w] += other._counters[d][w];
+            }
+        }
+        _total += other._total;
+
+        Entry candidates[TOPK * 2];
+        size_t candidates_cnt = 0;
+        for(size_t i = 0; i < _heap_size; i++) {
+            candidates[candidates_cnt++] = _heap[i];
+        }
+        for(size_t i = 0; i < other._heap_size; i++) {
+            candidates[candidates_cnt++] = other._heap[i];
+        }
+
+        _heap_size = 0;
+        for(size_t i = 0; i < candidates_cnt; i++) {
+            offer(candidates[i].key, estimate(candidates[i].key));
+        }
+    }
+
+    // Heaviest keys in descending order
+    size_t top(Entry * out) const
+    {
+        std::copy(_heap, _heap + _heap_size, out);
+        std::sort(out, out + _heap_size, [](const Entry & l, const Entry & r) { return l.count > r.count; });
+        return _heap_size;
+    }
+
+    uint64_t total() const
+    {
+        return _total;
+    }
+
+    static const size_t TOP_SIZE = TOPK;
+private:
+    static const size_t WIDTH = 1 << WIDTH_BITS;
+
+    uint64_t _counters[DEPTH][WIDTH];
+    Entry _heap[TOPK];
+    size_t _heap_size;
+    uint64_t _total;
+
+    static size_t index(const uint64_t & key, const size_t & row)
+    {
+        // Multiply-shift hashing, odd seeds per row
+        static const uint64_t seeds[] = { 0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0xD6E8FEB86659FD93ULL,
+                                          0xFF51AFD7ED558CCDULL, 0xC4CEB9FE1A85EC53ULL, 0x94D049BB133111EBULL, 0xBF58476D1CE4E5B9ULL };
+        static_assert(DEPTH <= sizeof(seeds) / sizeof(seeds[0]), "Not enough hash seeds for sketch depth");
+        return (key * seeds[row]) >> (64 - WIDTH_BITS);
+    }
+
+    void offer(const uint64_t & key, const uint64_t & count)
+    {
+        for(size_t i = 0; i < _heap_size; i++) {
+            if(_heap[i].key == key) {
+                _heap[i].count = count;
+                siftDown(i);
+                return;
+            }
+        }
+
+        if(_heap_size < TOPK) {
+            _heap[_heap_size] = { key, count };
+            siftUp(_heap_size++);
+        }
+        else if(count > _heap[0].count) {
+            _heap[0] = { key, count };
+            siftDown(0);
+        }
+    }
+
+    void siftUp(size_t i)
+    {
+        while(i) {
+            size_t parent = (i - 1) / 2;
+            if(_heap[parent].count <= _heap[i].count) {
+                break;
+            }
+            std::swap(_heap[parent], _heap[i]);
+            i = parent;
+        }
+    }
+
+    void siftDown(size_t i)
+    {
+        while(true) {
+            size_t smallest = i;
+            size_t left = i * 2 + 1;
+            size_t right = left + 1;
+            if(left < _heap_size && _heap[left].count < _heap[smallest].count) {
+                smallest = left;
+            }
+            if(right < _heap_size && _heap[right].count < _heap[smallest].count) {
+                smallest = right;
+            }
+            if(smallest == i) {
+                break;
+            }
+            std::swap(_heap[smallest], _heap[i]);
+            i = smallest;
+        }
+    }
+};
+
+typedef FlowSketch<> flow_sketch_t;
+
+/*
+ * Collects per-core sketches. Every core publishes its local sketch once per interval,
+ * result of previous interval is printed to stats.
+ */
+class HeavyHitters
+{
+public:
+    static const TimeHandler::usecs_t DEFAULT_INTERVAL = 1 * 1000000;
+
+    HeavyHitters(const TimeHandler::usecs_t & interval = DEFAULT_INTERVAL): _interval(interval)
+    {
+        _rotate_ts = TimeHandler::Instance()->get_time_usecs();
+    }
+
+    void publish(const flow_sketch_t & local)
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        _current.merge(local);
+    }
+
+    void idle()
+    {
+        auto now = TimeHandler::Instance()->get_time_usecs();
+        if(now - _rotate_ts < _interval) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(_lock);
+        _last = _current;
+        _current.reset();
+        _rotate_ts = now;
+    }
+
+    void print(FILE * file)
+    {
+        flow_sketch_t::Entry top[flow_sketch_t::TOP_SIZE];
+        size_t cnt;
+        uint64_t total;
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+            cnt = _last.top(top);
+            total = _last.total();
+        }
+
+        fprintf(file, "Heavy hitters (bytes per %lu ms, total %lu):\n", _interval / 1000, total);
+        for(size_t i = 0; i < cnt; i++) {
+            fprintf(file, "  %2lu. flow 0x%016lx: %lu (%.2f%%)\n", i + 1, top[i].key, top[i].count, total ? 100.0 * top[i].count / total : 0.0);
+        }
+    }
+
+    TimeHandler::usecs_t interval() const
+    {
+        return _interval;
+    }
+
+private:
+    TimeHandler::usecs_t _interval;
+    TimeHandler::usecs_t _rotate_ts;
+    std::mutex _lock;
+    flow_sketch_t _current;
+    flow_sketch_t _last;
+};
+
+/*
+ * Per-core chain stage placed after parsing: counts bytes by PacketDetails::flowHash
+ * into local sketch and publishes it to HeavyHitters once per interval.
+ */
+class HeavyHittersChain: public Chain
+{
+public:
+    HeavyHittersChain(HeavyHitters & collector, Chain * next = nullptr): Chain(next), _collector(collector)
+    {
+        _publish_ts = TimeHandler::Instance()->get_time_usecs();
+    }
+
+    void putPackets(Packet** packets, size_t count) override
+    {
+        for(size_t i = 0; i < count; i++) {
+            update(packets[i]);
+        }
+        checkPublish();
+
+        if(_next) {
+            _next->putPackets(packets, count);
+        }
+    }
+
+    void putPacket(Packet* packet) override
+    {
+        update(packet);
+        checkPublish();
+
+        if(_next) {
+            _next->putPacket(packet);
+        }
+    }
+
+private:
+    HeavyHitters & _collector;
+    flow_sketch_t _local;
+    TimeHandler::usecs_t _publish_ts;
+
+    void update(const Packet * packet)
+    {
+        auto flow_hash = packet->getDetails()->flowHash;
+        if(flow_hash) {
+            _local.update(flow_hash, packet->dataLength());
+        }
+    }
+
+    void checkPublish()
+    {
+        auto now = TimeHandler::Instance()->get_time_usecs();
+        if(now - _publish_ts < _collector.interval()) {
+            return;
+        }
+
+        _collector.publish(_local);
+        _local.reset();
+        _publish_ts = now;
+    }
+};
@@ -6,6 +6,7 @@
 #include "DpdkDriver.h"
 #endif
 #include "Capture.h"
+#include "PacketDedup.h"
 #include "System.h"
 #include "Driver.h"
 #include "Debug.h"
@@ -28,6 +29,8 @@ class Capture
                       //        std::shared_ptr<std::string> address;   //  optional
         std::string dpdk_cmd;
         std::string devices;
+        int dedup_window_us = 0;     // 0 - no deduplication between drivers
+        int dedup_size = 65536;      // fingerprints kept within window
         static const char *moduleName;
     };
     const char* const gModuleName = Config::moduleName;
@@ -35,7 +38,8 @@ class Capture
 public:
     Capture(System& system)
     {
-        system.loadConfig<Config>(CONFIG_COLUMN(iface), CONFIG_COLUMN(mtu), CONFIG_COLUMN(type), CONFIG_COLUMN(dpdk_cmd), CONFIG_COLUMN(devices));
+        system.loadConfig<Config>(CONFIG_COLUMN(iface), CONFIG_COLUMN(mtu), CONFIG_COLUMN(type), CONFIG_COLUMN(dpdk_cmd), CONFIG_COLUMN(devices),
+                                  CONFIG_COLUMN(dedup_window_us), CONFIG_COLUMN(dedup_size));
 
         for (Config config : _configs) {
             LOG_MESS(PROBE_CAPTURE, "opening capture iface: %s(%d), mtu: %d\n", config.iface.c_str(), config.type, config.mtu);
@@ -69,6 +73,12 @@ public:
             LOG_ERR(PROBE_CAPTURE, "No capture devices found\n");
             EXIT();
         }
+
+        const Config & config = _configs.front();
+        if (config.dedup_window_us > 0 && _driversCnt > 1) {
+            _dedup.reset(new PacketDedup(config.dedup_window_us, config.dedup_size));
+            LOG_MESS(PROBE_CAPTURE, "dedup between drivers: window %d us, %lu entries\n", config.dedup_window_us, _dedup->capacity());
+        }
     }
 
     ~Capture() {}
@@ -76,11 +86,17 @@ public:
     size_t getPackets(Packet** packets, size_t bulkLimit)
     {
         size_t got = 0;
+        uint16_t id = 0;
         for ( auto &driverPtr : _drivers ) {
             std::unique_lock<std::mutex> lock(driverPtr.get()->_lock, std::try_to_lock);
             if(lock.owns_lock()) {
-                got += driverPtr.get()->getPackets(packets+got, bulkLimit/_driversCnt);
+                size_t cnt = driverPtr.get()->getPackets(packets+got, bulkLimit/_driversCnt);
+                if (_dedup && cnt) {
+                    cnt = _dedup->filter(packets+got, cnt, id);
+                }
+                got += cnt;
             }
+            id++;
         }
         return got;
     }
@@ -100,9 +116,33 @@ public:
             std::lock_guard<std::mutex> lock(driverPtr.get()->_lock);
             driverPtr.get()->idle(id++);
         }
+        if (_dedup) {
+            dedupIdle();
+        }
     }
 private:
     std::vector<Config> _configs;
     std::vector<std::unique_ptr<Driver>> _drivers;
     size_t _driversCnt;
+    std::unique_ptr<PacketDedup> _dedup;
+    struct timeval _dedupPrev = { 0, 0 };
+
+    void dedupIdle()
+    {
+        struct timeval curr;
+        gettimeofday(&curr, nullptr);
+        if (TimeHandler::timeval_diff(curr, _dedupPrev) <= 500000) {
+            return;
+        }
+        _dedupPrev = curr;
+
+        auto stats = _dedup->stats();
+        FILE * file = fopen("./capture_dedup_stat.txt", "w");
+        if (file) {
+            fprintf(file, "(Dedup window %lu us, %lu entries) checked: %lu, suppressed: %lu (%.2f%%), evicted: %lu\n",
+                    _dedup->window(), _dedup->capacity(), stats.checked, stats.suppressed,
+                    stats.checked ? 100.0 * stats.suppressed / stats.checked : 0.0, stats.evicted);
+            fclose(file);
+        }
+    }
 };
@@ -0,0 +1,200 @@
+// Copyright: https://github.com/mikerez/mediaroom/blob/main/LICENSE
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <mutex>
+
+#include "../core/Packet.h"
+#include "../TimeHandler.h"
+
+/*
+ * Drops copies of the same frame delivered by different capture drivers (redundant mirror ports).
+ *
+ * Fingerprint covers L3 and upper bytes only (first HASH_LIMIT of them plus length); L2 (MAC, VLAN tags) may be rewritten by taps, IPv4 TTL/checksum
+ * and IPv6 hop limit differ between mirror points, so they are masked out.
+ * Fingerprints are kept in a set-associative table with timestamps: entry older than
+ * window is treated as empty, so filter never needs explicit cleanup. Copy is dropped only if seen from another
+ * driver within window, retransmissions on the same tap pass through.
+ */
+class PacketDedup
+{
+public:
+    struct Stats
+    {
+        uint64_t checked = 0;
+        uint64_t suppressed = 0;
+        uint64_t evicted = 0;   // live entries replaced before window end: table is too small for traffic
+    };
+
+    PacketDedup(const TimeHandler::usecs_t & window_usecs, size_t entries): _window(window_usecs)
+    {
+        size_t buckets = 1;
+        while(buckets * WAYS < entries) {
+            buckets <<= 1;
+        }
+        _mask = buckets - 1;
+        _buckets.resize(buckets);
+    }
+
+    PacketDedup(const PacketDedup &) = delete;
+    PacketDedup & operator =(const PacketDedup &) = delete;
+
+    // Filters packets in place, dropped duplicates are freed. Returns number of packets left.
+    size_t filter(Packet ** packets, size_t count, const uint16_t & driver_id)
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        size_t left = 0;
+        for(size_t i = 0; i < count; i++) {
+            Packet * packet = packets[i];
+            auto ts = TimeHandler::Instance()->get_time_usecs(packet->cpu_ticks);
+            if(check(fingerprint(packet), ts, driver_id)) {
+                packet->free();
+                continue;
+            }
+            packets[left++] = packet;
+        }
+        _stats.checked += count;
+        _stats.suppressed += count - left;
+        return left;
+    }
+
+    Stats stats()
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        return _stats;
+    }
+
+    size_t capacity() const
+    {
+        return (_mask + 1) * WAYS;
+    }
+
+    TimeHandler::usecs_t window() const
+    {
+        return _window;
+    }
+
+private:
+    static const size_t WAYS = 4;
+    // Headers and start of payload are enough to tell frames apart, full length is mixed in separately
+    static const size_t HASH_LIMIT = 256;
+
+    struct Entry
+    {
+        uint32_t tag = 0;   // 0 - empty
+        uint16_t driver_id = 0;
+        uint16_t reserved = 0;
+        TimeHandler::usecs_t ts = 0;
+    };
+
+    // 64 bytes: whole bucket is checked with one cache line fetch
+    struct Bucket
+    {
+        Entry ways[WAYS];
+    };
+
+    TimeHandler::usecs_t _window;
+    size_t _mask;
+    std::vector<Bucket> _buckets;
+    std::mutex _lock;
+    Stats _stats;
+
+    // Returns true if packet is a copy from another driver
+    bool check(const uint64_t & hash, const TimeHandler::usecs_t & ts, const uint16_t & driver_id)
+    {
+        Bucket & bucket = _buckets[hash & _mask];
+        uint32_t tag = (uint32_t)(hash >> 32) | 1;
+        // Victim is first expired entry, otherwise the oldest live one
+        Entry * victim = nullptr;
+        bool victim_live = true;
+        for(auto & entry : bucket.ways) {
+            bool live = entry.tag && inWindow(ts, entry.ts);
+            if(live && entry.tag == tag) {
+                if(entry.driver_id != driver_id) {
+                    // Every copy is suppressed once, next packet with same bytes is a new one
+                    entry.tag = 0;
+                    return true;
+                }
+                entry.ts = ts;
+                return false;
+            }
+            if(victim_live && (!live || !victim || entry.ts < victim->ts)) {
+                victim = &entry;
+                victim_live = live;
+            }
+        }
+
+        if(victim_live) {
+            _stats.evicted++;
+        }
+        victim->tag = tag;
+        victim->driver_id = driver_id;
+        victim->ts = ts;
+        return false;
+    }
+
+    // Drivers are not synchronized, copy may carry slightly older timestamp than the original
+    bool inWindow(const TimeHandler::usecs_t & ts_l, const TimeHandler::usecs_t & ts_r) const
+    {
+        return (ts_l > ts_r ? ts_l - ts_r : ts_r - ts_l) <= _window;
+    }
+
+    static uint64_t load(const uint8_t * data, const size_t & len)
+    {
+        uint64_t word = 0;
+        memcpy(&word, data, len < 8 ? len : 8);
+        return word;
+    }
+
+    static uint64_t fingerprint(const Packet * packet)
+    {
+        const uint8_t * data = packet->data();
+        size_t len = packet->dataLength();
+        // Little-endian masks for first two 8-byte words of L3 header
+        uint64_t mask0 = ~0ULL;
+        uint64_t mask1 = ~0ULL;
+
+        if(packet->type == Packet::L2Eth && len >= 14) {
+            size_t offs = 12;
+            uint16_t ether_type = (data[offs] << 8) | data[offs + 1];
+            while((ether_type == 0x8100 || ether_type == 0x88a8 || ether_type == 0x9100) && len >= offs + 6) {
+                offs += 4;
+                ether_type = (data[offs] << 8) | data[offs + 1];
+            }
+            offs += 2;
+            data += offs;
+            len -= offs;
+
+            if(ether_type == 0x0800 && len >= 20) {
+                mask1 = ~0x00000000FFFF00FFULL;     // TTL (byte 8), header checksum (bytes 10-11)
+            }
+            else if(ether_type == 0x86DD && len >= 40) {
+                mask0 = ~0xFF00000000000000ULL;     // hop limit (byte 7)
+            }
+        }
+
+        uint64_t hash = len * 0x9E3779B97F4A7C15ULL;
+        if(len > HASH_LIMIT) {
+            len = HASH_LIMIT;
+        }
+        for(size_t pos = 0; pos < len; pos += 8) {
+            uint64_t word = load(data + pos, len - pos);
+            if(pos == 0) {
+                word &= mask0;
+            }
+            else if(pos == 8) {
+                word &= mask1;
+            }
+            hash = (hash ^ word) * 0xC2B2AE3D27D4EB4FULL;
+            hash = (hash << 31) | (hash >> 33);
+        }
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 33;
+        return hash;
+    }
+};
@@ -21,6 +21,7 @@
 
 #include "Packet.h"
 #include "Capture.h"
+#include "HeavyHitters.h"
 
 #include <boost/crc.hpp>
 
@@ -65,8 +66,12 @@ void ctrlHandler(int signum)
 }
 #endif
 
-void idle()
+void idle(HeavyHitters & heavy_hitters, SharedServer & shm_server)
 {
+    heavy_hitters.idle();
+    // Frames of framed channels are sent by this thread
+    shm_server.flush();
+
     static timeval prev = { 0, 0 };
     timeval curr;
     gettimeofday(&curr, nullptr);
@@ -75,6 +80,8 @@ void idle()
         FILE * file = fopen("main_stats.txt", "w");
         if(file)
         {
+            heavy_hitters.print(file);
+            shm_server.print(file);
             fclose(file);
         }
     }
@@ -133,7 +140,10 @@ int main( int argc, char ** argv )
 
     std::unique_ptr<Packet *> _pkts = std::make_unique<Packet *>(new Packet*[10]);
     Capture capture(system);
-    Stack stack;
+    // Stack parses packets and passes them to its next stage: heavy hitters are counted per core by flowHash after parsing
+    HeavyHitters heavy_hitters;
+    HeavyHittersChain heavy_hitters_chain(heavy_hitters);
+    Stack stack(&heavy_hitters_chain);
 
     while(!gExit) {
         // TODO
@@ -143,6 +153,7 @@ int main( int argc, char ** argv )
         }
 
         capture.idle();
+        idle(heavy_hitters, shm_server);
         usleep(10);
     }
 
@@ -0,0 +1,126 @@
+// Copyright: https://github.com/mikerez/mediaroom/blob/main/LICENSE
+
+/*
+ * Cross-core throughput of CycleBuffer: producer and consumer are forked processes pinned to different cores,
+ * the ring is in shared mapping like SharedCircularBuffer. Consumer checks sequence and length of every message.
+ *
+ * cycle_buffer_bench [producer_cpu consumer_cpu [ring_bytes [messages]]]
+ *
+ * Not run by ctest: result depends on the host. On one CPU both sides share it and yield to each other,
+ * so it measures instruction cost per record, not cache line transfer between cores.
+ */
+
+#include "CycleBuffer.h"
+
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+struct Control
+{
+    std::atomic<uint32_t> ready;
+    std::atomic<uint64_t> errors;
+};
+
+static bool pin(const int & cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+static void wait(Control * control, const uint32_t & parties)
+{
+    control->ready.fetch_add(1);
+    while(control->ready.load() < parties) {
+        std::this_thread::yield();
+    }
+}
+
+static void produce(CycleBuffer & cb, Control * control, const uint32_t & size, const uint64_t & messages)
+{
+    std::vector<uint8_t> message(size > sizeof(uint64_t) ? size : sizeof(uint64_t));
+    wait(control, 2);
+    for(uint64_t seq = 0; seq < messages; seq++) {
+        memcpy(message.data(), &seq, sizeof(seq));
+        while(!cb.write1(message.data(), size)) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+static void consume(CycleBuffer & cb, Control * control, const uint32_t & size, const uint64_t & messages)
+{
+    uint64_t errors = 0;
+    wait(control, 2);
+    for(uint64_t seq = 0; seq < messages; ) {
+        uint32_t len;
+        auto data = cb.read1(len);
+        if(!data) {
+            std::this_thread::yield();
+            continue;
+        }
+        uint64_t got;
+        memcpy(&got, data, sizeof(got));
+        errors += len != size || got != seq;
+        seq++;
+    }
+    control->errors.store(errors);
+}
+
+int main(int argc, char * argv[])
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int producer_cpu = argc > 2 ? atoi(argv[1]) : 0;
+    int consumer_cpu = argc > 2 ? atoi(argv[2]) : (cpus > 1 ? 1 : 0);
+    size_t ring = argc > 3 ? strtoul(argv[3], nullptr, 0) : 4 << 20;
+    uint64_t total = argc > 4 ? strtoull(argv[4], nullptr, 0) : 0;
+
+    if(cpus < 2 || producer_cpu == consumer_cpu) {
+        printf("Producer and consumer share CPU %i (%li online): result is not cross-core\n", producer_cpu, cpus);
+    }
+
+    size_t mem_size = sizeof(Control) + 64 + ring;
+    uint8_t * mem = (uint8_t *)mmap(nullptr, mem_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(mem == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    for(uint32_t size : { 16, 64, 1024, 65536 }) {
+        uint64_t messages = total ? total : (size <= 64 ? 20000000 : 200000000 / size);
+        Control * control = new (mem) Control();
+        CycleBuffer cb(mem + 64 * ((sizeof(Control) + 63) / 64), ring);
+        cb.clear();
+
+        pid_t child = fork();
+        if(!child) {
+            if(!pin(consumer_cpu)) {
+                perror("consumer affinity");
+            }
+            consume(cb, control, size, messages);
+            _exit(0);
+        }
+        if(!pin(producer_cpu)) {
+            perror("producer affinity");
+        }
+        auto start = std::chrono::steady_clock::now();
+        produce(cb, control, size, messages);
+        waitpid(child, nullptr, 0);
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        printf("%6u B: %7.2f M msg/s, %6.2f GB/s, %lu errors\n", size, messages / secs / 1e6, messages * size / secs / 1e9,
+               (unsigned long)control->errors.load());
+    }
+
+    munmap(mem, mem_size);
+    return 0;
+}
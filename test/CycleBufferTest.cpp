@@ -0,0 +1,72 @@
+// Copyright: https://github.com/mikerez/mediaroom/blob/main/LICENSE
+
+#include "Test.h"
+#include "CycleBuffer.h"
+
+#include <stdlib.h>
+#include <vector>
+
+int main()
+{
+    runTest("descriptor is aligned for odd memory size", []() {
+        // Like client shm_size in app/example.cpp
+        const size_t size = 10001;
+        uint8_t * mem = (uint8_t *)aligned_alloc(64, 10048);
+        CycleBuffer cb(mem, size);
+        cb.clear();
+        CHECK((uintptr_t)&cb->head % 64 == 0);
+        CHECK((uintptr_t)&cb->tail % 64 == 0);
+        CHECK((uint8_t *)&cb->size + sizeof(size_t) <= mem + size);
+        CHECK(cb.size() % CycleBuffer::RECORD_ALIGN == 0);
+        CHECK(mem + cb.size() <= (uint8_t *)&cb->head);
+        free(mem);
+    });
+
+    runTest("records wrap and keep order", []() {
+        const size_t size = 4097;
+        uint8_t * mem = (uint8_t *)aligned_alloc(64, 4160);
+        CycleBuffer cb(mem, size);
+        cb.clear();
+
+        uint32_t written = 0, read = 0;
+        std::vector<uint8_t> record(301);
+        for(int round = 0; round < 200; round++) {
+            // Odd lengths, so records are padded and marker is written at different positions
+            uint32_t len = 1 + (written * 37) % record.size();
+            memset(record.data(), (uint8_t)written, len);
+            if(cb.write1(record.data(), len)) {
+                written++;
+            }
+            if(round % 3) {
+                continue;
+            }
+            uint32_t got;
+            while(auto data = cb.read1(got)) {
+                CHECK(got == 1 + (read * 37) % record.size());
+                CHECK(data[0] == (uint8_t)read && data[got - 1] == (uint8_t)read);
+                read++;
+            }
+        }
+        uint32_t got;
+        while(auto data = cb.read1(got)) {
+            CHECK(data[0] == (uint8_t)read);
+            read++;
+        }
+        cb.release();
+        CHECK(written > 100);
+        CHECK(read == written);
+        CHECK(cb.length() == 0);
+        free(mem);
+    });
+
+    runTest("record bigger than ring is refused", []() {
+        uint8_t * mem = (uint8_t *)aligned_alloc(64, 1024);
+        CycleBuffer cb(mem, 1000);
+        cb.clear();
+        CHECK(cb.reserve(cb.size()) == nullptr);
+        CHECK(cb.reserve(cb.size() - CycleBuffer::RECORD_HDR_SIZE) != nullptr);
+        free(mem);
+    });
+
+    return testResult();
+}
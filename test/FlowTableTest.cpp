@@ -0,0 +1,145 @@
+// Copyright: https://github.com/mikerez/mediaroom/blob/main/LICENSE
+
+#include "Test.h"
+#include "FlowTable.h"
+
+#include <new>
+
+typedef FlowTable<uint64_t, uint64_t> table_t;
+
+// Allocation of bucket arrays (more than one element) fails while it is set
+static bool fail_buckets = false;
+
+template<typename T>
+struct FailingAllocator
+{
+    typedef T value_type;
+
+    FailingAllocator() = default;
+    template<typename U> FailingAllocator(const FailingAllocator<U> &) { }
+
+    T * allocate(size_t n)
+    {
+        if(fail_buckets && n > 1) {
+            throw std::bad_alloc();
+        }
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T * ptr, size_t n)
+    {
+        std::allocator<T>().deallocate(ptr, n);
+    }
+
+    template<typename U> bool operator ==(const FailingAllocator<U> &) const { return true; }
+    template<typename U> bool operator !=(const FailingAllocator<U> &) const { return false; }
+};
+
+static bool allFound(table_t & table, const uint64_t & begin, const uint64_t & end)
+{
+    for(uint64_t key = begin; key < end; key++) {
+        auto value = table.find(key);
+        if(!value || *value != key * 3) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main()
+{
+    runTest("grows and finds every key during resize", []() {
+        table_t table(16);
+        bool seen_resizing = false, seen_init = false;
+        for(uint64_t key = 0; key < 10000; key++) {
+            CHECK(table.insert(key, key * 3).second);
+            if(table.resizing()) {
+                seen_resizing = true;
+                seen_init |= !table.migrating();
+                // Some keys are in old array, some in new one
+                CHECK(table.find(key / 2) && *table.find(key / 2) == key / 2 * 3);
+            }
+        }
+        CHECK(seen_resizing);
+        CHECK(seen_init);
+        CHECK(table.size() == 10000);
+        CHECK(allFound(table, 0, 10000));
+        while(table.rehashStep(table_t::REHASH_STEP)) { }
+        auto stats = table.stats();
+        CHECK(stats.buckets >= 10000);
+        CHECK(stats.resizes > 0);
+        CHECK(stats.migrated > 0);
+        CHECK(stats.failed_resizes == 0);
+    });
+
+    runTest("shrinks after erase and keeps the rest", []() {
+        table_t table(16);
+        for(uint64_t key = 0; key < 10000; key++) {
+            table.insert(key, key * 3);
+        }
+        while(table.rehashStep(table_t::REHASH_STEP)) { }
+        auto grown = table.stats().buckets;
+
+        for(uint64_t key = 100; key < 10000; key++) {
+            CHECK(table.erase(key));
+            CHECK(!table.find(key));
+        }
+        CHECK(!table.erase(100));
+        CHECK(table.size() == 100);
+        CHECK(allFound(table, 0, 100));
+        while(table.rehashStep(table_t::REHASH_STEP)) { }
+        CHECK(table.stats().buckets < grown);
+        CHECK(allFound(table, 0, 100));
+
+        size_t visited = 0;
+        table.forEach([&](const uint64_t & key, uint64_t & value) {
+            CHECK(value == key * 3);
+            visited++;
+        });
+        CHECK(visited == 100);
+    });
+
+    runTest("new bucket array is initialized a step at a time", []() {
+        table_t table(1024);
+        for(uint64_t key = 0; key < 1024; key++) {
+            table.insert(key, key * 3);
+        }
+        CHECK(table.resizing());
+        CHECK(!table.migrating());
+        // 2048 new buckets need 2048 / (REHASH_STEP * INIT_PER_STEP) operations before migration starts
+        size_t ops = 1;
+        while(!table.migrating()) {
+            CHECK(table.find(ops % 1024));
+            ops++;
+        }
+        CHECK(ops >= 2048 / (table_t::REHASH_STEP * table_t::INIT_PER_STEP));
+        CHECK(allFound(table, 0, 1024));
+        CHECK(table.insert(5000, 15000).second);
+        CHECK(table.find(5000) && *table.find(5000) == 15000);
+    });
+
+    runTest("failed allocation of bucket array skips resize", []() {
+        typedef FlowTable<uint64_t, uint64_t, FailingAllocator<uint64_t>> failing_table_t;
+        failing_table_t table(16);
+        fail_buckets = true;
+        for(uint64_t key = 0; key < 200; key++) {
+            CHECK(table.insert(key, key * 3).second);
+        }
+        CHECK(!table.resizing());
+        CHECK(table.stats().failed_resizes > 0);
+        CHECK(table.stats().buckets == 16);
+        for(uint64_t key = 0; key < 200; key++) {
+            CHECK(table.find(key) && *table.find(key) == key * 3);
+        }
+
+        fail_buckets = false;
+        for(uint64_t key = 200; key < 400; key++) {
+            table.insert(key, key * 3);
+        }
+        while(table.rehashStep(failing_table_t::REHASH_STEP)) { }
+        CHECK(table.stats().buckets > 16);
+        CHECK(table.size() == 400);
+    });
+
+    return testResult();
+}
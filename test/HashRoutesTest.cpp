@@ -0,0 +1,97 @@
+// Copyright: https://github.com/mikerez/mediaroom/blob/main/LICENSE
+
+#include "Test.h"
+#include "HashRoutes.h"
+
+#include <memory>
+
+typedef HashRoutes<std::shared_ptr<int>> routes_t;
+
+static int routed(const routes_t & routes, const uint64_t & hash)
+{
+    auto value = routes.find(hash);
+    return value ? **value : -1;
+}
+
+int main()
+{
+    runTest("exact hash goes before mask and range", []() {
+        routes_t routes;
+        CHECK(routes.bind(7, std::make_shared<int>(1)));
+        CHECK(!routes.bind(7, std::make_shared<int>(2)));
+        CHECK(routes.bindMask(0x3, 0x3, std::make_shared<int>(2)));
+        CHECK(routes.bindRange(0, 100, std::make_shared<int>(3)));
+        CHECK(routed(routes, 7) == 1);
+        CHECK(routed(routes, 11) == 2);
+        CHECK(routed(routes, 8) == 3);
+        CHECK(routed(routes, 101) == -1);
+    });
+
+    runTest("mask splits hashes between consumers", []() {
+        routes_t routes;
+        for(int i = 0; i < 4; i++) {
+            CHECK(routes.bindMask(0x3, i, std::make_shared<int>(i)));
+        }
+        CHECK(!routes.bindMask(0x3, 2, std::make_shared<int>(9)));
+        CHECK(!routes.bindMask(0x3, 4, std::make_shared<int>(9)));
+        // Not low bits mask is in hash map
+        CHECK(routes.bindMask(0xF0, 0x50, std::make_shared<int>(5)));
+        CHECK(!routes.bindMask(0xF0, 0x50, std::make_shared<int>(9)));
+        for(uint64_t hash = 0; hash < 1000; hash++) {
+            CHECK(routed(routes, hash) == (int)(hash & 0x3));
+        }
+
+        routes_t high;
+        CHECK(high.bindMask(0xF0, 0x50, std::make_shared<int>(5)));
+        CHECK(routed(high, 0x1253) == 5);
+        CHECK(routed(high, 0x1263) == -1);
+    });
+
+    runTest("ranges are found across index buckets", []() {
+        routes_t routes;
+        const uint64_t quarter = 1ULL << 62;
+        for(int i = 0; i < 4; i++) {
+            CHECK(routes.bindRange(i * quarter, i * quarter + quarter - 1, std::make_shared<int>(i)));
+        }
+        CHECK(!routes.bindRange(quarter + 5, quarter + 10, std::make_shared<int>(9)));
+        for(int i = 0; i < 4; i++) {
+            CHECK(routed(routes, i * quarter) == i);
+            CHECK(routed(routes, i * quarter + quarter / 2) == i);
+            CHECK(routed(routes, i * quarter + quarter - 1) == i);
+        }
+
+        // Small range in the middle of bucket, hashes around it are not routed
+        routes_t sparse;
+        CHECK(sparse.bindRange(1000, 2000, std::make_shared<int>(1)));
+        CHECK(sparse.bindRange(quarter, quarter, std::make_shared<int>(2)));
+        CHECK(routed(sparse, 999) == -1);
+        CHECK(routed(sparse, 1500) == 1);
+        CHECK(routed(sparse, 2001) == -1);
+        CHECK(routed(sparse, quarter) == 2);
+        CHECK(routed(sparse, quarter + 1) == -1);
+        CHECK(!sparse.bindRange(5, 4, std::make_shared<int>(3)));
+    });
+
+    runTest("erased consumer loses all its rules", []() {
+        routes_t routes;
+        auto gone = std::make_shared<int>(1);
+        auto kept = std::make_shared<int>(2);
+        routes.bind(1, gone);
+        routes.bind(2, kept);
+        routes.bindMask(0x1, 1, gone);
+        routes.bindMask(0xF00, 0x100, gone);
+        routes.bindRange(1000, 2000, gone);
+        routes.bindRange(3000, 4000, kept);
+        CHECK(routes.eraseIf([&](const std::shared_ptr<int> & value) { return value == gone; }) == 4);
+        CHECK(routed(routes, 1) == -1);
+        CHECK(routed(routes, 2) == 2);
+        CHECK(routed(routes, 1001) == -1);
+        CHECK(routed(routes, 0x100) == -1);
+        CHECK(routed(routes, 3001) == 2);
+        // Erased rules may be bound again
+        CHECK(routes.bindMask(0x1, 1, kept));
+        CHECK(routed(routes, 1001) == 2);
+    });
+
+    return testResult();
+}
@@ -0,0 +1,129 @@
+// Copyright: https://github.com/mikerez/mediaroom/blob/main/LICENSE
+
+#include "Test.h"
+#include "PayloadSlab.h"
+#include "SharedPayloadSlab.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <set>
+#include <thread>
+#include <vector>
+
+int main()
+{
+    runTest("chunks are taken once until exhausted", []() {
+        uint8_t * mem = (uint8_t *)aligned_alloc(64, 4096);
+        PayloadSlab slab;
+        slab.set(mem, 4096, 100);
+        slab.clear();
+        CHECK(slab.chunkData() >= 100);
+
+        std::set<PayloadSlab::chunk_t> taken;
+        for(size_t i = 0; i < slab.chunks(); i++) {
+            auto chunk = slab.alloc(1);
+            CHECK(chunk != PayloadSlab::NO_CHUNK);
+            CHECK(slab.data(chunk) + slab.chunkData() <= mem + 4096);
+            taken.insert(chunk);
+        }
+        CHECK(taken.size() == slab.chunks());
+        CHECK(slab.alloc(1) == PayloadSlab::NO_CHUNK);
+
+        slab.release(*taken.begin());
+        CHECK(slab.alloc(1) == *taken.begin());
+        free(mem);
+    });
+
+    runTest("chunks are not touched until taken", []() {
+        uint8_t * mem = (uint8_t *)aligned_alloc(64, 1 << 16);
+        memset(mem, 0xAA, 1 << 16);
+        PayloadSlab slab;
+        slab.set(mem, 1 << 16, 1000);
+        slab.clear();
+        CHECK(slab.chunks() > 2);
+        for(size_t i = sizeof(PayloadSlabDescriptor); i < (1 << 16); i++) {
+            CHECK(mem[i] == 0xAA);
+        }
+        // Never taken chunks are given in order, released ones first
+        CHECK(slab.alloc(1) == 0 && slab.alloc(1) == 1);
+        CHECK(mem[(1 << 16) - 1] == 0xAA);
+        slab.release(0);
+        CHECK(slab.alloc(1) == 0 && slab.alloc(1) == 2);
+        free(mem);
+    });
+
+    runTest("shared slab checks segment size", []() {
+        bool thrown = false;
+        try {
+            SharedPayloadSlab small("shm_test_slab_small", 2048, true);
+        }  catch (std::exception &e) {
+            thrown = true;
+        }
+        CHECK(thrown);
+
+        SharedPayloadSlab creator("shm_test_slab", 1 << 20, true);
+        SharedPayloadSlab subscriber("shm_test_slab");
+        CHECK(subscriber.slab().chunks() == creator.slab().chunks() && creator.slab().chunks() > 400);
+        auto chunk = creator.slab().alloc(1);
+        memcpy(creator.slab().data(chunk), "payload", 8);
+        CHECK(!strcmp((char *)subscriber.slab().data(chunk), "payload"));
+        subscriber.slab().release(chunk);
+        shared_memory_object::remove("shm_test_slab");
+    });
+
+    runTest("chunk returns after the last reader", []() {
+        uint8_t * mem = (uint8_t *)aligned_alloc(64, 4096);
+        PayloadSlab slab;
+        slab.set(mem, 4096, 1000);
+        slab.clear();
+        CHECK(slab.chunks() == 3);
+
+        auto a = slab.alloc(3);
+        slab.alloc(1);
+        slab.alloc(1);
+        CHECK(slab.alloc(1) == PayloadSlab::NO_CHUNK);
+        slab.release(a);
+        slab.release(a);
+        CHECK(slab.alloc(1) == PayloadSlab::NO_CHUNK);
+        slab.release(a);
+        CHECK(slab.alloc(2) == a);
+        // Readers which didn't get ref are released at once
+        slab.release(a, 2);
+        CHECK(slab.alloc(1) == a);
+        free(mem);
+    });
+
+    runTest("concurrent alloc and release keep every chunk", []() {
+        uint8_t * mem = (uint8_t *)aligned_alloc(64, 1 << 16);
+        PayloadSlab slab;
+        slab.set(mem, 1 << 16, 64);
+        slab.clear();
+
+        std::vector<std::thread> threads;
+        for(int t = 0; t < 4; t++) {
+            threads.emplace_back([&, t]() {
+                for(int i = 0; i < 100000; i++) {
+                    auto chunk = slab.alloc(1);
+                    if(chunk == PayloadSlab::NO_CHUNK) {
+                        continue;
+                    }
+                    // Owner is alone in chunk
+                    memset(slab.data(chunk), t, 64);
+                    CHECK(slab.data(chunk)[63] == t);
+                    slab.release(chunk);
+                }
+            });
+        }
+        for(auto & thread : threads) {
+            thread.join();
+        }
+        size_t chunks = 0;
+        while(slab.alloc(1) != PayloadSlab::NO_CHUNK) {
+            chunks++;
+        }
+        CHECK(chunks == slab.chunks());
+        free(mem);
+    });
+
+    return testResult();
+}
@@ -0,0 +1,76 @@
+// Copyright: https://github.com/mikerez/mediaroom/blob/main/LICENSE
+
+#include "Test.h"
+#include "RecordFrame.h"
+
+#include <string>
+#include <vector>
+
+static std::vector<std::string> readFrame(const uint8_t * frame, const size_t & size)
+{
+    std::vector<std::string> messages;
+    FrameReader reader(frame, size);
+    const uint8_t * message;
+    uint32_t length;
+    while(reader.next(message, length)) {
+        messages.emplace_back((const char *)message, length);
+    }
+    return messages;
+}
+
+int main()
+{
+    runTest("messages come back in order", []() {
+        std::vector<uint8_t> span(256);
+        FrameBuilder builder;
+        builder.start(span.data(), span.size());
+        std::vector<std::string> messages = { "first", "", "third message", std::string(100, 'x') };
+        for(auto & message : messages) {
+            CHECK(builder.add((const uint8_t *)message.data(), message.size()));
+        }
+        CHECK(builder.count() == messages.size());
+        size_t size = builder.finish();
+        CHECK(!builder.started());
+        CHECK(size == 5 + 13 + 100 + (messages.size() + 1) * FrameBuilder::INDEX_ENTRY);
+        CHECK(readFrame(span.data(), size) == messages);
+    });
+
+    runTest("message which doesn't fit is refused", []() {
+        std::vector<uint8_t> span(FrameBuilder::frameSize(10) + 12);
+        FrameBuilder builder;
+        builder.start(span.data(), span.size());
+        CHECK(builder.add((const uint8_t *)"0123456789", 10));
+        CHECK(!builder.add((const uint8_t *)"0123456789", 11));
+        CHECK(builder.add((const uint8_t *)"0123456789", 10));
+        CHECK(!builder.add((const uint8_t *)"", 0));
+        size_t size = builder.finish();
+        CHECK(size == span.size());
+        CHECK(readFrame(span.data(), size).size() == 2);
+    });
+
+    runTest("broken frame has no messages", []() {
+        std::vector<uint8_t> span(64);
+        FrameBuilder builder;
+        builder.start(span.data(), span.size());
+        builder.add((const uint8_t *)"abc", 3);
+        builder.add((const uint8_t *)"defg", 4);
+        size_t size = builder.finish();
+
+        CHECK(FrameReader(span.data(), 1).count() == 0);
+        CHECK(FrameReader(span.data(), FrameBuilder::MAX_FRAME_SIZE + 1).count() == 0);
+        // Count bigger than frame
+        auto broken = span;
+        broken[size - 2] = 0xFF;
+        CHECK(FrameReader(broken.data(), size).count() == 0);
+        // End of message behind the index
+        broken = span;
+        broken[size - 4] = 60;
+        CHECK(readFrame(broken.data(), size).empty());
+        // Ends going back
+        broken = span;
+        broken[size - 6] = 2;
+        CHECK(readFrame(broken.data(), size).size() == 1);
+    });
+
+    return testResult();
+}
@@ -0,0 +1,111 @@
+// Copyright: https://github.com/mikerez/mediaroom/blob/main/LICENSE
+
+#include "Test.h"
+#include "RouteTable.h"
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <thread>
+#include <vector>
+
+typedef RouteTable<std::map<uint64_t, std::shared_ptr<uint64_t>>> table_t;
+
+int main()
+{
+    runTest("reader keeps its snapshot over update", []() {
+        table_t table;
+        table.update([](table_t::table_t & routes) {
+            routes[1] = std::make_shared<uint64_t>(10);
+            return true;
+        });
+        CHECK(!table.update([](table_t::table_t & routes) {
+            routes[2] = std::make_shared<uint64_t>(20);
+            return false;
+        }));
+
+        std::atomic<bool> updated(false);
+        std::thread writer;
+        {
+            table_t::Reader reader(table);
+            CHECK(reader->size() == 1 && *reader->at(1) == 10);
+            writer = std::thread([&]() {
+                table.update([](table_t::table_t & routes) {
+                    routes.erase(1);
+                    return true;
+                });
+                updated = true;
+            });
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            // Writer waits for grace period while this section can see the old snapshot
+            CHECK(!updated);
+            CHECK(reader->size() == 1 && *reader->at(1) == 10);
+        }
+        writer.join();
+        CHECK(updated);
+        table_t::Reader reader(table);
+        CHECK(reader->empty());
+    });
+
+    runTest("values of old snapshots outlive their readers", []() {
+        table_t table;
+        std::atomic<bool> stop(false);
+        std::atomic<size_t> bad(0), reads(0);
+        std::vector<std::thread> readers;
+        for(int r = 0; r < 2; r++) {
+            readers.emplace_back([&]() {
+                while(!stop.load()) {
+                    table_t::Reader routes(table);
+                    for(auto & route : *routes) {
+                        // Value is the key of its route, a freed one wouldn't be
+                        bad += *route.second != route.first;
+                    }
+                    reads++;
+                }
+            });
+        }
+        while(!reads.load()) {
+            std::this_thread::yield();
+        }
+        for(uint64_t i = 0; i < 200; i++) {
+            table.update([&](table_t::table_t & routes) {
+                routes.erase(i - 8);
+                routes[i] = std::make_shared<uint64_t>(i);
+                return true;
+            });
+        }
+        stop = true;
+        for(auto & reader : readers) {
+            reader.join();
+        }
+        table_t::Reader routes(table);
+        CHECK(routes->size() == 8);
+        CHECK(bad == 0);
+    });
+
+    runTest("exited readers give their slots to new ones", []() {
+        table_t table;
+        table.update([](table_t::table_t & routes) {
+            routes[1] = std::make_shared<uint64_t>(1);
+            return true;
+        });
+        std::atomic<size_t> failed(0);
+        for(size_t i = 0; i < table_t::MAX_READERS * 4; i++) {
+            std::thread([&]() {
+                try {
+                    table_t::Reader routes(table);
+                    failed += routes->size() != 1;
+                }  catch (std::exception &e) {
+                    failed++;
+                }
+            }).join();
+        }
+        CHECK(failed == 0);
+        table.update([](table_t::table_t & routes) {
+            routes.clear();
+            return true;
+        });
+    });
+
+    return testResult();
+}
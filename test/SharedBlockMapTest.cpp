@@ -0,0 +1,53 @@
+// Copyright: https://github.com/mikerez/mediaroom/blob/main/LICENSE
+
+#include "Test.h"
+#include "SharedBlockMap.h"
+
+#include <vector>
+
+static const char * SEGMENT = "shm_test_blockmap";
+
+int main()
+{
+    shared_memory_object::remove(SEGMENT);
+    managed_shared_memory segment(create_only, SEGMENT, 8 * 1024 * 1024);
+    auto map = segment.construct<SharedBlockMap>("blocks")(segment, 4 * 1024 * 1024);
+
+    runTest("list keeps sequence order across wraparound", [&]() {
+        const SharedBlockMap::key_t list = (SharedBlockMap::key_t)7 << 32;
+        std::vector<uint32_t> seqs = { 0xFFFFF000, 0x00000800, 0xFFFFF800, 0x00000000, 0x00001000 };
+        for(auto seq : seqs) {
+            CHECK(map->emplace(list | seq, Block::BlockType::L4_PAYLOAD) != SharedBlockMap::NO_BLOCK);
+        }
+
+        std::vector<uint32_t> order;
+        for(auto handle = map->lowerBound(list | 0xFFFFF000); handle; handle = map->next(handle)) {
+            order.push_back((uint32_t)map->key(handle));
+        }
+        CHECK((order == std::vector<uint32_t>{ 0xFFFFF000, 0xFFFFF800, 0x00000000, 0x00000800, 0x00001000 }));
+
+        auto handle = map->lowerBound(list | 0xFFFFFFF0);
+        CHECK(handle && (uint32_t)map->key(handle) == 0x00000000);
+        handle = map->lowerBound(list | 0x00000801);
+        CHECK(handle && (uint32_t)map->key(handle) == 0x00001000);
+        CHECK(map->lowerBound(list | 0x00001001) == SharedBlockMap::NO_BLOCK);
+    });
+
+    runTest("erase unlinks and lists are independent", [&]() {
+        const SharedBlockMap::key_t list = (SharedBlockMap::key_t)8 << 32;
+        auto a = map->emplace(list | 100, Block::BlockType::L4_PAYLOAD);
+        auto b = map->emplace(list | 50, Block::BlockType::L4_PAYLOAD);
+        auto c = map->emplace(list | 200, Block::BlockType::L4_PAYLOAD);
+        CHECK(map->lowerBound(list) == b);
+        map->erase(a);
+        CHECK(map->next(b) == c);
+        CHECK(map->prev(c) == b);
+        CHECK(map->find(list | 100) == SharedBlockMap::NO_BLOCK);
+        CHECK(map->find(list | 200) == c);
+        CHECK(map->lowerBound(((SharedBlockMap::key_t)7 << 32) | 0x00001000) != SharedBlockMap::NO_BLOCK);
+    });
+
+    segment.destroy_ptr(map);
+    shared_memory_object::remove(SEGMENT);
+    return testResult();
+}
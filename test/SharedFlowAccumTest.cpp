@@ -0,0 +1,239 @@
+// Copyright: https://github.com/mikerez/mediaroom/blob/main/LICENSE
+
+#include "Test.h"
+#include "SharedFlowAccum.h"
+
+#include <map>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <unistd.h>
+#include <sys/wait.h>
+
+static const char * SEGMENT = "shm_test_flowaccum";
+
+static Tcp<Pkt> segment(const uint32_t & seq, const std::string & payload, const bool & syn = false, const bool & rst = false)
+{
+    size_t len = sizeof(TcpHdr) + payload.size();
+    Packet * packet = allocPacket(len);
+    TcpHdr * hdr = (TcpHdr *)packet->data();
+    memset(hdr, 0, sizeof(TcpHdr));
+    hdr->sequence = htonl(seq);
+    hdr->data_offset = 5;
+    hdr->syn = syn;
+    hdr->rst = rst;
+    memcpy(packet->data() + sizeof(TcpHdr), payload.data(), payload.size());
+    return Tcp<Pkt>(Pkt(len, packet));
+}
+
+static std::string pattern(const size_t & offset, const size_t & length)
+{
+    std::string data(length, 0);
+    for(size_t i = 0; i < length; i++) {
+        data[i] = (char)((offset + i) * 7 + (offset + i) / 251);
+    }
+    return data;
+}
+
+// Completed blocks with their keys, they are readable after expiration interval
+template<typename F>
+static void readBlocks(SharedFlowAccum & accum, F && on_block)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    bool got = true;
+    while(true) {
+        auto handle = accum.get(got);
+        if(!got) {
+            break;
+        }
+        on_block(accum.block(handle), accum.key(handle));
+        accum.erase(handle);
+    }
+}
+
+// Appends L4 messages of block to `received`, returns number of them
+static size_t readMessages(Block * block, std::string & received)
+{
+    if(block->type != (uint32_t)Block::BlockType::L4_PAYLOAD) {
+        return 0;
+    }
+    // L4 header, then length prefixed messages
+    size_t messages = 0;
+    for(uint32_t offset = 2 * sizeof(seq_t); offset < block->data_len; messages++) {
+        uint32_t length;
+        memcpy(&length, block->data() + offset, sizeof(length));
+        received.append((const char *)block->data() + offset + sizeof(length), length);
+        offset += sizeof(length) + length;
+    }
+    return messages;
+}
+
+int main()
+{
+    runTest("L7: out-of-order segment bigger than block is stored whole", []() {
+        SharedFlowAccum accum(SEGMENT, 16 << 20, true, 1, SharedFlowAccum::Mode::L7);
+        const uint32_t isn = 0xFFFFF000;
+        const size_t head = 100, tail = 20000;
+        auto stream = pattern(0, head + tail);
+        accum.put(segment(isn - 1, "", true), 1, false);
+        // GRO segment after the hole, then the hole
+        accum.put(segment(isn + head, stream.substr(head)), 1, false);
+        accum.put(segment(isn, stream.substr(0, head)), 1, false);
+        accum.put(segment((uint32_t)(isn + head + tail), "", false, true), 1, false);
+
+        std::map<uint32_t, std::string> payloads;
+        uint32_t gaps = 0;
+        readBlocks(accum, [&](Block * block, const flow_seq_key_t & key) {
+            if(block->type == (uint32_t)Block::BlockType::L7_PAYLOAD) {
+                BlockL7Wrapper l7(block);
+                gaps += l7.gap();
+                payloads[FlowSeqKeyCtx::getSeq(key) - isn] = std::string((const char *)l7.payload(), l7.payloadLength());
+            }
+        });
+        std::string received;
+        for(auto & payload : payloads) {
+            CHECK(payload.first == received.size());
+            received += payload.second;
+        }
+        CHECK(gaps == 0);
+        CHECK(received.size() == stream.size());
+        CHECK(received == stream);
+    });
+
+    runTest("L4: in-order segment bigger than block is split to messages", []() {
+        SharedFlowAccum accum(SEGMENT, 16 << 20, true, 1, SharedFlowAccum::Mode::L4);
+        const uint32_t isn = 1000;
+        auto stream = pattern(0, 30000);
+        accum.put(segment(isn - 1, "", true), 2, false);
+        accum.put(segment(isn, stream), 2, false);
+        accum.put(segment(isn + stream.size(), "x"), 2, false);
+
+        std::string received;
+        size_t messages = 0;
+        // Current block is completed by expiration
+        accum.markExpiredBlocks();
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        accum.markExpiredBlocks();
+        readBlocks(accum, [&](Block * block, const flow_seq_key_t &) {
+            messages += readMessages(block, received);
+        });
+        CHECK(messages >= 5);
+        CHECK(received == stream + "x");
+    });
+
+    runTest("L7: hole of idle flow is abandoned by timer", []() {
+        SharedFlowAccum accum(SEGMENT, 16 << 20, true, 1, SharedFlowAccum::Mode::L7);
+        const uint32_t isn = 5000;
+        const size_t head = 100;
+        const flow_idx_t flows = 50;
+        auto stream = pattern(0, 1000);
+        for(flow_idx_t flow = 1; flow <= flows; flow++) {
+            accum.put(segment(isn - 1, "", true), flow, false);
+            accum.put(segment(isn + head, stream.substr(head)), flow, false);
+        }
+        // Nothing is due yet: runs wait for their holes
+        accum.markExpiredBlocks();
+        size_t early = 0;
+        readBlocks(accum, [&](Block * block, const flow_seq_key_t &) {
+            early += block->type == (uint32_t)Block::BlockType::L7_PAYLOAD;
+        });
+        CHECK(early == 0);
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(250));
+        accum.markExpiredBlocks();
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        accum.markExpiredBlocks();
+        std::map<flow_idx_t, std::string> received;
+        std::map<flow_idx_t, uint32_t> gaps;
+        readBlocks(accum, [&](Block * block, const flow_seq_key_t & key) {
+            if(block->type == (uint32_t)Block::BlockType::L7_PAYLOAD) {
+                BlockL7Wrapper l7(block);
+                gaps[FlowSeqKeyCtx::getFlowIdx(key)] += l7.gap();
+                received[FlowSeqKeyCtx::getFlowIdx(key)].append((const char *)l7.payload(), l7.payloadLength());
+            }
+        });
+        size_t whole = 0;
+        for(flow_idx_t flow = 1; flow <= flows; flow++) {
+            whole += gaps[flow] == head && received[flow] == stream.substr(head);
+        }
+        CHECK(whole == flows);
+    });
+
+    runTest("L4: message is split to smaller block when size class is exhausted", []() {
+        SharedFlowAccum accum(SEGMENT, 4 << 20, true, 1, SharedFlowAccum::Mode::L4);
+        const uint32_t isn = 1000;
+        const flow_idx_t flows = 200;
+        auto stream = pattern(0, BlockL4Wrapper::maxMessage());
+        // Every flow holds its open block, the biggest class is exhausted by about 130 of them
+        for(flow_idx_t flow = 1; flow <= flows; flow++) {
+            accum.put(segment(isn - 1, "", true), flow, false);
+            accum.put(segment(isn, stream), flow, false);
+        }
+
+        std::map<flow_idx_t, std::string> received;
+        std::map<flow_idx_t, size_t> messages;
+        accum.markExpiredBlocks();
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        accum.markExpiredBlocks();
+        readBlocks(accum, [&](Block * block, const flow_seq_key_t & key) {
+            messages[FlowSeqKeyCtx::getFlowIdx(key)] += readMessages(block, received[FlowSeqKeyCtx::getFlowIdx(key)]);
+        });
+        size_t whole = 0, split = 0;
+        for(flow_idx_t flow = 1; flow <= flows; flow++) {
+            whole += received[flow] == stream;
+            split += messages[flow] > 1;
+        }
+        CHECK(whole == flows);
+        CHECK(split > 0);
+    });
+
+    runTest("warm restart keeps flows and blocks, lock of crashed writer is recovered", []() {
+        const uint32_t isn = 5000;
+        auto stream = pattern(0, 3000);
+        {
+            SharedFlowAccum accum(SEGMENT, 16 << 20, true, 1, SharedFlowAccum::Mode::L7);
+            accum.put(segment(isn - 1, "", true), 3, false);
+            accum.put(segment(isn, stream.substr(0, 1000)), 3, false);
+        }
+
+        // Writer attaches, goes on with the flow and dies inside critical section
+        fflush(stdout);
+        pid_t pid = fork();
+        if(!pid) {
+            SharedFlowAccum accum(SEGMENT, 16 << 20, false, 1, SharedFlowAccum::Mode::L7);
+            accum.put(segment(isn + 1000, stream.substr(1000, 1000)), 3, false);
+            managed_shared_memory shard(open_only, SEGMENT);
+            shard.find<RobustMutex>("shm_mutex").first->lock();
+            _exit(0);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        CHECK(WIFEXITED(status) && !WEXITSTATUS(status));
+
+        // Hang is failure
+        alarm(10);
+        SharedFlowAccum accum(SEGMENT, 16 << 20, false, 1, SharedFlowAccum::Mode::L7);
+        accum.put(segment(isn + 2000, stream.substr(2000)), 3, false);
+        accum.put(segment(isn + 3000, "", false, true), 3, false);
+        alarm(0);
+
+        std::string received;
+        uint32_t gaps = 0, starts = 0;
+        readBlocks(accum, [&](Block * block, const flow_seq_key_t & key) {
+            CHECK(FlowSeqKeyCtx::getFlowIdx(key) == 3);
+            starts += block->type == (uint32_t)Block::BlockType::START_FLOW;
+            if(block->type == (uint32_t)Block::BlockType::L7_PAYLOAD) {
+                BlockL7Wrapper l7(block);
+                gaps += l7.gap();
+                CHECK(FlowSeqKeyCtx::getSeq(key) - isn == received.size());
+                received.append((const char *)l7.payload(), l7.payloadLength());
+            }
+        });
+        CHECK(starts == 1);
+        CHECK(gaps == 0);
+        CHECK(received == stream);
+    });
+
+    shared_memory_object::remove(SEGMENT);
+    return testResult();
+}
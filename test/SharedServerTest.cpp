@@ -0,0 +1,281 @@
+// Copyright: https://github.com/mikerez/mediaroom/blob/main/LICENSE
+
+#include "Test.h"
+#include "SharedServer.h"
+#include "SharedClient.h"
+#include "SharedPayloadSlab.h"
+
+#include <chrono>
+#include <sys/stat.h>
+
+// Own control socket, not the one of mediaroom running on the same host
+static const std::string socket_path = "/tmp/mediaroom-test-" + std::to_string(getpid()) + ".sock";
+static SharedServer server(socket_path);
+static std::unique_ptr<SharedClient> client;
+
+// Local channel from server to client, nullptr if it is refused
+static std::unique_ptr<SharedCircularBuffer> newChannel(const ss_chan_params & params, shm_id_t & id)
+{
+    ss_cmd cmd;
+    if(!client->newRChan("shm_test_server", params) || !client->waitAck(cmd) || (ss_proto)cmd.cmd != ss_proto::SS_ACK) {
+        return nullptr;
+    }
+    id = cmd.id;
+    return std::unique_ptr<SharedCircularBuffer>(new SharedCircularBuffer(client->takeChanFd(), cmd.text));
+}
+
+static bool acked()
+{
+    ss_cmd cmd;
+    return client->waitAck(cmd) && (ss_proto)cmd.cmd == ss_proto::SS_ACK;
+}
+
+// Writes values from `first` until `count` are sent or dropped, returns number of not dropped
+static uint64_t fill(SharedCtx & ctx, const uint64_t & first, const uint64_t & count)
+{
+    uint64_t pushed = 0;
+    for(uint64_t value = first; value < first + count; value++) {
+        pushed += ctx.push((uint8_t *)&value, sizeof(value));
+    }
+    return pushed;
+}
+
+// Reads values while they follow `next`, returns number of them
+static uint64_t readValues(SharedCircularBuffer & chan, uint64_t & next)
+{
+    uint64_t count = 0;
+    uint8_t buffer[64];
+    uint32_t len = sizeof(buffer);
+    while(chan.pop(buffer, len)) {
+        uint64_t value;
+        memcpy(&value, buffer, sizeof(value));
+        if(len != sizeof(value) || value != next) {
+            break;
+        }
+        next++;
+        count++;
+        len = sizeof(buffer);
+    }
+    return count;
+}
+
+int main()
+{
+    server.create();
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    client.reset(new SharedClient(socket_path));
+    ss_cmd cmd;
+    CHECK(client->create() && client->init() && client->waitAck(cmd));
+
+    runTest("local socket is private and not taken over by second server", []() {
+        struct stat st;
+        CHECK(stat(socket_path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode) && (st.st_mode & 0777) == 0600);
+        {
+            SharedServer second(socket_path);
+            CHECK(!second.create());
+        }
+        // Socket file of the first server is still there and answers
+        SharedClient other(socket_path);
+        ss_cmd cmd;
+        CHECK(other.create() && other.init() && other.waitAck(cmd));
+    });
+
+    runTest("full ring goes through backpressure policy", []() {
+        ss_chan_params params;
+        params.shm_size = 64 * 1024;
+        params.ring = SharedCircularBuffer::Ring::MPMC;
+        params.slot_size = 16;
+        ss_bind_params bind;
+
+        // Drop newest: ring keeps the first records
+        SharedCtx newest("shm_test_policy_newest", 1, ss_direction::SS_WRITE, params);
+        SharedCircularBuffer newest_chan("shm_test_policy_newest");
+        uint64_t capacity = newest.stats().capacity;
+        CHECK(fill(newest, 0, capacity + 100) == capacity);
+        auto stats = newest.stats();
+        CHECK(stats.enqueued == capacity && stats.dropped == 100 && stats.high_watermark == capacity);
+        uint64_t next = 0;
+        CHECK(readValues(newest_chan, next) == capacity && next == capacity);
+
+        // Drop oldest: ring keeps the last records
+        SharedCtx oldest("shm_test_policy_oldest", 2, ss_direction::SS_WRITE, params);
+        SharedCircularBuffer oldest_chan("shm_test_policy_oldest");
+        bind.policy = ss_backpressure::SS_DROP_OLDEST;
+        CHECK(oldest.supports(bind.policy));
+        oldest.setBackpressure(bind);
+        CHECK(fill(oldest, 0, capacity + 100) == capacity + 100);
+        stats = oldest.stats();
+        CHECK(stats.enqueued == capacity + 100 && stats.dropped == 100 && stats.high_watermark == capacity);
+        next = 100;
+        CHECK(readValues(oldest_chan, next) == capacity && next == capacity + 100);
+
+        // Spill: records over ring wait in queue, the ones over queue are dropped
+        params.ring = SharedCircularBuffer::Ring::SPSC;
+        SharedCtx spill("shm_test_policy_spill", 3, ss_direction::SS_WRITE, params);
+        SharedCircularBuffer spill_chan("shm_test_policy_spill");
+        bind.policy = ss_backpressure::SS_SPILL;
+        bind.spill_size = 100;
+        CHECK(spill.supports(bind.policy));
+        spill.setBackpressure(bind);
+        uint64_t sent = fill(spill, 0, 100000);
+        stats = spill.stats();
+        CHECK(stats.spilled == 100 && spill.spilling());
+        CHECK(stats.enqueued + stats.spilled == sent && stats.enqueued + stats.spilled + stats.dropped == 100000);
+        CHECK(stats.high_watermark > stats.capacity * 9 / 10 && stats.high_watermark <= stats.capacity);
+        next = 0;
+        CHECK(readValues(spill_chan, next) == stats.enqueued);
+        CHECK(spill.flush() && !spill.spilling());
+        CHECK(readValues(spill_chan, next) == 100 && next == sent);
+        stats = spill.stats();
+        CHECK(stats.enqueued == sent && stats.spilled == 0);
+        // Ring is free again, sender pushes to it directly
+        CHECK(fill(spill, next, 1) == 1 && readValues(spill_chan, next) == 1);
+    });
+
+    runTest("replies wait for client which doesn't read them", []() {
+        SharedClient slow(socket_path);
+        CHECK(slow.create());
+        // Far more replies than socket buffer takes
+        const size_t count = 2000;
+        for(size_t i = 0; i < count; i++) {
+            slow.init();
+        }
+        ss_chan_params params;
+        params.shm_size = 64 * 1024;
+        CHECK(slow.newRChan("shm_test_slow", params));
+
+        ss_cmd cmd;
+        size_t acks = 0;
+        while(acks < count && slow.waitAck(cmd) && (ss_proto)cmd.cmd == ss_proto::SS_ACK) {
+            acks++;
+        }
+        CHECK(acks == count);
+        // Channel descriptor waited with its reply
+        CHECK(slow.waitAck(cmd) && (ss_proto)cmd.cmd == ss_proto::SS_ACK);
+        auto fd = slow.takeChanFd();
+        CHECK(fd >= 0);
+        if(fd >= 0) {
+            SharedCircularBuffer chan(fd, cmd.text);
+        }
+    });
+
+    runTest("local channel gets messages of bound hash", []() {
+        ss_chan_params params;
+        params.shm_size = 64 * 1024;
+        shm_id_t id;
+        auto chan = newChannel(params, id);
+        CHECK(chan != nullptr);
+        if(!chan) {
+            return;
+        }
+        CHECK(client->bindChan(id, 0x42) && acked());
+
+        for(uint64_t value = 0; value < 100; value++) {
+            CHECK(server.send(0x42, (uint8_t *)&value, sizeof(value)));
+        }
+        CHECK(!server.send(0x43, (uint8_t *)&id, sizeof(id)));
+
+        uint32_t len;
+        uint64_t expected = 0;
+        while(auto record = chan->pop(len)) {
+            CHECK(len == sizeof(uint64_t) && !memcmp(record, &expected, len));
+            expected++;
+        }
+        CHECK(expected == 100);
+        CHECK(client->closeChan(id) && acked());
+        CHECK(!server.send(0x42, (uint8_t *)&id, sizeof(id)));
+    });
+
+    runTest("framed channel packs messages to frames", []() {
+        ss_chan_params params;
+        params.shm_size = 64 * 1024;
+        params.frame_size = 1024;
+        params.frame_usecs = 1000;
+        shm_id_t id;
+        auto chan = newChannel(params, id);
+        CHECK(chan != nullptr);
+        if(!chan) {
+            return;
+        }
+        CHECK(client->bindChan(id, 0x50) && acked());
+
+        const uint64_t count = 1000;
+        uint8_t message[40] = { 0 };
+        for(uint64_t value = 0; value < count; value++) {
+            memcpy(message, &value, sizeof(value));
+            CHECK(server.send(0x50, message, sizeof(value) + value % 32));
+        }
+
+        uint64_t expected = 0, frames = 0;
+        auto readFrames = [&]() {
+            SharedCircularBuffer::Record record;
+            while(chan->peek(record)) {
+                FrameReader reader(record.data, record.length);
+                const uint8_t * data;
+                uint32_t len;
+                while(reader.next(data, len)) {
+                    CHECK(len == sizeof(uint64_t) + expected % 32 && !memcmp(data, &expected, sizeof(expected)));
+                    expected++;
+                }
+                frames++;
+                chan->release(record);
+            }
+        };
+        readFrames();
+        CHECK(frames > 1 && frames < count / 10);
+        // The last frame is open until its deadline
+        CHECK(expected < count);
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        server.flush();
+        readFrames();
+        CHECK(expected == count);
+
+        // Records of framed channel are frames only, Ref records of subscription don't fit there
+        ss_cmd cmd;
+        CHECK(client->subscribe(id, 0, 0) && client->waitAck(cmd) && (ss_proto)cmd.cmd == ss_proto::SS_NACK);
+        CHECK(client->closeChan(id) && acked());
+    });
+
+    runTest("subscriber reads published payload from slab", []() {
+        ss_chan_params params;
+        params.shm_size = 64 * 1024;
+        shm_id_t id;
+        auto chan = newChannel(params, id);
+        CHECK(chan != nullptr);
+        if(!chan) {
+            return;
+        }
+
+        ss_cmd cmd;
+        CHECK(client->subscribe(id, 0xFF, 0x12) && client->waitAck(cmd));
+        CHECK((ss_proto)cmd.cmd == ss_proto::SS_ACK);
+        if((ss_proto)cmd.cmd != ss_proto::SS_ACK) {
+            return;
+        }
+        SharedPayloadSlab slab(cmd.text);
+
+        const char payload[] = "payload for every subscriber";
+        CHECK(server.publish(0x3412, (const uint8_t *)payload, sizeof(payload)) == 1);
+        CHECK(server.publish(0x3413, (const uint8_t *)payload, sizeof(payload)) == 0);
+
+        uint32_t len;
+        auto record = chan->pop(len);
+        CHECK(record && len == sizeof(PayloadSlab::Ref));
+        if(record) {
+            PayloadSlab::Ref ref;
+            memcpy(&ref, record, sizeof(ref));
+            CHECK(ref.length == sizeof(payload) && !memcmp(slab.slab().data(ref.chunk), payload, sizeof(payload)));
+            slab.slab().release(ref.chunk);
+        }
+        CHECK(chan->pop(len) == nullptr);
+        CHECK(client->closeChan(id) && acked());
+    });
+
+    server.stop();
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    shared_memory_object::remove("shm_ss_slab");
+    for(auto name : { "shm_test_policy_newest", "shm_test_policy_oldest", "shm_test_policy_spill" }) {
+        shared_memory_object::remove(name);
+    }
+    return testResult();
+}
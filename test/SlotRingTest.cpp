@@ -0,0 +1,109 @@
+// Copyright: https://github.com/mikerez/mediaroom/blob/main/LICENSE
+
+#include "Test.h"
+#include "SlotRing.h"
+
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+
+int main()
+{
+    runTest("capacity, full and empty ring", []() {
+        uint8_t * mem = (uint8_t *)aligned_alloc(64, 4096);
+        SlotRing ring;
+        ring.set(mem, 4096, 100);
+        ring.clear();
+        CHECK(ring.slotData() >= 100);
+        CHECK((ring.capacity() & (ring.capacity() - 1)) == 0);
+        CHECK(sizeof(SlotRingDescriptor) + ring.capacity() * SlotRing::slotSize(100) <= 4096);
+
+        uint8_t data[100] = { 0 };
+        CHECK(!ring.write1(data, ring.slotData() + 1));
+        for(size_t i = 0; i < ring.capacity(); i++) {
+            data[0] = (uint8_t)i;
+            CHECK(ring.write1(data, i % 100 + 1));
+        }
+        CHECK(!ring.write1(data, 1));
+        CHECK(ring.length() == ring.capacity());
+
+        for(size_t i = 0; i < ring.capacity(); i++) {
+            uint32_t len = sizeof(data);
+            CHECK(ring.read1(data, len));
+            CHECK(len == i % 100 + 1 && data[0] == (uint8_t)i);
+        }
+        uint32_t len = sizeof(data);
+        CHECK(!ring.read1(data, len));
+        free(mem);
+    });
+
+    runTest("burst reserve and peek keep order", []() {
+        uint8_t * mem = (uint8_t *)aligned_alloc(64, 4096);
+        SlotRing ring;
+        ring.set(mem, 4096, 8);
+        ring.clear();
+
+        uint32_t next_write = 0, next_read = 0;
+        for(int round = 0; round < 100; round++) {
+            size_t ticket;
+            size_t n = ring.reserveBurst(7, ticket);
+            for(size_t i = 0; i < n; i++) {
+                memcpy(ring.data(ticket + i), &next_write, sizeof(next_write));
+                ring.commit(ticket + i, sizeof(next_write));
+                next_write++;
+            }
+            n = ring.peekBurst(5, ticket);
+            for(size_t i = 0; i < n; i++) {
+                uint32_t len;
+                auto record = ring.record(ticket + i, len);
+                CHECK(len == sizeof(uint32_t) && *(const uint32_t *)record == next_read);
+                ring.release(ticket + i);
+                next_read++;
+            }
+        }
+        CHECK(next_write > ring.capacity() && next_read > ring.capacity());
+        CHECK(ring.length() == next_write - next_read);
+        free(mem);
+    });
+
+    runTest("every record is taken exactly once by concurrent sides", []() {
+        uint8_t * mem = (uint8_t *)aligned_alloc(64, 1 << 16);
+        SlotRing ring;
+        ring.set(mem, 1 << 16, sizeof(uint32_t));
+        ring.clear();
+
+        const uint32_t producers = 2, consumers = 2, per_producer = 100000;
+        std::vector<std::atomic<uint8_t>> seen(producers * per_producer);
+        std::atomic<uint32_t> taken(0);
+        std::vector<std::thread> threads;
+        for(uint32_t p = 0; p < producers; p++) {
+            threads.emplace_back([&, p]() {
+                for(uint32_t i = p * per_producer; i < (p + 1) * per_producer; ) {
+                    i += ring.write1((const uint8_t *)&i, sizeof(i));
+                }
+            });
+        }
+        for(uint32_t c = 0; c < consumers; c++) {
+            threads.emplace_back([&]() {
+                while(taken.load() < producers * per_producer) {
+                    uint32_t value, len = sizeof(value);
+                    if(ring.read1((uint8_t *)&value, len)) {
+                        seen[value]++;
+                        taken++;
+                    }
+                }
+            });
+        }
+        for(auto & thread : threads) {
+            thread.join();
+        }
+        bool once = true;
+        for(auto & count : seen) {
+            once = once && count.load() == 1;
+        }
+        CHECK(once);
+        free(mem);
+    });
+
+    return testResult();
+}
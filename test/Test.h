@@ -0,0 +1,42 @@
+// Copyright: https://github.com/mikerez/mediaroom/blob/main/LICENSE
+
+#pragma once
+
+#include <stdio.h>
+#include <exception>
+
+/*
+ * Minimal test harness: every test binary is a ctest case, CHECK failures are printed and counted,
+ * main returns non-zero if any check failed or test threw.
+ */
+inline int & testFailures()
+{
+    static int failures = 0;
+    return failures;
+}
+
+#define CHECK(cond) \
+    do { \
+        if(!(cond)) { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            testFailures()++; \
+        } \
+    } while(0)
+
+template<typename F>
+void runTest(const char * name, F && test)
+{
+    int failures = testFailures();
+    try {
+        test();
+    }  catch (std::exception &e) {
+        fprintf(stderr, "%s: exception %s\n", name, e.what());
+        testFailures()++;
+    }
+    printf("%s %s\n", testFailures() == failures ? "[  OK  ]" : "[FAILED]", name);
+}
+
+inline int testResult()
+{
+    return testFailures() ? 1 : 0;
+}
@@ -0,0 +1,88 @@
+// Copyright: https://github.com/mikerez/mediaroom/blob/main/LICENSE
+
+#include "Test.h"
+#include "TimerWheel.h"
+
+#include <vector>
+#include <random>
+
+typedef TimerWheel<4, 4> wheel_t;
+
+int main()
+{
+    runTest("fires in order and never early", []() {
+        wheel_t wheel(10, 0);
+        std::vector<wheel_t::Node> nodes(1000);
+        std::mt19937 rnd(1);
+        for(auto & node : nodes) {
+            wheel.schedule(&node, rnd() % 2000000);
+        }
+        CHECK(wheel.size() == nodes.size());
+
+        size_t fired = 0;
+        wheel_t::usecs_t last = 0;
+        for(wheel_t::usecs_t now = 0; now <= 2000000 + 10; now += 777) {
+            fired += wheel.advance(now, [&](wheel_t::Node * node) {
+                CHECK(node->expireTs() <= now);
+                CHECK(node->expireTs() + 777 + 10 > now);
+                CHECK((node->expireTs() + 9) / 10 >= (last + 9) / 10);
+                last = node->expireTs();
+            });
+        }
+        CHECK(fired == nodes.size());
+        CHECK(wheel.size() == 0);
+    });
+
+    runTest("reschedule and cancel keep size", []() {
+        wheel_t wheel(1, 0);
+        wheel_t::Node a, b;
+        wheel.schedule(&a, 100);
+        wheel.schedule(&a, 200);
+        wheel.schedule(&a, 50);
+        CHECK(wheel.size() == 1);
+        wheel.schedule(&b, 60);
+        wheel.cancel(&b);
+        wheel.cancel(&b);
+        CHECK(wheel.size() == 1);
+
+        size_t fired = wheel.advance(49, [](wheel_t::Node *) {});
+        CHECK(fired == 0);
+        fired = wheel.advance(50, [&](wheel_t::Node * node) { CHECK(node == &a); });
+        CHECK(fired == 1);
+        CHECK(wheel.size() == 0);
+        CHECK(!a.scheduled());
+    });
+
+    runTest("empty wheel jumps, timer beyond range is recascaded", []() {
+        wheel_t wheel(1, 0);
+        CHECK(wheel.advance(1000000, [](wheel_t::Node *) {}) == 0);
+
+        // Range of TimerWheel<4, 4> is 2^16 ticks
+        wheel_t::Node far;
+        wheel.schedule(&far, 1000000 + 300000);
+        size_t fired = 0;
+        for(wheel_t::usecs_t now = 1000000; now < 1000000 + 400000; now += 1000) {
+            fired += wheel.advance(now, [&](wheel_t::Node * node) { CHECK(node->expireTs() <= now); });
+            CHECK(fired || now < 1000000 + 300000);
+        }
+        CHECK(fired == 1);
+    });
+
+    runTest("timer scheduled again from callback", []() {
+        wheel_t wheel(1, 0);
+        wheel_t::Node node;
+        wheel.schedule(&node, 10);
+        size_t fired = 0;
+        for(wheel_t::usecs_t now = 0; now <= 100; now++) {
+            fired += wheel.advance(now, [&](wheel_t::Node * n) {
+                if(fired < 4) {
+                    wheel.schedule(n, now + 10);
+                }
+            });
+        }
+        CHECK(fired == 5);
+        CHECK(wheel.size() == 0);
+    });
+
+    return testResult();
+}